@@ -0,0 +1,196 @@
+#!/usr/bin/python
+import sys
+import os
+import time
+import recutils
+import pyrec
+
+# Scale factor applied to movies.rec.  Can be given as the first
+# argument of the script.
+SCALE = 200
+if len(sys.argv) > 1:
+	SCALE = int(sys.argv[1])
+
+BIGFILE = "movies_big.rec"
+
+def make_big_file(scale):
+	"""Write BIGFILE, holding the records of movies.rec SCALE times."""
+	text = open("movies.rec").read()
+	(descriptor, body) = text.split("\n\n", 1)
+	out = open(BIGFILE, "w")
+	out.write(descriptor + "\n\n")
+	for i in range(0, scale):
+		out.write(body.rstrip("\n") + "\n\n")
+	out.close()
+
+def timeit(label, func, repeat=3):
+	best = None
+	for i in range(0, repeat):
+		start = time.time()
+		func()
+		elapsed = time.time() - start
+		if best is None or elapsed < best:
+			best = elapsed
+	print "%-40s %8.3f s" % (label, best)
+	return best
+
+print "CREATING %s (movies.rec x %d)" % (BIGFILE, SCALE)
+make_big_file(SCALE)
+print "Size = %d bytes" % os.path.getsize(BIGFILE)
+
+print "\nLOADING"
+def load_stdio():
+	db = recutils.recdb()
+	db.pyloadfile(BIGFILE)
+def load_mmap():
+	db = recutils.recdb()
+	db.pyloadfile(BIGFILE, mmap=True)
+t_stdio = timeit("pyloadfile (stdio)", load_stdio)
+t_mmap = timeit("pyloadfile (mmap)", load_mmap)
+print "mmap speedup = %.2fx" % (t_stdio / t_mmap)
+def load_lazy():
+	db = recutils.recdb()
+	db.pyloadfile(BIGFILE, lazy=True)
+timeit("pyloadfile (lazy, nothing parsed)", load_lazy)
+SNAPFILE = "movies_big.snap"
+db = recutils.recdb()
+db.pyloadfile(BIGFILE, mmap=True)
+db.save_snapshot(SNAPFILE)
+def load_snapshot():
+	db = recutils.recdb()
+	db.load_snapshot(SNAPFILE)
+t_snap = timeit("load_snapshot", load_snapshot)
+print "snapshot speedup = %.2fx" % (t_stdio / t_snap)
+os.remove(SNAPFILE)
+
+db = recutils.recdb()
+db.pyloadfile(BIGFILE, mmap=True)
+rs = db.get_rset_by_type("movies")
+print "Records = %d" % rs.num_records()
+
+print "\nCONVERTING TO PYTHON DATA"
+def dicts_python():
+	result = []
+	for rec in rs:
+		d = {}
+		for fl in rec:
+			d[fl.name()] = fl.value()
+		result.append(d)
+def dicts_native():
+	rs.to_dicts()
+t_python = timeit("per-field calls", dicts_python)
+t_native = timeit("rset.to_dicts()", dicts_native)
+print "to_dicts speedup = %.2fx" % (t_python / t_native)
+
+print "\nPOINT QUERIES"
+sexid = recutils.sex(0)
+sexid.pycompile("Id = 19")
+def query_scan():
+	for i in range(0, 100):
+		db.query("movies", None, None, sexid, None, 0, None, None, None, None, 0)
+t_scan = timeit("100 x query Id = 19 (scan)", query_scan, 1)
+db.create_index("movies", "Id")
+t_index = timeit("100 x query Id = 19 (hash index)", query_scan, 1)
+print "hash index speedup = %.2fx" % (t_scan / t_index)
+
+print "\nRANGE QUERIES"
+sexrange = recutils.sex(0)
+sexrange.pycompile("Date > 1990 && Date < 2000")
+sortdate = recutils.fex("Date", 0)
+def query_range():
+	for i in range(0, 10):
+		db.query("movies", None, None, sexrange, None, 0, None, None, None, sortdate, 0)
+t_scan = timeit("10 x range query sorted by Date (scan)", query_range, 1)
+db.create_index("movies", "Date", "ordered")
+t_index = timeit("10 x range query sorted by Date (ordered index)", query_range, 1)
+print "ordered index speedup = %.2fx" % (t_scan / t_index)
+
+print "\nTOP-K QUERIES"
+sortrating = recutils.fex("Rating", 0)
+t_sort = timeit("query sorted by Rating, first 20 cut", lambda: list(db.query("movies", None, None, None, None, 0, None, None, None, sortrating, 0))[:20], 1)
+t_heap = timeit("query sorted by Rating, limit=20", lambda: db.query("movies", None, None, None, None, 0, None, None, None, sortrating, 0, limit=20), 1)
+print "bounded heap speedup = %.2fx" % (t_sort / t_heap)
+
+print "\nPAGINATION"
+def pages_query():
+	for i in range(0, 10):
+		db.query("movies", None, None, sexrange, None, 0, None, None, None, None, 0, limit=20, offset=i * 20)
+def pages_cursor():
+	cur = db.cursor("movies", sexrange)
+	for i in range(0, 10):
+		cur.fetch(20)
+t_query = timeit("10 pages of 20 (query with offset)", pages_query)
+t_cursor = timeit("10 pages of 20 (cursor)", pages_cursor)
+print "cursor speedup = %.2fx" % (t_query / t_cursor)
+
+print "\nSEX EVALUATION"
+# Subscripted field references are left to the librec evaluator, so
+# Date[0] gives the same results as Date without the bytecode.
+sexast = recutils.sex(0)
+sexast.pycompile("Date[0] > 1990 && Date[0] < 2000 && Id[0] != 0")
+sexcode = recutils.sex(0)
+sexcode.pycompile("Date > 1990 && Date < 2000 && Id != 0")
+def eval_ast():
+	sexast.eval_many(rs)
+def eval_code():
+	sexcode.eval_many(rs)
+t_ast = timeit("eval_many (librec evaluator)", eval_ast)
+t_code = timeit("eval_many (bytecode)", eval_code)
+print "bytecode speedup = %.2fx" % (t_ast / t_code)
+
+print "\nFAST STRING QUERIES"
+def query_fast():
+	for i in range(0, 10):
+		db.query("movies", None, None, None, "Germ", 0, None, None, None, None, 0)
+timeit("10 x query fast_string 'Germ'", query_fast, 1)
+
+print "\nMULTI-THREADED QUERIES"
+sexrating = recutils.sex(0)
+sexrating.pycompile("Date[0] > 1990")
+def query_threads(n):
+	return lambda: db.query("movies", None, None, sexrating, None, 0, None, None, None, None, 0, threads=n)
+t_one = timeit("full scan query (1 thread)", query_threads(1))
+t_all = timeit("full scan query (all processors)", query_threads(0))
+print "threads speedup = %.2fx" % (t_one / t_all)
+
+print "\nWRITING"
+OUTFILE = "movies_out.rec"
+for (atomic, mode) in [(False, "none"), (True, "none"), (True, "data"), (True, "full")]:
+	def write():
+		db.pywritefile(OUTFILE, atomic=atomic, fsync=mode)
+	t = timeit("pywritefile (atomic=%s, fsync=%s)" % (atomic, mode), write)
+	print "%-40s %8.1f MB/s" % ("", os.path.getsize(OUTFILE) / t / 1e6)
+os.remove(OUTFILE)
+
+print "\nJOINS"
+JOINFILE = "orders_big.rec"
+ncustomers = SCALE * 50
+out = open(JOINFILE, "w")
+out.write("%rec: Customer\n%key: Id\n\n")
+for i in range(0, ncustomers):
+	out.write("Id: %d\nName: Customer %d\n\n" % (i, i))
+out.write("%rec: Order\n%type: Customer rec Customer\n\n")
+for i in range(0, ncustomers * 10):
+	out.write("Id: %d\nCustomer: %d\nAmount: %d\n\n" % (i, (i * 7919) % ncustomers, i % 100))
+out.close()
+dbjoin = recutils.recdb()
+dbjoin.pyloadfile(JOINFILE)
+sexamount = recutils.sex(0)
+sexamount.pycompile("Amount > 90")
+t = timeit("join %d orders with %d customers" % (ncustomers * 10, ncustomers), lambda: dbjoin.query("Order", "Customer", None, sexamount, None, 0, None, None, None, None, 0), 1)
+os.remove(JOINFILE)
+
+print "\nAGGREGATION"
+fexcountry = recutils.fex("Country", 0)
+timeit("aggregate by Country (Count, Avg, Max)", lambda: db.aggregate("movies", fexcountry, ["Count(Id)", "Avg(Rating)", "Max(Date)"]))
+
+print "\nREADING RECORDS BY NUMBER"
+nrecords = rs.num_records()
+timeit("read_record (building the sidecar)", lambda: recutils.read_record(BIGFILE, "movies", 0), 1)
+def read_records():
+	for i in range(0, 1000):
+		recutils.read_record(BIGFILE, "movies", (i * 7919) % nrecords)
+timeit("1000 x read_record", read_records)
+os.remove(BIGFILE + ".recidx")
+
+os.remove(BIGFILE)
@@ -7,21 +7,21 @@ class Recdb(recutils.recdb):
  	def __init__(self):
 		pass
 
-	def loadfile(self, filename):
+	def loadfile(self, filename, mmap=False):
 		try:
-			self.pyloadfile(filename)	
+			self.pyloadfile(filename, mmap)	
 		except recutils.error as e:
 			print 'File load failed:', e
 
-	def writefile(self, filename):
+	def writefile(self, filename, atomic=False, fsync="none"):
 		try:
-			self.pywritefile(filename)	
+			self.pywritefile(filename, atomic, fsync)	
 		except recutils.error as e:
 			print 'File write failed:', e
 
-	def appendfile(self, filename):
+	def appendfile(self, filename, mmap=False):
 		try:
-			self.pyappendfile(filename)	
+			self.pyappendfile(filename, mmap)	
 		except recutils.error as e:
 			print 'File append failed:', e
 
@@ -1,5 +1,6 @@
 #!/usr/bin/python
 import sys	
+import struct
 import recutils
 import pyrec
 
@@ -39,6 +40,14 @@ print "\nGETTING NUMBER OF FIELDS IN THE DESCRIPTOR (RECORD)"
 num_fields = desc.num_fields()
 print "Number of fields is",num_fields
 
+print "\nITERATING OVER THE RECORDS OF AN RSET"
+num_rec = 0
+for rec in recset:
+	num_rec = num_rec + 1
+	for fl in rec:
+		print fl.name(), "=", fl.value()
+print "Number of records iterated = ", num_rec
+
 print "\nCHECKING FOR A FIELD VALUE IN A RECORD"
 fname = desc.contains_value("Login",1)
 print fname
@@ -59,10 +68,98 @@ print "\nGETTING THE RSET BY TYPE"
 rsettype = db2.get_rset_by_type("Account")
 print "Got rset by type"
 
-
-
-
-
-
-
-
+print "\nEXPORTING COLUMNS FROM AN RSET"
+movies = db1.get_rset_by_type("movies")
+cols = movies.to_columns(recutils.fex("Rating,Date,Title", 1),
+                         types={"Rating": "int", "Date": "int"})
+ratings = memoryview(cols["Rating"])
+print "Number of ratings = ", len(ratings), "format = ", ratings.format
+(offsets, data) = cols["Title"]
+print "Number of titles = ", len(offsets) - 1
+viewed = memoryview(movies.to_columns(recutils.fex("Viewed", 1), types={"Viewed": "bool"})["Viewed"])
+print "Movies viewed = ", sum(struct.unpack("%dq" % len(viewed), viewed.tobytes()))
+
+print "\nEVALUATING A SEX OVER A WHOLE RSET"
+sexg = recutils.sex(1)
+sexg.pycompile("Audio = 'German'")
+mask = sexg.eval_many(movies)
+num_rec = 0
+for byte in mask:
+	num_rec = num_rec + bin(ord(byte)).count("1")
+print "Number of matching records = ", num_rec
+sexno = recutils.sex(0)
+sexno.pycompile("Date < 0")
+sexyes = recutils.sex(0)
+sexyes.pycompile("Date > 0")
+first = list(movies)[0]
+print "pyeval on a non-matching record = ", sexno.pyeval(first, 0)
+print "pyeval on a matching record = ", sexyes.pyeval(first, 0)
+
+print "\nSCANNING A FILE FOR MATCHING RECORDS"
+sex1 = recutils.sex(1)
+sex1.pycompile("Audio = 'German'")
+fex1 = recutils.fex("Title", 0)
+num_rec = 0
+for rec in recutils.scan(string1, "movies", sex1, fex1):
+	num_rec = num_rec + 1
+print "Number of scanned records = ", num_rec
+
+print "\nREADING A RECORD BY NUMBER"
+rec = recutils.read_record(string1, "movies", 2)
+print "Same fields as the parsed record = ", [fl.value() for fl in rec] == [fl.value() for fl in list(movies)[2]]
+print "Record past the end = ", recutils.read_record(string1, "movies", movies.num_records())
+
+print "\nSORTING BY A FIELD THE PROJECTION DROPS"
+sexdate = recutils.sex(0)
+sexdate.pycompile("Date > 0")
+fextitle = recutils.fex("Title", 0)
+fexdate0 = recutils.fex("Date", 0)
+titles = db1.query("movies", None, None, sexdate, None, 0, fextitle, None, None, fexdate0, 0)
+whole = db1.query("movies", None, None, sexdate, None, 0, None, None, None, fexdate0, 0)
+print "Sorted like the whole records = ", [[fl.value() for fl in r] for r in titles] == [[fl.value() for fl in r if fl.name() == "Title"] for r in whole]
+
+print "\nSORTING WITH AN ORDERED INDEX"
+fexrating = recutils.fex("Rating", 0)
+sexlow = recutils.sex(0)
+sexlow.pycompile("Rating < 5")
+unindexed = [[fl.value() for fl in r] for r in db1.query("movies", None, None, None, None, 0, None, None, None, fexrating, 0)]
+lowunindexed = db1.query("movies", None, None, sexlow, None, 0, None, None, None, None, 0).num_records()
+db1.create_index("movies", "Rating", "ordered")
+indexed = [[fl.value() for fl in r] for r in db1.query("movies", None, None, None, None, 0, None, None, None, fexrating, 0)]
+print "Same order with the index = ", indexed == unindexed
+lowindexed = db1.query("movies", None, None, sexlow, None, 0, None, None, None, None, 0).num_records()
+print "Same records without a rating with the index = ", lowindexed == lowunindexed
+
+print "\nSELECTING WITH A HASH INDEX"
+sexfav = recutils.sex(0)
+sexfav.pycompile("Favourite = 0")
+favunindexed = db1.query("movies", None, None, sexfav, None, 0, None, None, None, None, 0).num_records()
+db1.create_index("movies", "Favourite")
+favindexed = db1.query("movies", None, None, sexfav, None, 0, None, None, None, None, 0).num_records()
+print "Same records without the field with the index = ", favindexed == favunindexed
+
+print "\nQUERYING A PAGE OF SORTED RECORDS"
+fexdate = recutils.fex("Date", 0)
+full = db1.query("movies", None, None, None, None, 0, None, None, None, fexdate, 0)
+page = db1.query("movies", None, None, None, None, 0, None, None, None, fexdate, 0, limit=3, offset=2)
+print "Records in the page = ", page.num_records()
+print "Same records as the full query = ", [[fl.value() for fl in r] for r in page] == [[fl.value() for fl in r] for r in list(full)[2:5]]
+empty = db1.query("movies", None, None, None, None, 0, None, None, None, None, 0, limit=0, offset=2)
+print "Records in an empty page = ", empty.num_records()
+
+print "\nPAGING THROUGH SORTED RECORDS WITH A CURSOR"
+cur = db1.cursor("movies", sort_by=fexdate)
+pages = []
+page = cur.fetch(4)
+while page.num_records() > 0:
+	pages.extend([[fl.value() for fl in r] for r in page])
+	page = cur.fetch(4)
+print "Same records as the full query = ", pages == [[fl.value() for fl in r] for r in full]
+
+print "\nAGGREGATING THE RECORDS OF AN RSET"
+fexcountry = recutils.fex("Country", 0)
+groups = db1.aggregate("movies", fexcountry, ["Count(Id)", "Avg(Rating)", "Max(Date)"])
+print "Number of countries = ", len(groups)
+print "Records counted = ", sum([g["Count(Id)"] for g in groups]), "of", movies.num_records()
+total = db1.aggregate("movies", None, ["Count(Id)", "Min(Date)"], sexg)
+print "German movies = ", total[0]["Count(Id)"], "oldest = ", total[0]["Min(Date)"]
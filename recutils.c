@@ -3,31 +3,85 @@
 #include <rec.h>
 #include "structmember.h"
 #include <error.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#if defined (__x86_64__) || defined (__i386__)
+# include <immintrin.h>
+# define RECUTILS_SIMD_X86 1
+#endif
+
+struct recutils_index_s;
+struct recutils_program_s;
+struct recutils_generation_s;
+struct recutils_query_cache_s;
+struct recutils_sync_s;
+struct recutils_wal_s;
+struct recutils_lazy_s;
+
+/* GENERATIONS, EPOCH and MUTATIONS count the mutations made through
+   the methods of the database, see QUERY CACHE below.  APPENDS counts
+   the records appended by insert and SYNC describes the file the
+   database was last saved to, see INCREMENTAL SYNC.  WAL is the
+   write-ahead log bound to the database, if any, see WRITE-AHEAD
+   LOG.  LAZY is the directory of the record sets not parsed yet, see
+   LAZY LOADING.  BUSY counts the multi-threaded queries running with
+   the GIL released, see recutils_check_idle.  */
 
 typedef struct {
     PyObject_HEAD   
     rec_db_t rdb;  
+    struct recutils_index_s *indexes;
+    struct recutils_generation_s *generations;
+    unsigned long epoch;
+    unsigned long mutations;
+    struct recutils_query_cache_s *query_cache;
+    unsigned long appends;
+    struct recutils_sync_s *sync;
+    struct recutils_wal_s *wal;
+    struct recutils_lazy_s *lazy;
+    unsigned int busy;
 } recdb;
 
 
+/* The rset, record and field objects either own the librec object
+   they wrap (OWNER is NULL) or borrow it from a containing object,
+   which is then kept alive in OWNER.  Borrowed objects are never
+   destroyed by the wrapper.  */
+
 typedef struct {
     PyObject_HEAD
     rec_rset_t rst;  
+    PyObject *owner;
 } rset;
 
 typedef struct {
     PyObject_HEAD 
     rec_record_t rcd;  
+    PyObject *owner;
 } record;
 
 typedef struct {
     PyObject_HEAD
     rec_field_t fld;  
+    PyObject *owner;
 } field;
 
+/* EXPR holds the source of the last successfully compiled expression,
+   which lets the indexes recognize the expressions they can answer.
+   PROG is its bytecode, or NULL if the expression can only be
+   evaluated by librec.  Sexes handed out by the sex cache are SHARED
+   and can't be recompiled.  */
+
 typedef struct {
     PyObject_HEAD
     rec_sex_t sx;  
+    char *expr;
+    struct recutils_program_s *prog;
+    bool case_insensitive;
+    bool shared;
 } sex;
 
 typedef struct {
@@ -51,6 +105,64 @@ typedef struct {
     rec_buf_t buf;  
 } buffer;
 
+/* Iterator over the records of an rset or the fields of a record,
+   walking the underlying mset in place.  */
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *owner;
+    rec_mset_iterator_t iter;
+    rec_mset_type_t elem_type;
+    PyTypeObject *item_type;
+} msetiter;
+
+/* Contiguous column of fixed-size items, exposed through the buffer
+   protocol.  FORMAT is a struct module format character.  */
+
+typedef struct {
+    PyObject_HEAD
+    char *data;
+    Py_ssize_t len;
+    Py_ssize_t itemsize;
+    char format[2];
+} column;
+
+/* Generator returned by recutils.scan.  Records are parsed one at a
+   time from IN and discarded unless they are yielded.  */
+
+typedef struct {
+    PyObject_HEAD
+    FILE *in;
+    rec_parser_t parser;
+    char *type;
+    char *cur_type;
+    PyObject *sexp;
+    PyObject *fexp;
+    bool done;
+} scanner;
+
+/* Cursor returned by recdb.cursor, see CURSORS.  DB is the database
+   of the cursor, as of EPOCH and GENERATION.  Unsorted cursors walk
+   ITER, sorted ones resume after LAST, at LAST_POSITION in the record
+   set, or from the start if it is NULL.  */
+
+typedef struct {
+    PyObject_HEAD
+    recdb *db;
+    char *type;
+    PyObject *sexp;
+    char *fast_string;
+    PyObject *fexp;
+    PyObject *sort_by;
+    int flags;
+    unsigned long epoch;
+    unsigned long generation;
+    rec_mset_iterator_t iter;
+    rec_record_t last;
+    size_t last_position;
+    bool done;
+} cursor;
+
 staticforward PyTypeObject rsetType;
 staticforward PyTypeObject recordType;
 staticforward PyTypeObject fexType;
@@ -59,171 +171,5950 @@ staticforward PyTypeObject sexType;
 staticforward PyTypeObject fieldType;
 staticforward PyTypeObject commentType;
 staticforward PyTypeObject bufferType;
+staticforward PyTypeObject msetiterType;
+staticforward PyTypeObject scannerType;
+staticforward PyTypeObject columnType;
+staticforward PyTypeObject cursorType;
 static PyObject *RecError;
 
-/* Create an empty database.  */
+/* Return the selection expression wrapped by SEXP, or NULL if SEXP is
+   None.  */
+
+static rec_sex_t
+recutils_sex (sex *sexp)
+{
+  return (PyObject *) sexp == Py_None ? NULL : sexp->sx;
+}
+
+/* Return the field expression wrapped by FEXP, or NULL if FEXP is
+   None.  */
+
+static rec_fex_t
+recutils_fex (fex *fexp)
+{
+  return (PyObject *) fexp == Py_None ? NULL : fexp->fx;
+}
+
+/* Build a new record holding copies of the fields of RECORD selected
+   by FEX, in the order of the fex elements.  Elements with no min
+   index select every field with that name, otherwise the fields in
+   the [min,max] range are selected.  Fields are renamed if the
+   element specifies a rewrite.  Return NULL if there is not enough
+   memory.  */
+
+static rec_record_t
+recutils_record_project (rec_record_t record, rec_fex_t fex)
+{
+  rec_record_t res;
+  size_t i, j, num;
+  res = rec_record_new ();
+  if (res == NULL)
+    return NULL;
+  for (i = 0; i < rec_fex_size (fex); i++)
+    {
+      rec_fex_elem_t elem = rec_fex_get (fex, i);
+      const char *fname = rec_fex_elem_field_name (elem);
+      const char *rewrite_to = rec_fex_elem_rewrite_to (elem);
+      int min = rec_fex_elem_min (elem);
+      int max = rec_fex_elem_max (elem);
+      num = rec_record_get_num_fields_by_name (record, fname);
+      if (min == -1)
+        {
+          min = 0;
+          max = (int) num - 1;
+        }
+      else if (max == -1)
+        max = min;
+      for (j = min; (int) j <= max && j < num; j++)
+        {
+          rec_field_t fld
+            = rec_field_dup (rec_record_get_field_by_name (record, fname, j));
+          if (fld == NULL
+              || (rewrite_to && !rec_field_set_name (fld, rewrite_to))
+              || !rec_mset_append (rec_record_mset (res), MSET_FIELD,
+                                   (void *) fld, MSET_ANY))
+            {
+              if (fld)
+                rec_field_destroy (fld);
+              rec_record_destroy (res);
+              return NULL;
+            }
+        }
+    }
+  return res;
+}
+
+/* Parse VALUE as an integer as librec would (decimal or 0x-prefixed
+   hexadecimal), storing it in NUM.  Return 'false' if VALUE is not an
+   integer.  */
+
+static bool
+recutils_parse_int (const char *value, long long *num)
+{
+  char *end;
+  const char *p = value + strspn (value, " \t");
+  int base = 10;
+  if (p[0] == '-' || p[0] == '+')
+    p++;
+  if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+    base = 16;
+  errno = 0;
+  *num = strtoll (value, &end, base);
+  if (end == value || errno != 0)
+    return false;
+  return end[strspn (end, " \t\n")] == '\0';
+}
+
+/* Parse VALUE as a real number, storing it in NUM.  Return 'false' if
+   VALUE is not a number.  */
+
+static bool
+recutils_parse_real (const char *value, double *num)
+{
+  char *end;
+  errno = 0;
+  *num = strtod (value, &end);
+  if (end == value || errno != 0)
+    return false;
+  return end[strspn (end, " \t\n")] == '\0';
+}
+
+/* Return the number of threads to use for a job made of NUM_ITEMS
+   independent parts when the user asked for THREADS threads.  A value
+   of THREADS less than 1 means one thread per online processor.  */
+
+static size_t
+recutils_num_threads (int threads, size_t num_items)
+{
+  size_t n;
+  if (threads < 1)
+    {
+      long ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+      threads = ncpus > 0 ? ncpus : 1;
+    }
+  n = threads;
+  if (n > num_items)
+    n = num_items;
+  return n > 0 ? n : 1;
+}
+
+/* Cache of interned Python strings for field names, so that the bulk
+   conversion functions create a single string object per distinct
+   field name instead of one per field.  Record sets have few distinct
+   field names, so a linear search is enough.  */
+
+struct recutils_names_s
+{
+  PyObject **objs;
+  size_t num;
+  size_t allocated;
+};
+
+/* Return a borrowed reference to the interned string for NAME, or
+   NULL with an exception set.  */
 
 static PyObject *
-recdb_new (PyTypeObject *type, PyObject *args, PyObject *kwds)
+recutils_names_get (struct recutils_names_s *names, const char *name)
 {
-  recdb *self;
-  self = (recdb *) type->tp_alloc (type, 0);
-  //Py_INCREF(self);
-  if (self != NULL) 
+  size_t i;
+  PyObject *obj;
+  PyObject **tmp;
+  for (i = 0; i < names->num; i++)
     {
-        self->rdb = rec_db_new();
-        
-        if (self->rdb == NULL) 
-          {
-             /* Out of memory.  */
-            Py_DECREF(self);
-            return NULL;
-          }
+      const char *cached = PyString_AS_STRING (names->objs[i]);
+      if (cached[0] == name[0] && strcmp (cached, name) == 0)
+        return names->objs[i];
     }
-  return (PyObject *)self;
+  if (names->num == names->allocated)
+    {
+      names->allocated = names->allocated ? names->allocated * 2 : 16;
+      tmp = realloc (names->objs, names->allocated * sizeof (PyObject *));
+      if (tmp == NULL)
+        {
+          PyErr_NoMemory ();
+          return NULL;
+        }
+      names->objs = tmp;
+    }
+  obj = PyString_InternFromString (name);
+  if (obj == NULL)
+    return NULL;
+  names->objs[names->num++] = obj;
+  return obj;
 }
 
+static void
+recutils_names_free (struct recutils_names_s *names)
+{
+  size_t i;
+  for (i = 0; i < names->num; i++)
+    Py_DECREF (names->objs[i]);
+  free (names->objs);
+}
 
-/* Destroy a database, freeing any used memory.
+/* Store VALUE under KEY in DICT.  If KEY is already present, because
+   the record features several fields with the same name, the values
+   are collected in a list in the order they appear.  */
+
+static bool
+recutils_dict_add_value (PyObject *dict, PyObject *key, const char *value)
+{
+  PyObject *old, *val, *list;
+  bool success;
+  val = PyString_FromString (value);
+  if (val == NULL)
+    return false;
+  old = PyDict_GetItem (dict, key);
+  if (old == NULL)
+    success = PyDict_SetItem (dict, key, val) == 0;
+  else if (PyList_Check (old))
+    success = PyList_Append (old, val) == 0;
+  else
+    {
+      list = PyList_New (2);
+      success = list != NULL;
+      if (success)
+        {
+          Py_INCREF (old);
+          PyList_SET_ITEM (list, 0, old);
+          Py_INCREF (val);
+          PyList_SET_ITEM (list, 1, val);
+          success = PyDict_SetItem (dict, key, list) == 0;
+          Py_DECREF (list);
+        }
+    }
+  Py_DECREF (val);
+  return success;
+}
+
+/* Convert RECORD into a new dict mapping field names to values.  If
+   FEX is not NULL only the fields it selects are converted, using
+   the same selection rules as recutils_record_project.  */
+
+static PyObject *
+recutils_record_to_dict (rec_record_t record, rec_fex_t fex,
+                         struct recutils_names_s *names)
+{
+  PyObject *dict, *key;
+  rec_mset_iterator_t iter;
+  const void *data;
+  size_t i, j, num;
+
+  dict = PyDict_New ();
+  if (dict == NULL)
+    return NULL;
+  if (fex == NULL)
+    {
+      iter = rec_mset_iterator (rec_record_mset (record));
+      while (rec_mset_iterator_next (&iter, MSET_FIELD, &data, NULL))
+        {
+          rec_field_t fld = (rec_field_t) data;
+          key = recutils_names_get (names, rec_field_name (fld));
+          if (key == NULL
+              || !recutils_dict_add_value (dict, key, rec_field_value (fld)))
+            {
+              rec_mset_iterator_free (&iter);
+              Py_DECREF (dict);
+              return NULL;
+            }
+        }
+      rec_mset_iterator_free (&iter);
+      return dict;
+    }
+
+  for (i = 0; i < rec_fex_size (fex); i++)
+    {
+      rec_fex_elem_t elem = rec_fex_get (fex, i);
+      const char *fname = rec_fex_elem_field_name (elem);
+      const char *rewrite_to = rec_fex_elem_rewrite_to (elem);
+      int min = rec_fex_elem_min (elem);
+      int max = rec_fex_elem_max (elem);
+      num = rec_record_get_num_fields_by_name (record, fname);
+      if (min == -1)
+        {
+          min = 0;
+          max = (int) num - 1;
+        }
+      else if (max == -1)
+        max = min;
+      if (min >= (int) num)
+        continue;
+      key = recutils_names_get (names, rewrite_to ? rewrite_to : fname);
+      if (key == NULL)
+        {
+          Py_DECREF (dict);
+          return NULL;
+        }
+      for (j = min; (int) j <= max && j < num; j++)
+        {
+          rec_field_t fld = rec_record_get_field_by_name (record, fname, j);
+          if (!recutils_dict_add_value (dict, key, rec_field_value (fld)))
+            {
+              Py_DECREF (dict);
+              return NULL;
+            }
+        }
+    }
+  return dict;
+}
+
+/*
+ * INDEXES
  *
- * This means that all the record sets contained in the database are
- * also destroyed.
+ * An index maps the values of a field of some record set to the
+ * records holding them, so that queries selecting records by that
+ * field do not need to scan the whole record set.  Indexes refer to
+ * the records stored in the database.  Mutations which may move or
+ * destroy records mark the affected indexes as stale, and stale
+ * indexes are rebuilt the next time they are used.
  */
 
+/* Hash table mapping strings to lists of records, using separate
+   chaining.  Hash indexes also count the records lacking the field in
+   NUM_MISSING, the values which are not integers in NUM_NON_INT, and
+   among those the reals in NUM_REALS, since librec matches them with
+   equalities the keys do not tell about.  */
+
+struct recutils_hash_entry_s
+{
+  char *key;
+  size_t hash;
+  rec_record_t *records;
+  size_t num_records;
+  size_t allocated;
+  struct recutils_hash_entry_s *next;
+};
+
+struct recutils_hash_s
+{
+  struct recutils_hash_entry_s **buckets;
+  size_t num_buckets;
+  size_t num_entries;
+  size_t num_missing;
+  size_t num_non_int;
+  size_t num_reals;
+};
+
+/* Sorted array of the values of a field, used by ordered indexes.
+   Only the first occurrence of the field in each record is indexed,
+   and NUM_MULTIPLE counts the records featuring it more than once,
+   which librec may match on any occurrence.  Values are compared
+   according to KEY_KIND: as integers, as reals, as dates using the
+   type declared in the record descriptor, or as plain strings.
+   TYPED tells whether KEY_KIND comes from the declared type rather
+   than from the values.  POSITION is the position of the record in
+   its record set, used to return matches in record set order.  */
+
+enum recutils_key_kind_e
+{
+  RECUTILS_KEY_INT,
+  RECUTILS_KEY_REAL,
+  RECUTILS_KEY_DATE,
+  RECUTILS_KEY_STR
+};
+
+struct recutils_key_s
+{
+  long long i;
+  double d;
+  const char *s;
+};
+
+struct recutils_ordered_entry_s
+{
+  struct recutils_key_s key;
+  rec_record_t record;
+  size_t position;
+};
+
+struct recutils_ordered_s
+{
+  struct recutils_ordered_entry_s *entries;
+  size_t num_entries;
+  size_t num_missing;
+  size_t num_multiple;
+  enum recutils_key_kind_e key_kind;
+  rec_type_t type;
+  bool typed;
+};
+
+enum recutils_index_kind_e
+{
+  RECUTILS_INDEX_HASH,
+  RECUTILS_INDEX_ORDERED
+};
+
+struct recutils_index_s
+{
+  char *type;
+  char *field;
+  enum recutils_index_kind_e kind;
+  bool stale;
+  struct recutils_hash_s hash;
+  struct recutils_ordered_s ordered;
+  struct recutils_index_s *next;
+};
+
+/* Prefix of the keys under which the canonical form of integer
+   values is stored, so that numeric comparisons can be answered.  */
+
+#define RECUTILS_INDEX_NUM_PREFIX '\001'
+
+static size_t
+recutils_hash_string (const char *str)
+{
+  /* FNV-1a.  */
+  size_t hash = 2166136261u;
+  for (; *str; str++)
+    {
+      hash ^= (unsigned char) *str;
+      hash *= 16777619u;
+    }
+  return hash;
+}
+
 static void
-recdb_dealloc (recdb* self)
+recutils_hash_clear (struct recutils_hash_s *hash)
 {
-  self->ob_type->tp_free ((PyObject*) self);
+  size_t i;
+  struct recutils_hash_entry_s *entry, *next;
+  for (i = 0; i < hash->num_buckets; i++)
+    for (entry = hash->buckets[i]; entry; entry = next)
+      {
+        next = entry->next;
+        free (entry->key);
+        free (entry->records);
+        free (entry);
+      }
+  free (hash->buckets);
+  hash->buckets = NULL;
+  hash->num_buckets = 0;
+  hash->num_entries = 0;
+  hash->num_missing = 0;
+  hash->num_non_int = 0;
+  hash->num_reals = 0;
 }
 
+/* Return the entry for KEY in HASH, or NULL if there is none.  */
 
-/* Return the number of record sets contained in a given database  */
-static PyObject*
-recdb_size (recdb* self)
+static struct recutils_hash_entry_s *
+recutils_hash_lookup (struct recutils_hash_s *hash, const char *key)
 {
-  int s = rec_db_size (self->rdb);
-  return Py_BuildValue ("i", s);
+  struct recutils_hash_entry_s *entry;
+  size_t h;
+  if (hash->num_buckets == 0)
+    return NULL;
+  h = recutils_hash_string (key);
+  for (entry = hash->buckets[h % hash->num_buckets]; entry; entry = entry->next)
+    if (entry->hash == h && strcmp (entry->key, key) == 0)
+      return entry;
+  return NULL;
 }
 
+static bool
+recutils_hash_grow (struct recutils_hash_s *hash)
+{
+  struct recutils_hash_entry_s **buckets, *entry, *next;
+  size_t num_buckets, i;
+  num_buckets = hash->num_buckets ? hash->num_buckets * 2 : 64;
+  buckets = calloc (num_buckets, sizeof (struct recutils_hash_entry_s *));
+  if (buckets == NULL)
+    return false;
+  for (i = 0; i < hash->num_buckets; i++)
+    for (entry = hash->buckets[i]; entry; entry = next)
+      {
+        next = entry->next;
+        entry->next = buckets[entry->hash % num_buckets];
+        buckets[entry->hash % num_buckets] = entry;
+      }
+  free (hash->buckets);
+  hash->buckets = buckets;
+  hash->num_buckets = num_buckets;
+  return true;
+}
 
-/* Load a file into a Database object */
+/* Add RECORD to the list of records of KEY, unless it is already the
+   last one, which happens when a record holds the same value in
+   several fields.  Return 'false' if there is not enough memory.  */
 
-static PyObject*
-recdb_pyloadfile (recdb *self, PyObject *args, PyObject *kwds)
+static bool
+recutils_hash_add (struct recutils_hash_s *hash, const char *key,
+                   rec_record_t record)
 {
-  char *string = NULL;
-  bool success;
-  rec_parser_t parser;
-  static char *kwlist[] = {"filename", NULL};
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &string)) 
+  struct recutils_hash_entry_s *entry;
+  entry = recutils_hash_lookup (hash, key);
+  if (entry == NULL)
     {
-      return NULL;
+      if (hash->num_entries >= hash->num_buckets * 3 / 4
+          && !recutils_hash_grow (hash))
+        return false;
+      entry = calloc (1, sizeof (struct recutils_hash_entry_s));
+      if (entry == NULL)
+        return false;
+      entry->key = strdup (key);
+      if (entry->key == NULL)
+        {
+          free (entry);
+          return false;
+        }
+      entry->hash = recutils_hash_string (key);
+      entry->next = hash->buckets[entry->hash % hash->num_buckets];
+      hash->buckets[entry->hash % hash->num_buckets] = entry;
+      hash->num_entries++;
     }
-  FILE *in = fopen (string,"r");
-  if (in == NULL)
+  if (entry->num_records > 0
+      && entry->records[entry->num_records - 1] == record)
+    return true;
+  if (entry->num_records == entry->allocated)
     {
-      PyErr_SetString (RecError, strerror (errno));
-      return NULL;
+      rec_record_t *tmp;
+      size_t allocated = entry->allocated ? entry->allocated * 2 : 2;
+      tmp = realloc (entry->records, allocated * sizeof (rec_record_t));
+      if (tmp == NULL)
+        return false;
+      entry->records = tmp;
+      entry->allocated = allocated;
     }
-  parser = rec_parser_new (in, string);
-  rec_db_destroy (self->rdb);
-  success = rec_parse_db (parser, &(self->rdb));
-  if (!success)
+  entry->records[entry->num_records++] = record;
+  return true;
+}
+
+/* Store the canonical decimal form of the integer NUM, prefixed with
+   RECUTILS_INDEX_NUM_PREFIX, in BUF.  */
+
+static void
+recutils_index_num_key (char *buf, size_t size, long long num)
+{
+  snprintf (buf, size, "%c%lld", RECUTILS_INDEX_NUM_PREFIX, num);
+}
+
+/* Add the values of the indexed field in RECORD to the hash index
+   INDEX.  */
+
+static bool
+recutils_index_add_record (struct recutils_index_s *index,
+                           rec_record_t record)
+{
+  size_t i, num;
+  long long n;
+  double d;
+  char numkey[32];
+  num = rec_record_get_num_fields_by_name (record, index->field);
+  if (num == 0)
+    index->hash.num_missing++;
+  for (i = 0; i < num; i++)
     {
-      PyErr_SetString (RecError, "parse error");
-      return NULL;
+      const char *value
+        = rec_field_value (rec_record_get_field_by_name (record,
+                                                         index->field, i));
+      if (!recutils_hash_add (&index->hash, value, record))
+        return false;
+      if (recutils_parse_int (value, &n))
+        {
+          recutils_index_num_key (numkey, sizeof (numkey), n);
+          if (!recutils_hash_add (&index->hash, numkey, record))
+            return false;
+        }
+      else
+        {
+          index->hash.num_non_int++;
+          if (recutils_parse_real (value, &d))
+            index->hash.num_reals++;
+        }
     }
-  fclose (in);
-  rec_parser_destroy (parser);
-  return Py_BuildValue ("");
+  return true;
 }
 
-/* Append a file into a Database object */
+/* Parse VALUE into KEY according to KIND.  Return 'false' if VALUE
+   is not a valid value of that kind.  */
 
-static PyObject*
-recdb_pyappendfile (recdb *self, PyObject *args, PyObject *kwds)
+static bool
+recutils_key_parse (enum recutils_key_kind_e kind, const char *value,
+                    struct recutils_key_s *key)
 {
-  char *string = NULL;
-  bool success = true;
-  char str[100];
-  rec_rset_t res;  
-  rec_parser_t parser;
-  static char *kwlist[] = {"filename", NULL};
-  if (!PyArg_ParseTupleAndKeywords (args, kwds, "s", kwlist, &string)) 
+  key->s = value;
+  switch (kind)
     {
-      return NULL;
+    case RECUTILS_KEY_INT:
+      return recutils_parse_int (value, &key->i);
+    case RECUTILS_KEY_REAL:
+      return recutils_parse_real (value, &key->d);
+    default:
+      return true;
     }
-  FILE *in = fopen (string,"r");
-  if (in == NULL)
+}
+
+static int
+recutils_key_cmp (struct recutils_ordered_s *ordered,
+                  const struct recutils_key_s *key1,
+                  const struct recutils_key_s *key2)
+{
+  switch (ordered->key_kind)
     {
-      PyErr_SetString (RecError, strerror (errno));
-      return NULL;
+    case RECUTILS_KEY_INT:
+      return (key1->i > key2->i) - (key1->i < key2->i);
+    case RECUTILS_KEY_REAL:
+      return (key1->d > key2->d) - (key1->d < key2->d);
+    case RECUTILS_KEY_DATE:
+      return rec_type_values_cmp (ordered->type, key1->s, key2->s);
+    default:
+      return strcmp (key1->s, key2->s);
     }
-  parser = rec_parser_new (in, string);
-  while (rec_parse_rset (parser, &res))
+}
+
+/* qsort has no context argument, and indexes are only built with the
+   GIL held, so the index being sorted is passed in a static.  */
+
+static struct recutils_ordered_s *recutils_sorting;
+
+static int
+recutils_ordered_entry_cmp (const void *p1, const void *p2)
+{
+  const struct recutils_ordered_entry_s *e1 = p1, *e2 = p2;
+  int res = recutils_key_cmp (recutils_sorting, &e1->key, &e2->key);
+  if (res == 0)
+    res = (e1->position > e2->position) - (e1->position < e2->position);
+  return res;
+}
+
+/* Choose how to compare the values of the field of the ordered index
+   INDEX in RSET: by the type declared in the descriptor if there is
+   one, otherwise as integers or reals if every value parses as such,
+   and as strings if not.  */
+
+static enum recutils_key_kind_e
+recutils_ordered_key_kind (struct recutils_index_s *index, rec_rset_t rset)
+{
+  rec_mset_iterator_t iter;
+  const void *data;
+  rec_field_t fld;
+  struct recutils_key_s key;
+  bool ints = true, reals = true;
+
+  index->ordered.type = rec_rset_get_field_type (rset, index->field);
+  index->ordered.typed = true;
+  if (index->ordered.type)
+    switch (rec_type_kind (index->ordered.type))
+      {
+      case REC_TYPE_INT:
+      case REC_TYPE_RANGE:
+      case REC_TYPE_SIZE:
+        return RECUTILS_KEY_INT;
+      case REC_TYPE_REAL:
+        return RECUTILS_KEY_REAL;
+      case REC_TYPE_DATE:
+        return RECUTILS_KEY_DATE;
+      default:
+        break;
+      }
+  index->ordered.typed = false;
+
+  iter = rec_mset_iterator (rec_rset_mset (rset));
+  while ((ints || reals)
+         && rec_mset_iterator_next (&iter, MSET_RECORD, &data, NULL))
     {
-      char *rset_type;
-      /* XXX: check for consistency!!!.  */
-      rset_type = rec_rset_type (res);
-      if (rec_db_type_p (self->rdb, rset_type))
-        {
-          sprintf (str,"Duplicated record set '%s' from %s.",rset_type, string);
-          PyErr_SetString (RecError, str);
-          return NULL;
-        }
+      fld = rec_record_get_field_by_name ((rec_record_t) data,
+                                          index->field, 0);
+      if (fld == NULL)
+        continue;
+      ints = ints && recutils_key_parse (RECUTILS_KEY_INT,
+                                         rec_field_value (fld), &key);
+      reals = reals && recutils_key_parse (RECUTILS_KEY_REAL,
+                                           rec_field_value (fld), &key);
+    }
+  rec_mset_iterator_free (&iter);
+  if (ints)
+    return RECUTILS_KEY_INT;
+  if (reals)
+    return RECUTILS_KEY_REAL;
+  return RECUTILS_KEY_STR;
+}
 
-      if (!rec_db_insert_rset (self->rdb, res, rec_db_size (self->rdb)))
+/* Build the sorted array of the ordered index INDEX from RSET.  */
+
+static bool
+recutils_ordered_build (struct recutils_index_s *index, rec_rset_t rset)
+{
+  struct recutils_ordered_s *ordered = &index->ordered;
+  struct recutils_ordered_entry_s *entry;
+  rec_mset_iterator_t iter;
+  const void *data;
+  rec_field_t fld;
+  size_t position = 0;
+
+  ordered->key_kind = recutils_ordered_key_kind (index, rset);
+  ordered->entries
+    = malloc ((rec_rset_num_records (rset) + 1)
+              * sizeof (struct recutils_ordered_entry_s));
+  if (ordered->entries == NULL)
+    return false;
+  iter = rec_mset_iterator (rec_rset_mset (rset));
+  while (rec_mset_iterator_next (&iter, MSET_RECORD, &data, NULL))
+    {
+      entry = &ordered->entries[ordered->num_entries];
+      fld = rec_record_get_field_by_name ((rec_record_t) data,
+                                          index->field, 0);
+      if (fld && recutils_key_parse (ordered->key_kind,
+                                     rec_field_value (fld), &entry->key))
         {
-          /* Error.  */
-          success = false;
-          break;
+          entry->record = (rec_record_t) data;
+          entry->position = position;
+          ordered->num_entries++;
         }
+      else
+        ordered->num_missing++;
+      if (fld && rec_record_get_num_fields_by_name ((rec_record_t) data,
+                                                    index->field) > 1)
+        ordered->num_multiple++;
+      position++;
     }
+  rec_mset_iterator_free (&iter);
+  recutils_sorting = ordered;
+  qsort (ordered->entries, ordered->num_entries,
+         sizeof (struct recutils_ordered_entry_s),
+         recutils_ordered_entry_cmp);
+  recutils_sorting = NULL;
+  return true;
+}
 
-  if (rec_parser_error (parser))
+static void
+recutils_ordered_clear (struct recutils_ordered_s *ordered)
+{
+  free (ordered->entries);
+  memset (ordered, 0, sizeof (struct recutils_ordered_s));
+}
+
+/* (Re)build INDEX from the contents of DB.  */
+
+static bool
+recutils_index_build (struct recutils_index_s *index, rec_db_t db)
+{
+  rec_rset_t rset;
+  rec_mset_iterator_t iter;
+  const void *data;
+  bool success = true;
+
+  recutils_hash_clear (&index->hash);
+  recutils_ordered_clear (&index->ordered);
+  rset = rec_db_get_rset_by_type (db, index->type);
+  if (rset != NULL && index->kind == RECUTILS_INDEX_ORDERED)
+    success = recutils_ordered_build (index, rset);
+  else if (rset != NULL)
     {
-      /* Report parsing errors.  */
-      rec_parser_perror (parser, "%s", string);
-      success = false;
+      iter = rec_mset_iterator (rec_rset_mset (rset));
+      while (success
+             && rec_mset_iterator_next (&iter, MSET_RECORD, &data, NULL))
+        success = recutils_index_add_record (index, (rec_record_t) data);
+      rec_mset_iterator_free (&iter);
     }
-  rec_parser_destroy (parser);
-  fclose (in);
-  if (!success)
+  index->stale = !success;
+  return success;
+}
+
+static bool
+recutils_type_equal_p (const char *type1, const char *type2)
+{
+  if (type1 == NULL || type2 == NULL)
+    return type1 == type2;
+  return strcmp (type1, type2) == 0;
+}
+
+/* Return the index of kind KIND on field FIELD of the record set of
+   type TYPE in the list INDEXES, or NULL if there is none.  */
+
+static struct recutils_index_s *
+recutils_index_find (struct recutils_index_s *indexes,
+                     const char *type, const char *field,
+                     enum recutils_index_kind_e kind)
+{
+  for (; indexes; indexes = indexes->next)
+    if (indexes->kind == kind
+        && recutils_type_equal_p (indexes->type, type)
+        && strcmp (indexes->field, field) == 0)
+      return indexes;
+  return NULL;
+}
+
+/* Mark the indexes on record sets of type TYPE as stale.  If ALL is
+   'true' every index is marked regardless of its type.  */
+
+static void
+recutils_indexes_invalidate (struct recutils_index_s *indexes,
+                             const char *type, bool all)
+{
+  for (; indexes; indexes = indexes->next)
+    if (all || recutils_type_equal_p (indexes->type, type))
+      indexes->stale = true;
+}
+
+/* Update the indexes on record sets of type TYPE after a record has
+   been appended to that record set by DB.  */
+
+static void
+recutils_indexes_record_appended (struct recutils_index_s *indexes,
+                                  rec_db_t db, const char *type)
+{
+  rec_rset_t rset;
+  rec_record_t record;
+  size_t num_records;
+  for (; indexes; indexes = indexes->next)
+    {
+      if (indexes->stale || !recutils_type_equal_p (indexes->type, type))
+        continue;
+      if (indexes->kind != RECUTILS_INDEX_HASH)
+        {
+          /* Appending to a sorted array is not worth it.  */
+          indexes->stale = true;
+          continue;
+        }
+      rset = rec_db_get_rset_by_type (db, type);
+      num_records = rset ? rec_rset_num_records (rset) : 0;
+      record = num_records
+        ? rec_mset_get_at (rec_rset_mset (rset), MSET_RECORD, num_records - 1)
+        : NULL;
+      if (record == NULL || !recutils_index_add_record (indexes, record))
+        indexes->stale = true;
+    }
+}
+
+static void
+recutils_indexes_free (struct recutils_index_s *indexes)
+{
+  struct recutils_index_s *next;
+  for (; indexes; indexes = next)
+    {
+      next = indexes->next;
+      recutils_hash_clear (&indexes->hash);
+      recutils_ordered_clear (&indexes->ordered);
+      free (indexes->type);
+      free (indexes->field);
+      free (indexes);
+    }
+}
+
+/* Recognize selection expressions of the form FIELD = 'literal' or
+   FIELD = integer.  On success store the field name in FNAME and the
+   key to look for in KEY, both of at most SIZE bytes, and return
+   'true'.  */
+
+static bool
+recutils_parse_equality (const char *expr, char *fname, char *key,
+                         size_t size)
+{
+  const char *p = expr, *start;
+  size_t len;
+  long long num;
+  char quote;
+
+  p += strspn (p, " \t\n");
+  start = p;
+  if (!(isalpha ((unsigned char) *p) || *p == '%'))
+    return false;
+  p++;
+  while (isalnum ((unsigned char) *p) || *p == '_')
+    p++;
+  len = p - start;
+  if (len >= size)
+    return false;
+  memcpy (fname, start, len);
+  fname[len] = '\0';
+
+  p += strspn (p, " \t\n");
+  if (p[0] != '=' || p[1] == '=' || p[1] == '~')
+    return false;
+  p++;
+  p += strspn (p, " \t\n");
+
+  if (*p == '\'' || *p == '"')
+    {
+      quote = *p++;
+      start = p;
+      while (*p && *p != quote && *p != '\\')
+        p++;
+      if (*p != quote)
+        return false;
+      len = p - start;
+      if (len >= size)
+        return false;
+      memcpy (key, start, len);
+      key[len] = '\0';
+      p++;
+    }
+  else
+    {
+      start = p;
+      if (*p == '-' || *p == '+')
+        p++;
+      while (isalnum ((unsigned char) *p))
+        p++;
+      len = p - start;
+      if (len == 0 || len >= size)
+        return false;
+      memcpy (key, start, len);
+      key[len] = '\0';
+      if (!recutils_parse_int (key, &num))
+        return false;
+      recutils_index_num_key (key, size, num);
+    }
+  p += strspn (p, " \t\n");
+  return *p == '\0';
+}
+
+/* Return 'true' if the records of the hash index HASH stored under
+   KEY, as built by recutils_parse_equality, are the ones librec
+   selects.  librec compares a missing field as "", which converts to
+   0, and compares integers with reals as reals, so that Field = ''
+   also selects the records lacking the field, Field = 0 those lacking
+   it or holding an empty or non-numeric value, and Field = 7 those
+   holding 7.0.  */
+
+static bool
+recutils_hash_equality_p (struct recutils_hash_s *hash, const char *key)
+{
+  if (key[0] == '\0')
+    return hash->num_missing == 0;
+  if (key[0] != RECUTILS_INDEX_NUM_PREFIX)
+    return true;
+  if (strcmp (key + 1, "0") == 0)
+    return hash->num_missing == 0 && hash->num_non_int == 0;
+  return hash->num_reals == 0;
+}
+
+/* Range of values selected by a selection expression, as recognized
+   by recutils_parse_range.  Bounds are kept as literal strings until
+   the kind of the index answering the query is known.  QUOTED tells
+   whether some of them were quoted, which librec compares as strings.  */
+
+struct recutils_bound_s
+{
+  bool set;
+  bool inclusive;
+  char value[256];
+};
+
+struct recutils_range_s
+{
+  char field[256];
+  struct recutils_bound_s lo;
+  struct recutils_bound_s hi;
+  bool date_ops;
+  bool prefix;
+  bool quoted;
+};
+
+/* Parse a literal at *P, either quoted or a bare number, into BUF of
+   SIZE bytes, advancing *P past it.  Set *QUOTED if it was quoted.  */
+
+static bool
+recutils_parse_literal (const char **p, char *buf, size_t size,
+                        bool *quoted)
+{
+  const char *start;
+  size_t len;
+  char quote;
+  *quoted = **p == '\'' || **p == '"';
+  if (*quoted)
+    {
+      quote = *(*p)++;
+      start = *p;
+      while (**p && **p != quote && **p != '\\')
+        (*p)++;
+      if (**p != quote)
+        return false;
+      len = *p - start;
+      (*p)++;
+    }
+  else
+    {
+      start = *p;
+      if (**p == '-' || **p == '+')
+        (*p)++;
+      while (isalnum ((unsigned char) **p) || **p == '.')
+        (*p)++;
+      len = *p - start;
+      if (len == 0)
+        return false;
+    }
+  if (len >= size)
+    return false;
+  memcpy (buf, start, len);
+  buf[len] = '\0';
+  return true;
+}
+
+static bool
+recutils_set_bound (struct recutils_bound_s *bound, const char *value,
+                    bool inclusive)
+{
+  if (bound->set)
+    return false;
+  bound->set = true;
+  bound->inclusive = inclusive;
+  strcpy (bound->value, value);
+  return true;
+}
+
+/* Recognize selection expressions made of one or more comparisons
+   between a single field and literals joined by &&, such as
+   Date > 1990 && Date < 2000 or Rating >= 7, as well as the date
+   operators <<, >> and == and anchored prefix matches such as
+   Title ~ '^The '.  Store the selected range in RANGE and return
+   'true' on success.  */
+
+static bool
+recutils_parse_range (const char *expr, struct recutils_range_s *range)
+{
+  const char *p = expr, *start;
+  char op[3], literal[256];
+  size_t len;
+  bool first = true, quoted;
+
+  memset (range, 0, sizeof (struct recutils_range_s));
+  while (true)
+    {
+      p += strspn (p, " \t\n");
+      start = p;
+      if (!(isalpha ((unsigned char) *p) || *p == '%'))
+        return false;
+      p++;
+      while (isalnum ((unsigned char) *p) || *p == '_')
+        p++;
+      len = p - start;
+      if (len >= sizeof (range->field))
+        return false;
+      if (first)
+        {
+          memcpy (range->field, start, len);
+          range->field[len] = '\0';
+        }
+      else if (strlen (range->field) != len
+               || strncmp (range->field, start, len) != 0)
+        return false;
+
+      p += strspn (p, " \t\n");
+      len = strspn (p, "<>=~");
+      if (len == 0 || len > 2)
+        return false;
+      memcpy (op, p, len);
+      op[len] = '\0';
+      p += len;
+      p += strspn (p, " \t\n");
+      if (!recutils_parse_literal (&p, literal, sizeof (literal), &quoted))
+        return false;
+      range->quoted = range->quoted || quoted;
+
+      if (strcmp (op, "<<") == 0 || strcmp (op, ">>") == 0
+          || strcmp (op, "==") == 0)
+        {
+          if (!first && !range->date_ops)
+            return false;
+          range->date_ops = true;
+        }
+      else if (range->date_ops)
+        return false;
+
+      if (strcmp (op, "<") == 0 || strcmp (op, "<<") == 0)
+        {
+          if (!recutils_set_bound (&range->hi, literal, false))
+            return false;
+        }
+      else if (strcmp (op, "<=") == 0)
+        {
+          if (!recutils_set_bound (&range->hi, literal, true))
+            return false;
+        }
+      else if (strcmp (op, ">") == 0 || strcmp (op, ">>") == 0)
+        {
+          if (!recutils_set_bound (&range->lo, literal, false))
+            return false;
+        }
+      else if (strcmp (op, ">=") == 0)
+        {
+          if (!recutils_set_bound (&range->lo, literal, true))
+            return false;
+        }
+      else if (strcmp (op, "=") == 0 || strcmp (op, "==") == 0)
+        {
+          if (!recutils_set_bound (&range->lo, literal, true)
+              || !recutils_set_bound (&range->hi, literal, true))
+            return false;
+        }
+      else if (strcmp (op, "=~") == 0 || strcmp (op, "~") == 0)
+        {
+          /* Only anchored patterns without metacharacters.  */
+          if (!first || literal[0] != '^'
+              || strpbrk (literal + 1, ".[]()*+?{}|^$\\") != NULL)
+            return false;
+          range->prefix = true;
+          strcpy (range->lo.value, literal + 1);
+          range->lo.set = true;
+          range->lo.inclusive = true;
+        }
+      else
+        return false;
+
+      first = false;
+      p += strspn (p, " \t\n");
+      if (*p == '\0')
+        break;
+      if (range->prefix || p[0] != '&' || p[1] != '&')
+        return false;
+      p += 2;
+    }
+  return true;
+}
+
+/* Return the position of the first entry of ORDERED whose key is not
+   less than KEY (or, if STRICT, greater than KEY).  */
+
+static size_t
+recutils_ordered_bound (struct recutils_ordered_s *ordered,
+                        const struct recutils_key_s *key, bool strict)
+{
+  size_t lo = 0, hi = ordered->num_entries, mid;
+  int res;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      res = recutils_key_cmp (ordered, &ordered->entries[mid].key, key);
+      if (res < 0 || (strict && res == 0))
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return lo;
+}
+
+/* Return 'true' if RANGE, whose bounds parse as keys of ORDERED,
+   selects the value 0.  librec compares a missing or empty field as
+   "", which converts to 0, so the records missing from ORDERED are
+   then selected too.  */
+
+static bool
+recutils_range_zero_p (struct recutils_ordered_s *ordered,
+                       struct recutils_range_s *range)
+{
+  struct recutils_key_s zero, key;
+  int res;
+
+  memset (&zero, 0, sizeof (struct recutils_key_s));
+  zero.s = "";
+  if (range->lo.set
+      && recutils_key_parse (ordered->key_kind, range->lo.value, &key))
+    {
+      res = recutils_key_cmp (ordered, &zero, &key);
+      if (res < 0 || (res == 0 && !range->lo.inclusive))
+        return false;
+    }
+  if (range->hi.set
+      && recutils_key_parse (ordered->key_kind, range->hi.value, &key))
+    {
+      res = recutils_key_cmp (ordered, &zero, &key);
+      if (res > 0 || (res == 0 && !range->hi.inclusive))
+        return false;
+    }
+  return true;
+}
+
+/* Compute the interval [*FIRST, *LAST) of the entries of the ordered
+   index INDEX selected by RANGE.  Return 'false' if the range cannot
+   be answered by this index, which includes ranges that would also
+   select the records lacking the field.  */
+
+static bool
+recutils_ordered_select (struct recutils_index_s *index,
+                         struct recutils_range_s *range,
+                         size_t *first, size_t *last)
+{
+  struct recutils_ordered_s *ordered = &index->ordered;
+  struct recutils_key_s key;
+  size_t len;
+
+  if (range->prefix)
+    {
+      if (ordered->key_kind != RECUTILS_KEY_STR
+          || (ordered->num_missing > 0 && range->lo.value[0] == '\0'))
+        return false;
+      key.s = range->lo.value;
+      len = strlen (range->lo.value);
+      *first = recutils_ordered_bound (ordered, &key, false);
+      *last = *first;
+      while (*last < ordered->num_entries
+             && strncmp (ordered->entries[*last].key.s, key.s, len) == 0)
+        (*last)++;
+      return true;
+    }
+  /* Quoted literals are compared as strings by librec, except by the
+     date operators.  */
+  if (range->date_ops != (ordered->key_kind == RECUTILS_KEY_DATE)
+      || ordered->key_kind == RECUTILS_KEY_STR
+      || (range->quoted && !range->date_ops))
+    return false;
+  if (ordered->num_missing > 0
+      && (ordered->key_kind == RECUTILS_KEY_DATE
+          || recutils_range_zero_p (ordered, range)))
+    return false;
+
+  *first = 0;
+  *last = ordered->num_entries;
+  if (range->lo.set)
+    {
+      if (!recutils_key_parse (ordered->key_kind, range->lo.value, &key))
+        return false;
+      *first = recutils_ordered_bound (ordered, &key, !range->lo.inclusive);
+    }
+  if (range->hi.set)
+    {
+      if (!recutils_key_parse (ordered->key_kind, range->hi.value, &key))
+        return false;
+      *last = recutils_ordered_bound (ordered, &key, range->hi.inclusive);
+    }
+  if (*last < *first)
+    *last = *first;
+  return true;
+}
+
+static int
+recutils_record_position_cmp (const void *p1, const void *p2)
+{
+  const struct recutils_ordered_entry_s *const *e1 = p1, *const *e2 = p2;
+  return ((*e1)->position > (*e2)->position)
+    - ((*e1)->position < (*e2)->position);
+}
+
+/* Return 'true' if SORT_BY sorts by FIELD alone.  */
+
+static bool
+recutils_sort_by_field_p (rec_fex_t sort_by, const char *field)
+{
+  rec_fex_elem_t elem;
+  if (sort_by == NULL || rec_fex_size (sort_by) != 1)
+    return false;
+  elem = rec_fex_get (sort_by, 0);
+  return strcmp (rec_fex_elem_field_name (elem), field) == 0
+    && rec_fex_elem_min (elem) <= 0;
+}
+
+/* Return 'true' if the projection FEX keeps the first FIELD of the
+   records, under the same name.  */
+
+static bool
+recutils_fex_keeps_p (rec_fex_t fex, const char *field)
+{
+  rec_fex_elem_t elem;
+  size_t i;
+  for (i = 0; i < rec_fex_size (fex); i++)
+    {
+      elem = rec_fex_get (fex, i);
+      if (strcmp (rec_fex_elem_field_name (elem), field) == 0
+          && rec_fex_elem_rewrite_to (elem) == NULL
+          && rec_fex_elem_min (elem) <= 0)
+        return true;
+    }
+  return false;
+}
+
+/* Return 'true' if the records projected through FEX can still be
+   sorted by SORT_BY as the original ones, that is, if FEX keeps every
+   field of SORT_BY.  librec sorts before projecting, so queries whose
+   results are sorted after projection can only be answered if this
+   holds.  */
+
+static bool
+recutils_sort_kept_p (rec_fex_t fex, rec_fex_t sort_by)
+{
+  size_t i;
+  for (i = 0; fex && sort_by && i < rec_fex_size (sort_by); i++)
+    if (!recutils_fex_keeps_p (fex, rec_fex_elem_field_name
+                                      (rec_fex_get (sort_by, i))))
+      return false;
+  return true;
+}
+
+/* Build the result of an index query: a record set holding copies of
+   the NUM_RECORDS records in RECORDS, projected through FEX if not
+   NULL, with a copy of the descriptor of RSET if FLAGS ask for it.
+   Return NULL if there is not enough memory.  */
+
+static rec_rset_t
+recutils_index_result (rec_rset_t rset, rec_record_t *records,
+                       size_t num_records, rec_fex_t fex, int flags)
+{
+  rec_rset_t res;
+  rec_record_t descriptor, rec;
+  size_t i;
+
+  res = rec_rset_new ();
+  if (res == NULL)
+    return NULL;
+  descriptor = rec_rset_descriptor (rset);
+  if ((flags & REC_F_DESCRIPTOR) && descriptor)
+    rec_rset_set_descriptor (res, rec_record_dup (descriptor));
+  for (i = 0; i < num_records; i++)
+    {
+      rec = fex ? recutils_record_project (records[i], fex)
+                : rec_record_dup (records[i]);
+      if (rec == NULL
+          || !rec_mset_append (rec_rset_mset (res), MSET_RECORD,
+                               (void *) rec, MSET_ANY))
+        {
+          if (rec)
+            rec_record_destroy (rec);
+          rec_rset_destroy (res);
+          return NULL;
+        }
+    }
+  return res;
+}
+
+/* Return 'true' if the entries of ORDERED are in the order
+   rec_rset_sort puts the records of a query result in.  The result
+   only knows the types declared in the descriptor if FLAGS ask for a
+   descriptor, and compares the values of other fields as strings.  */
+
+static bool
+recutils_ordered_sort_p (struct recutils_ordered_s *ordered, int flags)
+{
+  if (ordered->type && (flags & REC_F_DESCRIPTOR))
+    return ordered->typed;
+  return ordered->key_kind == RECUTILS_KEY_STR;
+}
+
+/* Answer a query from an ordered index, if there is one for the field
+   compared in SEXP or for the field in SORT_BY, unless some records
+   feature that field more than once, or the query also selects the
+   records lacking it.  Records are returned in record
+   set order, or in index order when SORT_BY sorts by the indexed
+   field and the index compares values as rec_rset_sort does, which
+   saves the sort.  */
+
+static bool
+recutils_ordered_query (recdb *self, rec_rset_t rset, const char *type,
+                        sex *sexp, rec_fex_t fex, rec_fex_t sort_by,
+                        int flags, rec_rset_t *res)
+{
+  struct recutils_range_s range;
+  struct recutils_index_s *idx;
+  struct recutils_ordered_entry_s **matches;
+  rec_record_t *records;
+  size_t first, last, i, num;
+  bool sorted;
+
+  if ((PyObject *) sexp != Py_None)
+    {
+      if (!recutils_parse_range (sexp->expr, &range))
+        return false;
+    }
+  else
+    {
+      /* A plain sort by an indexed field, which can only be answered
+         if every record features the field.  */
+      if (sort_by == NULL)
+        return false;
+      memset (&range, 0, sizeof (struct recutils_range_s));
+      strncpy (range.field, rec_fex_elem_field_name (rec_fex_get (sort_by, 0)),
+               sizeof (range.field) - 1);
+    }
+  idx = recutils_index_find (self->indexes, type, range.field,
+                             RECUTILS_INDEX_ORDERED);
+  if (idx == NULL)
+    return false;
+  if ((idx->stale && !recutils_index_build (idx, self->rdb))
+      || idx->ordered.num_multiple > 0)
+    return false;
+  sorted = recutils_sort_by_field_p (sort_by, range.field)
+    && recutils_ordered_sort_p (&idx->ordered, flags);
+  if ((PyObject *) sexp == Py_None)
+    {
+      if (idx->ordered.num_missing > 0 || !sorted)
+        return false;
+      first = 0;
+      last = idx->ordered.num_entries;
+    }
+  else if (!recutils_ordered_select (idx, &range, &first, &last))
+    return false;
+
+  num = last - first;
+  matches = malloc ((num ? num : 1) * sizeof (*matches));
+  records = malloc ((num ? num : 1) * sizeof (rec_record_t));
+  if (matches == NULL || records == NULL)
+    {
+      free (matches);
+      free (records);
+      *res = NULL;
+      return true;
+    }
+  for (i = 0; i < num; i++)
+    matches[i] = &idx->ordered.entries[first + i];
+  if (!sorted)
+    qsort (matches, num, sizeof (*matches), recutils_record_position_cmp);
+  for (i = 0; i < num; i++)
+    records[i] = matches[i]->record;
+  free (matches);
+
+  *res = recutils_index_result (rset, records, num, fex, flags);
+  free (records);
+  if (*res && sort_by && !sorted)
+    *res = rec_rset_sort (*res, sort_by);
+  return true;
+}
+
+/* Return 'true' if a query only selects records of a single record
+   set by their contents, that is, if it has no join, index, random,
+   password or group_by, and its fex is made of plain field
+   references.  Such queries can be answered without librec.  */
+
+static bool
+recutils_plain_query_p (recdb *self, const char *join, size_t *index,
+                        size_t random, rec_fex_t fex, const char *password,
+                        rec_fex_t group_by, int flags)
+{
+  size_t i;
+  if (join || index || random || group_by || (password && *password)
+      || (flags & ~(REC_F_DESCRIPTOR | REC_F_ICASE)))
+    return false;
+  if (fex)
+    for (i = 0; i < rec_fex_size (fex); i++)
+      if (rec_fex_elem_function_name (rec_fex_get (fex, i)))
+        return false;
+  return true;
+}
+
+/* Try to answer a query from the indexes of SELF.  This is only
+   possible for plain case-sensitive queries whose selection
+   expression is either an equality Field = literal on a field with a
+   hash index, or a range over a field with an ordered index.  Plain
+   sorts by a field with an ordered index are answered as well.  If
+   the query can be answered store the resulting record set in RES and
+   return 'true'; RES is NULL if there was not enough memory.  */
+
+static bool
+recutils_index_query (recdb *self, const char *type, const char *join,
+                      size_t *index, sex *sexp, const char *fast_string,
+                      size_t random, rec_fex_t fex, const char *password,
+                      rec_fex_t group_by, rec_fex_t sort_by, int flags,
+                      rec_rset_t *res)
+{
+  struct recutils_index_s *idx;
+  struct recutils_hash_entry_s *entry;
+  rec_rset_t rset;
+  char fname[256], key[256];
+
+  if (self->indexes == NULL
+      || ((PyObject *) sexp != Py_None
+          && (sexp->expr == NULL || sexp->case_insensitive))
+      || fast_string || (flags & REC_F_ICASE)
+      || !recutils_plain_query_p (self, join, index, random, fex, password,
+                                  group_by, flags)
+      || !recutils_sort_kept_p (fex, sort_by))
+    return false;
+  rset = rec_db_get_rset_by_type (self->rdb, type);
+  if (rset == NULL)
+    return false;
+
+  if ((PyObject *) sexp == Py_None
+      || !recutils_parse_equality (sexp->expr, fname, key, sizeof (key))
+      || (idx = recutils_index_find (self->indexes, type, fname,
+                                     RECUTILS_INDEX_HASH)) == NULL)
+    return recutils_ordered_query (self, rset, type, sexp, fex, sort_by,
+                                   flags, res);
+  if (idx->stale && !recutils_index_build (idx, self->rdb))
+    return false;
+  if (!recutils_hash_equality_p (&idx->hash, key))
+    return false;
+
+  entry = recutils_hash_lookup (&idx->hash, key);
+  *res = recutils_index_result (rset, entry ? entry->records : NULL,
+                                entry ? entry->num_records : 0, fex, flags);
+  if (*res && sort_by)
+    *res = rec_rset_sort (*res, sort_by);
+  return true;
+}
+
+/*
+ * HASH JOINS
+ *
+ * librec joins two record sets with a nested loop, comparing every
+ * record of the referenced record set with every foreign key.
+ * recutils_join_query probes instead a hash table on the key of the
+ * referenced record set: the hash index on it if there is one, or a
+ * table built for the query.  Joined records are built as librec
+ * does: the fields of the record, but the foreign key, followed by the
+ * fields of the referenced record prefixed with the name of the
+ * foreign key and an underscore.  They are put in a temporary
+ * database which librec queries with the other arguments, so that
+ * selection, projection, grouping and sorting apply to the joined
+ * records unchanged.
+ */
+
+/* Build the record joining RECORD, without its field FK, and
+   REFERENCED, whose fields are prefixed by PREFIX.  Return NULL if
+   there is not enough memory.  */
+
+static rec_record_t
+recutils_join_records (rec_record_t record, rec_field_t fk,
+                       rec_record_t referenced, const char *prefix)
+{
+  rec_record_t res;
+  rec_mset_iterator_t iter;
+  rec_mset_elem_t elem;
+  const void *data;
+  void *copy;
+  char *name;
+  bool success = true;
+  size_t prefix_len = strlen (prefix);
+
+  res = rec_record_new ();
+  if (res == NULL)
+    return NULL;
+  iter = rec_mset_iterator (rec_record_mset (record));
+  while (success && rec_mset_iterator_next (&iter, MSET_ANY, &data, &elem))
+    {
+      if (data == (const void *) fk)
+        continue;
+      if (rec_mset_elem_type (elem) == MSET_COMMENT)
+        {
+          copy = rec_comment_new (rec_comment_text ((rec_comment_t) data));
+          success = copy
+            && rec_mset_append (rec_record_mset (res), MSET_COMMENT, copy,
+                                MSET_ANY);
+          if (copy && !success)
+            rec_comment_destroy (copy);
+        }
+      else
+        {
+          copy = rec_field_dup ((rec_field_t) data);
+          success = copy
+            && rec_mset_append (rec_record_mset (res), MSET_FIELD, copy,
+                                MSET_ANY);
+          if (copy && !success)
+            rec_field_destroy (copy);
+        }
+    }
+  rec_mset_iterator_free (&iter);
+
+  iter = rec_mset_iterator (rec_record_mset (referenced));
+  while (success && rec_mset_iterator_next (&iter, MSET_FIELD, &data, NULL))
+    {
+      name = malloc (prefix_len + strlen (rec_field_name ((rec_field_t) data))
+                     + 2);
+      if (name == NULL)
+        {
+          success = false;
+          break;
+        }
+      sprintf (name, "%s_%s", prefix, rec_field_name ((rec_field_t) data));
+      copy = rec_field_new (name, rec_field_value ((rec_field_t) data));
+      free (name);
+      success = copy
+        && rec_mset_append (rec_record_mset (res), MSET_FIELD, copy,
+                            MSET_ANY);
+      if (copy && !success)
+        rec_field_destroy (copy);
+    }
+  rec_mset_iterator_free (&iter);
+  if (!success)
+    {
+      rec_record_destroy (res);
+      return NULL;
+    }
+  return res;
+}
+
+/* Answer a query of the record set of type TYPE joined through the
+   field JOIN, storing the result in *RES.  Return 'false' if the
+   query has to be left to librec: JOIN isn't of type rec or the
+   referenced record set has no key.  */
+
+static bool
+recutils_join_query (recdb *self, const char *type, const char *join,
+                     size_t *index, sex *sexp, const char *fast_string,
+                     size_t random, rec_fex_t fex, const char *password,
+                     rec_fex_t group_by, rec_fex_t sort_by, int flags,
+                     rec_rset_t *res)
+{
+  struct recutils_hash_s own = { NULL, 0, 0, 0, 0, 0 };
+  struct recutils_hash_s *hash = &own;
+  struct recutils_hash_entry_s *entry;
+  struct recutils_index_s *idx;
+  rec_rset_t rset, referenced, joined;
+  rec_record_t descriptor, record, rec;
+  rec_field_t key_field, fk;
+  rec_type_t field_type;
+  rec_mset_iterator_t iter;
+  rec_db_t tmp;
+  const void *data;
+  const char *key;
+  size_t i, j, num;
+  bool success = true;
+
+  if (join == NULL || type == NULL
+      || (rset = rec_db_get_rset_by_type (self->rdb, type)) == NULL
+      || (field_type = rec_rset_get_field_type (rset, join)) == NULL
+      || rec_type_kind (field_type) != REC_TYPE_REC
+      || rec_type_rec (field_type) == NULL
+      || (referenced = rec_db_get_rset_by_type (self->rdb,
+                                                rec_type_rec (field_type)))
+         == NULL
+      || (descriptor = rec_rset_descriptor (referenced)) == NULL
+      || (key_field = rec_record_get_field_by_name (descriptor, "%key", 0))
+         == NULL)
+    return false;
+  key = rec_field_value (key_field);
+
+  /* Hash the referenced records by key, unless there is an index.  */
+  idx = recutils_index_find (self->indexes, rec_type_rec (field_type), key,
+                             RECUTILS_INDEX_HASH);
+  if (idx && (!idx->stale || recutils_index_build (idx, self->rdb)))
+    hash = &idx->hash;
+  else
+    {
+      iter = rec_mset_iterator (rec_rset_mset (referenced));
+      while (success
+             && rec_mset_iterator_next (&iter, MSET_RECORD, &data, NULL))
+        {
+          record = (rec_record_t) data;
+          num = rec_record_get_num_fields_by_name (record, key);
+          for (i = 0; success && i < num; i++)
+            {
+              fk = rec_record_get_field_by_name (record, key, i);
+              success = recutils_hash_add (&own, rec_field_value (fk), record);
+            }
+        }
+      rec_mset_iterator_free (&iter);
+    }
+
+  tmp = success ? rec_db_new () : NULL;
+  joined = tmp ? rec_rset_new () : NULL;
+  if (joined == NULL || !rec_db_insert_rset (tmp, joined, 0))
+    {
+      /* Out of memory.  */
+      if (joined)
+        rec_rset_destroy (joined);
+      if (tmp)
+        rec_db_destroy (tmp);
+      recutils_hash_clear (&own);
+      *res = NULL;
+      return true;
+    }
+  if (rec_rset_descriptor (rset))
+    rec_rset_set_descriptor (joined,
+                             rec_record_dup (rec_rset_descriptor (rset)));
+
+  iter = rec_mset_iterator (rec_rset_mset (rset));
+  while (success && rec_mset_iterator_next (&iter, MSET_RECORD, &data, NULL))
+    {
+      record = (rec_record_t) data;
+      num = rec_record_get_num_fields_by_name (record, join);
+      for (i = 0; success && i < num; i++)
+        {
+          fk = rec_record_get_field_by_name (record, join, i);
+          entry = recutils_hash_lookup (hash, rec_field_value (fk));
+          for (j = 0; success && entry && j < entry->num_records; j++)
+            {
+              rec = recutils_join_records (record, fk, entry->records[j],
+                                           join);
+              success = rec
+                && rec_mset_append (rec_rset_mset (joined), MSET_RECORD,
+                                    (void *) rec, MSET_ANY);
+              if (rec && !success)
+                rec_record_destroy (rec);
+            }
+        }
+    }
+  rec_mset_iterator_free (&iter);
+  recutils_hash_clear (&own);
+
+  *res = success
+    ? rec_db_query (tmp, type, NULL, index, recutils_sex (sexp), fast_string,
+                    random, fex, password, group_by, sort_by, flags)
+    : NULL;
+  rec_db_destroy (tmp);
+  return true;
+}
+
+/*
+ * FAST STRING SEARCH
+ *
+ * The fast_string option of query, delete and set selects the records
+ * featuring some field whose value contains a fixed string.  Values
+ * are searched a block at a time: candidate positions are those where
+ * both the first and the last byte of the string match, and only
+ * those are compared in full.  Blocks are 32 bytes wide with AVX2, 16
+ * bytes wide with SSE2, and a scalar loop is used on other machines
+ * or when the CPU lacks AVX2.  The implementation is chosen once, when
+ * the module is loaded.
+ */
+
+/* A string to search for.  FIRST and LAST hold the lower and upper
+   case variants of the first and last bytes of STR, which are equal
+   unless the search is case-insensitive.  */
+
+struct recutils_needle_s
+{
+  const char *str;
+  size_t len;
+  bool icase;
+  unsigned char first[2];
+  unsigned char last[2];
+};
+
+typedef const char *(*recutils_search_fn) (const char *hay, size_t len,
+                                           const struct recutils_needle_s *needle);
+
+static void
+recutils_needle_init (struct recutils_needle_s *needle, const char *str,
+                      bool icase)
+{
+  needle->str = str;
+  needle->len = strlen (str);
+  needle->icase = icase;
+  if (needle->len == 0)
+    return;
+  needle->first[0] = needle->first[1] = str[0];
+  needle->last[0] = needle->last[1] = str[needle->len - 1];
+  if (icase)
+    {
+      needle->first[0] = tolower ((unsigned char) str[0]);
+      needle->first[1] = toupper ((unsigned char) str[0]);
+      needle->last[0] = tolower ((unsigned char) str[needle->len - 1]);
+      needle->last[1] = toupper ((unsigned char) str[needle->len - 1]);
+    }
+}
+
+static bool
+recutils_needle_at_p (const char *p, const struct recutils_needle_s *needle)
+{
+  return needle->icase ? strncasecmp (p, needle->str, needle->len) == 0
+                       : memcmp (p, needle->str, needle->len) == 0;
+}
+
+static const char *
+recutils_search_scalar (const char *hay, size_t len,
+                        const struct recutils_needle_s *needle)
+{
+  const struct recutils_needle_s *n = needle;
+  size_t i;
+  unsigned char c;
+  if (n->len > len)
+    return NULL;
+  for (i = 0; i + n->len <= len; i++)
+    {
+      c = hay[i];
+      if ((c == n->first[0] || c == n->first[1])
+          && recutils_needle_at_p (hay + i, n))
+        return hay + i;
+    }
+  return NULL;
+}
+
+#ifdef RECUTILS_SIMD_X86
+
+/* Check the candidate positions in MASK, starting at HAY.  */
+
+static const char *
+recutils_search_candidates (const char *hay, unsigned int mask,
+                            const struct recutils_needle_s *needle)
+{
+  while (mask)
+    {
+      if (recutils_needle_at_p (hay + __builtin_ctz (mask), needle))
+        return hay + __builtin_ctz (mask);
+      mask &= mask - 1;
+    }
+  return NULL;
+}
+
+static const char *
+recutils_search_sse2 (const char *hay, size_t len,
+                      const struct recutils_needle_s *needle)
+{
+  const struct recutils_needle_s *n = needle;
+  __m128i f0, f1, l0, l1, bf, bl, eq;
+  const char *res;
+  size_t i = 0;
+
+  if (n->len > len)
+    return NULL;
+  f0 = _mm_set1_epi8 (n->first[0]);
+  f1 = _mm_set1_epi8 (n->first[1]);
+  l0 = _mm_set1_epi8 (n->last[0]);
+  l1 = _mm_set1_epi8 (n->last[1]);
+  for (; i + n->len - 1 + 16 <= len; i += 16)
+    {
+      bf = _mm_loadu_si128 ((const __m128i *) (hay + i));
+      bl = _mm_loadu_si128 ((const __m128i *) (hay + i + n->len - 1));
+      eq = _mm_and_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (bf, f0),
+                                        _mm_cmpeq_epi8 (bf, f1)),
+                          _mm_or_si128 (_mm_cmpeq_epi8 (bl, l0),
+                                        _mm_cmpeq_epi8 (bl, l1)));
+      res = recutils_search_candidates (hay + i, _mm_movemask_epi8 (eq), n);
+      if (res)
+        return res;
+    }
+  return recutils_search_scalar (hay + i, len - i, n);
+}
+
+__attribute__ ((target ("avx2")))
+static const char *
+recutils_search_avx2 (const char *hay, size_t len,
+                      const struct recutils_needle_s *needle)
+{
+  const struct recutils_needle_s *n = needle;
+  __m256i f0, f1, l0, l1, bf, bl, eq;
+  const char *res;
+  size_t i = 0;
+
+  if (n->len > len)
+    return NULL;
+  f0 = _mm256_set1_epi8 (n->first[0]);
+  f1 = _mm256_set1_epi8 (n->first[1]);
+  l0 = _mm256_set1_epi8 (n->last[0]);
+  l1 = _mm256_set1_epi8 (n->last[1]);
+  for (; i + n->len - 1 + 32 <= len; i += 32)
+    {
+      bf = _mm256_loadu_si256 ((const __m256i *) (hay + i));
+      bl = _mm256_loadu_si256 ((const __m256i *) (hay + i + n->len - 1));
+      eq = _mm256_and_si256 (_mm256_or_si256 (_mm256_cmpeq_epi8 (bf, f0),
+                                              _mm256_cmpeq_epi8 (bf, f1)),
+                             _mm256_or_si256 (_mm256_cmpeq_epi8 (bl, l0),
+                                              _mm256_cmpeq_epi8 (bl, l1)));
+      res = recutils_search_candidates (hay + i,
+                                        (unsigned int) _mm256_movemask_epi8 (eq),
+                                        n);
+      if (res)
+        return res;
+    }
+  return recutils_search_sse2 (hay + i, len - i, n);
+}
+
+#endif /* RECUTILS_SIMD_X86 */
+
+static recutils_search_fn recutils_search = recutils_search_scalar;
+
+/* Choose the search implementation for this CPU.  */
+
+static void
+recutils_search_init (void)
+{
+#ifdef RECUTILS_SIMD_X86
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    recutils_search = recutils_search_avx2;
+  else if (__builtin_cpu_supports ("sse2"))
+    recutils_search = recutils_search_sse2;
+#endif
+}
+
+/* Return 'true' if some field of RECORD contains NEEDLE, like
+   rec_record_contains_value.  */
+
+static bool
+recutils_record_contains_p (rec_record_t record,
+                            const struct recutils_needle_s *needle)
+{
+  rec_mset_iterator_t iter;
+  const void *data;
+  const char *value;
+  bool found = false;
+
+  iter = rec_mset_iterator (rec_record_mset (record));
+  while (!found && rec_mset_iterator_next (&iter, MSET_FIELD, &data, NULL))
+    {
+      value = rec_field_value ((rec_field_t) data);
+      found = needle->len == 0
+        || recutils_search (value, strlen (value), needle) != NULL;
+    }
+  rec_mset_iterator_free (&iter);
+  return found;
+}
+
+/* Build the index buffer selecting the records of RSET featuring some
+   field which contains FAST_STRING, as pairs of Min,Max positions
+   ended by REC_Q_NOINDEX,REC_Q_NOINDEX.  This lets delete and set
+   use the fast search while librec performs the mutation.  Return
+   NULL if there is not enough memory.  */
+
+static size_t *
+recutils_fast_string_index (rec_rset_t rset, const char *fast_string,
+                            bool icase)
+{
+  struct recutils_needle_s needle;
+  rec_mset_iterator_t iter;
+  const void *data;
+  size_t *index, num = 0, position = 0;
+
+  index = malloc ((2 * rec_rset_num_records (rset) + 2) * sizeof (size_t));
+  if (index == NULL)
+    return NULL;
+  recutils_needle_init (&needle, fast_string, icase);
+  iter = rec_mset_iterator (rec_rset_mset (rset));
+  while (rec_mset_iterator_next (&iter, MSET_RECORD, &data, NULL))
+    {
+      if (recutils_record_contains_p ((rec_record_t) data, &needle))
+        {
+          if (num > 0 && index[num - 1] + 1 == position)
+            index[num - 1] = position;
+          else
+            {
+              index[num++] = position;
+              index[num++] = position;
+            }
+        }
+      position++;
+    }
+  rec_mset_iterator_free (&iter);
+  index[num] = REC_Q_NOINDEX;
+  index[num + 1] = REC_Q_NOINDEX;
+  return index;
+}
+
+/*
+ * SEX BYTECODE
+ *
+ * Selection expressions made of comparisons between fields and
+ * literals joined by &&, || and ! are lowered, when they are compiled,
+ * into a flat program for a small register machine.  Each field
+ * referenced by the expression is resolved to a register slot, which
+ * is loaded in a single pass over the fields of the record, literals
+ * are converted to numbers ahead of time and constant sub-expressions
+ * are folded.
+ *
+ * A program only decides the records on which it is sure to agree
+ * with librec: every referenced field must occur exactly once in the
+ * record, and fields compared as numbers must hold plain decimal
+ * numbers.  Other records, as well as expressions using any other
+ * construct, are evaluated by rec_sex_eval.
+ */
+
+#define RECUTILS_PROGRAM_MAX_SLOTS 16
+#define RECUTILS_PROGRAM_MAX_NODES 128
+
+/* Operands referring to a constant rather than to a slot have this
+   bit set.  */
+
+#define RECUTILS_OPERAND_CONST 0x8000
+
+enum recutils_opcode_e
+{
+  RECUTILS_OP_STR,      /* ACC = A CMP B, compared as strings.  */
+  RECUTILS_OP_NUM,      /* ACC = A CMP B, compared as numbers.  */
+  RECUTILS_OP_JFALSE,   /* Jump to TARGET if ACC is false.  */
+  RECUTILS_OP_JTRUE,    /* Jump to TARGET if ACC is true.  */
+  RECUTILS_OP_NOT,      /* ACC = !ACC.  */
+  RECUTILS_OP_SET,      /* ACC = A.  */
+  RECUTILS_OP_END       /* Stop, the result is in ACC.  */
+};
+
+enum recutils_cmp_e
+{
+  RECUTILS_CMP_EQ,
+  RECUTILS_CMP_NE,
+  RECUTILS_CMP_LT,
+  RECUTILS_CMP_GT,
+  RECUTILS_CMP_LE,
+  RECUTILS_CMP_GE
+};
+
+struct recutils_insn_s
+{
+  unsigned char op;
+  unsigned char cmp;
+  unsigned short a;
+  unsigned short b;
+  unsigned short target;
+};
+
+/* Literal of the expression.  QUOTED literals are strings for the
+   purposes of =, != and numbers only if NUM_P.  */
+
+struct recutils_const_s
+{
+  char *str;
+  double num;
+  bool num_p;
+  bool quoted;
+};
+
+struct recutils_program_s
+{
+  struct recutils_insn_s *code;
+  size_t num_insns;
+  size_t allocated_insns;
+  char *slots[RECUTILS_PROGRAM_MAX_SLOTS];
+  bool numeric[RECUTILS_PROGRAM_MAX_SLOTS];
+  size_t num_slots;
+  struct recutils_const_s *consts;
+  size_t num_consts;
+  size_t allocated_consts;
+  bool case_insensitive;
+};
+
+/* Abstract syntax tree built while compiling, before folding and
+   code generation.  */
+
+enum recutils_node_kind_e
+{
+  RECUTILS_NODE_CMP,
+  RECUTILS_NODE_AND,
+  RECUTILS_NODE_OR,
+  RECUTILS_NODE_NOT,
+  RECUTILS_NODE_BOOL
+};
+
+struct recutils_node_s
+{
+  enum recutils_node_kind_e kind;
+  enum recutils_cmp_e cmp;
+  bool numeric;
+  bool value;
+  unsigned short a;
+  unsigned short b;
+  struct recutils_node_s *left;
+  struct recutils_node_s *right;
+};
+
+struct recutils_compiler_s
+{
+  const char *p;
+  struct recutils_program_s *prog;
+  struct recutils_node_s nodes[RECUTILS_PROGRAM_MAX_NODES];
+  size_t num_nodes;
+};
+
+/* Parse STR as a plain decimal number, such as 12, -3 or 7.25,
+   storing it in NUM.  Integers are limited to nine digits so that
+   they fit the integers used by librec.  */
+
+static bool
+recutils_plain_number (const char *str, double *num)
+{
+  const char *p = str;
+  size_t digits;
+  if (*p == '-')
+    p++;
+  digits = strspn (p, "0123456789");
+  if (digits == 0 || (p[0] == '0' && digits > 1))
+    return false;
+  p += digits;
+  if (*p == '.')
+    {
+      p++;
+      if (strspn (p, "0123456789") == 0)
+        return false;
+      p += strspn (p, "0123456789");
+    }
+  else if (digits > 9)
+    return false;
+  if (*p != '\0')
+    return false;
+  *num = strtod (str, NULL);
+  return true;
+}
+
+static void
+recutils_program_free (struct recutils_program_s *prog)
+{
+  size_t i;
+  if (prog == NULL)
+    return;
+  for (i = 0; i < prog->num_slots; i++)
+    free (prog->slots[i]);
+  for (i = 0; i < prog->num_consts; i++)
+    free (prog->consts[i].str);
+  free (prog->consts);
+  free (prog->code);
+  free (prog);
+}
+
+static struct recutils_node_s *
+recutils_compiler_node (struct recutils_compiler_s *comp,
+                        enum recutils_node_kind_e kind)
+{
+  struct recutils_node_s *node;
+  if (comp->num_nodes == RECUTILS_PROGRAM_MAX_NODES)
+    return NULL;
+  node = &comp->nodes[comp->num_nodes++];
+  memset (node, 0, sizeof (struct recutils_node_s));
+  node->kind = kind;
+  return node;
+}
+
+static void
+recutils_compiler_skip (struct recutils_compiler_s *comp)
+{
+  comp->p += strspn (comp->p, " \t\n");
+}
+
+/* Parse a field name or a literal, storing the operand referring to
+   its slot or constant in *OPERAND.  */
+
+static bool
+recutils_compile_operand (struct recutils_compiler_s *comp,
+                          unsigned short *operand)
+{
+  struct recutils_program_s *prog = comp->prog;
+  struct recutils_const_s *cst;
+  const char *start;
+  char quote;
+  size_t len, i;
+
+  recutils_compiler_skip (comp);
+  start = comp->p;
+  if (isalpha ((unsigned char) *start) || *start == '%')
+    {
+      comp->p++;
+      while (isalnum ((unsigned char) *comp->p) || *comp->p == '_')
+        comp->p++;
+      len = comp->p - start;
+      if (*comp->p == '[' || *comp->p == '.' || *comp->p == '(')
+        return false;
+      for (i = 0; i < prog->num_slots; i++)
+        if (strlen (prog->slots[i]) == len
+            && strncmp (prog->slots[i], start, len) == 0)
+          break;
+      if (i == prog->num_slots)
+        {
+          if (i == RECUTILS_PROGRAM_MAX_SLOTS
+              || (prog->slots[i] = strndup (start, len)) == NULL)
+            return false;
+          prog->num_slots++;
+        }
+      *operand = i;
+      return true;
+    }
+
+  if (prog->num_consts == prog->allocated_consts)
+    {
+      size_t allocated = prog->allocated_consts ? 2 * prog->allocated_consts : 8;
+      cst = realloc (prog->consts, allocated * sizeof (*cst));
+      if (cst == NULL)
+        return false;
+      prog->consts = cst;
+      prog->allocated_consts = allocated;
+    }
+  cst = &prog->consts[prog->num_consts];
+  if (*start == '\'' || *start == '"')
+    {
+      quote = *comp->p++;
+      start = comp->p;
+      while (*comp->p && *comp->p != quote && *comp->p != '\\')
+        comp->p++;
+      if (*comp->p != quote)
+        return false;
+      len = comp->p - start;
+      comp->p++;
+      cst->quoted = true;
+    }
+  else
+    {
+      if (*comp->p == '-')
+        comp->p++;
+      comp->p += strspn (comp->p, "0123456789.");
+      len = comp->p - start;
+      cst->quoted = false;
+    }
+  cst->str = strndup (start, len);
+  if (cst->str == NULL)
+    return false;
+  cst->num_p = recutils_plain_number (cst->str, &cst->num);
+  if (!cst->quoted && !cst->num_p)
+    {
+      free (cst->str);
+      return false;
+    }
+  *operand = RECUTILS_OPERAND_CONST | prog->num_consts++;
+  return true;
+}
+
+/* Parse a comparison OPERAND OP OPERAND.  Equality between strings
+   (fields or quoted literals) compares strings, and any other
+   comparison compares numbers, as librec does.  Comparisons between
+   two literals are folded.  */
+
+static struct recutils_node_s *
+recutils_compile_cmp (struct recutils_compiler_s *comp)
+{
+  struct recutils_program_s *prog = comp->prog;
+  struct recutils_node_s *node;
+  struct recutils_const_s *ca, *cb;
+  const char *p;
+  unsigned short ops[2];
+  enum recutils_cmp_e cmp;
+  size_t i;
+  int diff;
+  bool res = false;
+
+  if (!recutils_compile_operand (comp, &ops[0]))
+    return NULL;
+  recutils_compiler_skip (comp);
+  p = comp->p;
+  if (p[0] == '=' && p[1] != '=' && p[1] != '~' && p[1] != '>')
+    cmp = RECUTILS_CMP_EQ, comp->p += 1;
+  else if (p[0] == '!' && p[1] == '=')
+    cmp = RECUTILS_CMP_NE, comp->p += 2;
+  else if (p[0] == '<' && p[1] == '=')
+    cmp = RECUTILS_CMP_LE, comp->p += 2;
+  else if (p[0] == '>' && p[1] == '=')
+    cmp = RECUTILS_CMP_GE, comp->p += 2;
+  else if (p[0] == '<' && p[1] != '<')
+    cmp = RECUTILS_CMP_LT, comp->p += 1;
+  else if (p[0] == '>' && p[1] != '>')
+    cmp = RECUTILS_CMP_GT, comp->p += 1;
+  else
+    return NULL;
+  if (!recutils_compile_operand (comp, &ops[1])
+      || (node = recutils_compiler_node (comp, RECUTILS_NODE_CMP)) == NULL)
+    return NULL;
+  node->cmp = cmp;
+  node->a = ops[0];
+  node->b = ops[1];
+
+  node->numeric = cmp != RECUTILS_CMP_EQ && cmp != RECUTILS_CMP_NE;
+  for (i = 0; i < 2; i++)
+    if ((ops[i] & RECUTILS_OPERAND_CONST)
+        && !prog->consts[ops[i] & ~RECUTILS_OPERAND_CONST].quoted)
+      node->numeric = true;
+  for (i = 0; i < 2; i++)
+    {
+      if (!node->numeric)
+        continue;
+      if (!(ops[i] & RECUTILS_OPERAND_CONST))
+        prog->numeric[ops[i]] = true;
+      else if (!prog->consts[ops[i] & ~RECUTILS_OPERAND_CONST].num_p)
+        return NULL;
+    }
+
+  if ((node->a & node->b & RECUTILS_OPERAND_CONST) == 0)
+    return node;
+  ca = &prog->consts[node->a & ~RECUTILS_OPERAND_CONST];
+  cb = &prog->consts[node->b & ~RECUTILS_OPERAND_CONST];
+  if (!node->numeric)
+    {
+      diff = prog->case_insensitive ? strcasecmp (ca->str, cb->str)
+                                    : strcmp (ca->str, cb->str);
+      res = (diff == 0) == (cmp == RECUTILS_CMP_EQ);
+    }
+  else
+    switch (cmp)
+      {
+      case RECUTILS_CMP_EQ: res = ca->num == cb->num; break;
+      case RECUTILS_CMP_NE: res = ca->num != cb->num; break;
+      case RECUTILS_CMP_LT: res = ca->num < cb->num; break;
+      case RECUTILS_CMP_GT: res = ca->num > cb->num; break;
+      case RECUTILS_CMP_LE: res = ca->num <= cb->num; break;
+      case RECUTILS_CMP_GE: res = ca->num >= cb->num; break;
+      }
+  node->kind = RECUTILS_NODE_BOOL;
+  node->value = res;
+  return node;
+}
+
+static struct recutils_node_s *recutils_compile_or (struct recutils_compiler_s *comp);
+
+/* Parse either a negated or parenthesized expression or a
+   comparison.  */
+
+static struct recutils_node_s *
+recutils_compile_not (struct recutils_compiler_s *comp)
+{
+  struct recutils_node_s *node, *child;
+  bool negate = false;
+
+  recutils_compiler_skip (comp);
+  if (comp->p[0] == '!' && comp->p[1] != '=')
+    {
+      /* ! binds tighter than comparisons, so only !(...) is handled
+         here.  */
+      comp->p++;
+      recutils_compiler_skip (comp);
+      if (*comp->p != '(')
+        return NULL;
+      negate = true;
+    }
+  if (*comp->p != '(')
+    return negate ? NULL : recutils_compile_cmp (comp);
+
+  comp->p++;
+  child = recutils_compile_or (comp);
+  if (child == NULL)
+    return NULL;
+  recutils_compiler_skip (comp);
+  if (*comp->p != ')')
+    return NULL;
+  comp->p++;
+  if (!negate)
+    return child;
+  if (child->kind == RECUTILS_NODE_BOOL)
+    {
+      child->value = !child->value;
+      return child;
+    }
+  node = recutils_compiler_node (comp, RECUTILS_NODE_NOT);
+  if (node)
+    node->left = child;
+  return node;
+}
+
+/* Parse a sequence of operands joined by && (if KIND is
+   RECUTILS_NODE_AND) or || (if KIND is RECUTILS_NODE_OR), folding
+   constant operands.  */
+
+static struct recutils_node_s *
+recutils_compile_chain (struct recutils_compiler_s *comp,
+                        enum recutils_node_kind_e kind)
+{
+  struct recutils_node_s *left, *right, *node;
+  const char *op = kind == RECUTILS_NODE_AND ? "&&" : "||";
+  /* A constant operand equal to ABSORBING decides the chain.  */
+  bool absorbing = kind == RECUTILS_NODE_OR;
+
+  left = kind == RECUTILS_NODE_AND ? recutils_compile_not (comp)
+                                   : recutils_compile_chain (comp, RECUTILS_NODE_AND);
+  while (left)
+    {
+      recutils_compiler_skip (comp);
+      if (strncmp (comp->p, op, 2) != 0)
+        break;
+      comp->p += 2;
+      right = kind == RECUTILS_NODE_AND ? recutils_compile_not (comp)
+                                        : recutils_compile_chain (comp, RECUTILS_NODE_AND);
+      if (right == NULL)
+        return NULL;
+      if (left->kind == RECUTILS_NODE_BOOL)
+        left = left->value == absorbing ? left : right;
+      else if (right->kind == RECUTILS_NODE_BOOL)
+        left = right->value == absorbing ? right : left;
+      else
+        {
+          node = recutils_compiler_node (comp, kind);
+          if (node == NULL)
+            return NULL;
+          node->left = left;
+          node->right = right;
+          left = node;
+        }
+    }
+  return left;
+}
+
+static struct recutils_node_s *
+recutils_compile_or (struct recutils_compiler_s *comp)
+{
+  return recutils_compile_chain (comp, RECUTILS_NODE_OR);
+}
+
+static bool
+recutils_program_emit (struct recutils_program_s *prog,
+                       enum recutils_opcode_e op, enum recutils_cmp_e cmp,
+                       unsigned short a, unsigned short b)
+{
+  struct recutils_insn_s *insn;
+  size_t allocated;
+  if (prog->num_insns == prog->allocated_insns)
+    {
+      allocated = prog->allocated_insns ? 2 * prog->allocated_insns : 16;
+      insn = realloc (prog->code, allocated * sizeof (*insn));
+      if (insn == NULL)
+        return false;
+      prog->code = insn;
+      prog->allocated_insns = allocated;
+    }
+  insn = &prog->code[prog->num_insns++];
+  insn->op = op;
+  insn->cmp = cmp;
+  insn->a = a;
+  insn->b = b;
+  insn->target = 0;
+  return true;
+}
+
+/* Generate the code evaluating NODE into the accumulator.  The
+   operands of && and || are short-circuited: a false (or true)
+   operand jumps straight to the end of the chain with the result in
+   the accumulator.  */
+
+static bool
+recutils_program_gen (struct recutils_program_s *prog,
+                      struct recutils_node_s *node)
+{
+  size_t jump;
+  switch (node->kind)
+    {
+    case RECUTILS_NODE_CMP:
+      return recutils_program_emit (prog, node->numeric ? RECUTILS_OP_NUM
+                                                        : RECUTILS_OP_STR,
+                                    node->cmp, node->a, node->b);
+    case RECUTILS_NODE_BOOL:
+      return recutils_program_emit (prog, RECUTILS_OP_SET, 0,
+                                    node->value, 0);
+    case RECUTILS_NODE_NOT:
+      return recutils_program_gen (prog, node->left)
+        && recutils_program_emit (prog, RECUTILS_OP_NOT, 0, 0, 0);
+    case RECUTILS_NODE_AND:
+    case RECUTILS_NODE_OR:
+      if (!recutils_program_gen (prog, node->left))
+        return false;
+      jump = prog->num_insns;
+      if (!recutils_program_emit (prog, node->kind == RECUTILS_NODE_AND
+                                        ? RECUTILS_OP_JFALSE : RECUTILS_OP_JTRUE,
+                                  0, 0, 0)
+          || !recutils_program_gen (prog, node->right))
+        return false;
+      prog->code[jump].target = prog->num_insns;
+      return true;
+    }
+  return false;
+}
+
+/* Compile EXPR into a program.  Return NULL if EXPR uses constructs
+   that programs don't support, or if there is not enough memory.  */
+
+static struct recutils_program_s *
+recutils_program_compile (const char *expr, bool case_insensitive)
+{
+  struct recutils_compiler_s *comp;
+  struct recutils_program_s *prog;
+  struct recutils_node_s *root;
+  bool success;
+
+  if (expr == NULL)
+    return NULL;
+  comp = malloc (sizeof (struct recutils_compiler_s));
+  prog = calloc (1, sizeof (struct recutils_program_s));
+  if (comp == NULL || prog == NULL)
+    {
+      free (comp);
+      free (prog);
+      return NULL;
+    }
+  prog->case_insensitive = case_insensitive;
+  comp->p = expr;
+  comp->prog = prog;
+  comp->num_nodes = 0;
+
+  root = recutils_compile_or (comp);
+  if (root)
+    recutils_compiler_skip (comp);
+  success = root && *comp->p == '\0'
+    && recutils_program_gen (prog, root)
+    && recutils_program_emit (prog, RECUTILS_OP_END, 0, 0, 0);
+  free (comp);
+  if (!success)
+    {
+      recutils_program_free (prog);
+      return NULL;
+    }
+  return prog;
+}
+
+/* Registers of a running program, one per slot.  */
+
+struct recutils_reg_s
+{
+  const char *str;
+  double num;
+  size_t count;
+};
+
+/* Run PROG on RECORD.  Return 1 if the record matches, 0 if it
+   doesn't and -1 if the record must be evaluated by librec.  */
+
+static int
+recutils_program_run (struct recutils_program_s *prog, rec_record_t record)
+{
+  struct recutils_reg_s regs[RECUTILS_PROGRAM_MAX_SLOTS];
+  struct recutils_insn_s *insn;
+  rec_mset_iterator_t iter;
+  const void *data;
+  const char *name, *sa, *sb;
+  double na, nb;
+  size_t i, pc = 0;
+  bool acc = false;
+
+  for (i = 0; i < prog->num_slots; i++)
+    regs[i].count = 0;
+  iter = rec_mset_iterator (rec_record_mset (record));
+  while (rec_mset_iterator_next (&iter, MSET_FIELD, &data, NULL))
+    {
+      name = rec_field_name ((rec_field_t) data);
+      for (i = 0; i < prog->num_slots; i++)
+        if (strcmp (name, prog->slots[i]) == 0)
+          {
+            regs[i].count++;
+            regs[i].str = rec_field_value ((rec_field_t) data);
+            break;
+          }
+    }
+  rec_mset_iterator_free (&iter);
+  for (i = 0; i < prog->num_slots; i++)
+    if (regs[i].count != 1
+        || (prog->numeric[i]
+            && !recutils_plain_number (regs[i].str, &regs[i].num)))
+      return -1;
+
+#define RECUTILS_OPERAND(OP, FIELD)                                     \
+  (((OP) & RECUTILS_OPERAND_CONST)                                      \
+   ? prog->consts[(OP) & ~RECUTILS_OPERAND_CONST].FIELD : regs[OP].FIELD)
+
+  while (true)
+    {
+      insn = &prog->code[pc++];
+      switch (insn->op)
+        {
+        case RECUTILS_OP_STR:
+          sa = RECUTILS_OPERAND (insn->a, str);
+          sb = RECUTILS_OPERAND (insn->b, str);
+          acc = (prog->case_insensitive ? strcasecmp (sa, sb)
+                                        : strcmp (sa, sb)) == 0;
+          if (insn->cmp == RECUTILS_CMP_NE)
+            acc = !acc;
+          break;
+        case RECUTILS_OP_NUM:
+          na = RECUTILS_OPERAND (insn->a, num);
+          nb = RECUTILS_OPERAND (insn->b, num);
+          switch (insn->cmp)
+            {
+            case RECUTILS_CMP_EQ: acc = na == nb; break;
+            case RECUTILS_CMP_NE: acc = na != nb; break;
+            case RECUTILS_CMP_LT: acc = na < nb; break;
+            case RECUTILS_CMP_GT: acc = na > nb; break;
+            case RECUTILS_CMP_LE: acc = na <= nb; break;
+            case RECUTILS_CMP_GE: acc = na >= nb; break;
+            }
+          break;
+        case RECUTILS_OP_JFALSE:
+          if (!acc)
+            pc = insn->target;
+          break;
+        case RECUTILS_OP_JTRUE:
+          if (acc)
+            pc = insn->target;
+          break;
+        case RECUTILS_OP_NOT:
+          acc = !acc;
+          break;
+        case RECUTILS_OP_SET:
+          acc = insn->a;
+          break;
+        case RECUTILS_OP_END:
+          return acc;
+        }
+    }
+#undef RECUTILS_OPERAND
+}
+
+/* Evaluate SEXP on RECORD like rec_sex_eval does, running the program
+   of SEXP if it has one.  */
+
+static bool
+recutils_sex_eval (sex *sexp, rec_record_t record, bool *status)
+{
+  int res;
+  if (sexp->prog)
+    {
+      res = recutils_program_run (sexp->prog, record);
+      if (res >= 0)
+        {
+          *status = true;
+          return res;
+        }
+    }
+  return rec_sex_eval (sexp->sx, record, status);
+}
+
+/* Return 'true' if the records of SELF may be modified, that is, if
+   no worker threads of a query are reading them with the GIL
+   released.  Otherwise set an exception and return 'false'.  Every
+   method replacing or modifying record sets checks this right before
+   doing so.  */
+
+static bool
+recutils_check_idle (recdb *self)
+{
+  if (self->busy == 0)
+    return true;
+  PyErr_SetString (RecError, "database in use by a multi-threaded query");
+  return false;
+}
+
+/* Part of a scanning query.  The NUM_RECORDS records at RECORDS are
+   checked against NEEDLE, or against PROG and SX, or all selected if
+   both are NULL, and copies of the selected records, projected
+   through FEX if not NULL, are stored in RESULTS.  SX evaluates the
+   records PROG can't decide; each thread has its own, as librec sexes
+   can't be evaluated concurrently.  */
+
+struct recutils_query_job_s
+{
+  rec_record_t *records;
+  size_t num_records;
+  rec_record_t *results;
+  size_t num_results;
+  const struct recutils_needle_s *needle;
+  struct recutils_program_s *prog;
+  rec_sex_t sx;
+  rec_fex_t fex;
+  bool nomem;
+};
+
+static void *
+recutils_query_worker (void *arg)
+{
+  struct recutils_query_job_s *job = arg;
+  rec_record_t rec, copy;
+  size_t i;
+  int res;
+  bool status;
+
+  for (i = 0; i < job->num_records; i++)
+    {
+      rec = job->records[i];
+      if (job->needle)
+        res = recutils_record_contains_p (rec, job->needle);
+      else if (job->sx)
+        {
+          res = job->prog ? recutils_program_run (job->prog, rec) : -1;
+          if (res < 0)
+            res = rec_sex_eval (job->sx, rec, &status) && status;
+        }
+      else
+        res = 1;
+      if (!res)
+        continue;
+      copy = job->fex ? recutils_record_project (rec, job->fex)
+                      : rec_record_dup (rec);
+      if (copy == NULL)
+        {
+          job->nomem = true;
+          break;
+        }
+      job->results[job->num_results++] = copy;
+    }
+  return NULL;
+}
+
+/* Answer a query scanning the record set of TYPE, selecting records
+   either with SEXP or with FAST_STRING.  With more than one of
+   THREADS, the record set is split in chunks which are evaluated and
+   projected by worker threads with the GIL released, and the results
+   are merged in record set order; meanwhile the database is marked
+   busy, and its mutators refuse to run (see recutils_check_idle).  A
+   single thread is only used for sexes which have a program and for
+   FAST_STRING, everything else is left to librec, as are sorts by
+   fields FEX drops.  */
+
+static bool
+recutils_scan_query (recdb *self, const char *type, sex *sexp,
+                     const char *fast_string, rec_fex_t fex,
+                     rec_fex_t sort_by, int flags, int threads,
+                     rec_rset_t *res)
+{
+  struct recutils_needle_s needle;
+  struct recutils_query_job_s *jobs;
+  rec_rset_t rset;
+  rec_record_t *records, *results, descriptor;
+  rec_mset_iterator_t iter;
+  const void *data;
+  pthread_t *workers;
+  size_t num, num_threads, chunk, i, j, num_workers = 0;
+  bool has_sex = (PyObject *) sexp != Py_None;
+  bool nomem = false;
+
+  if (fast_string)
+    {
+      if (has_sex)
+        return false;
+      recutils_needle_init (&needle, fast_string, flags & REC_F_ICASE);
+    }
+  else if (flags & REC_F_ICASE)
+    return false;
+  else if (threads == 1 ? !has_sex || sexp->prog == NULL
+                        : has_sex && sexp->expr == NULL)
+    return false;
+  if (!recutils_sort_kept_p (fex, sort_by))
+    return false;
+  rset = rec_db_get_rset_by_type (self->rdb, type);
+  if (rset == NULL)
+    return false;
+
+  num = rec_rset_num_records (rset);
+  num_threads = recutils_num_threads (threads, num);
+  records = malloc ((num + 1) * sizeof (rec_record_t));
+  results = malloc ((num + 1) * sizeof (rec_record_t));
+  jobs = calloc (num_threads, sizeof (struct recutils_query_job_s));
+  workers = malloc (num_threads * sizeof (pthread_t));
+  if (records == NULL || results == NULL || jobs == NULL || workers == NULL)
+    {
+      free (records);
+      free (results);
+      free (jobs);
+      free (workers);
+      *res = NULL;
+      return true;
+    }
+  i = 0;
+  iter = rec_mset_iterator (rec_rset_mset (rset));
+  while (i < num && rec_mset_iterator_next (&iter, MSET_RECORD, &data, NULL))
+    records[i++] = (rec_record_t) data;
+  rec_mset_iterator_free (&iter);
+  num = i;
+
+  chunk = (num + num_threads - 1) / num_threads;
+  for (i = 0; i < num_threads; i++)
+    {
+      jobs[i].records = records + i * chunk;
+      jobs[i].results = results + i * chunk;
+      jobs[i].num_records = i * chunk >= num ? 0
+        : (num - i * chunk < chunk ? num - i * chunk : chunk);
+      jobs[i].needle = fast_string ? &needle : NULL;
+      jobs[i].fex = fex;
+      if (fast_string || !has_sex)
+        continue;
+      jobs[i].prog = sexp->prog;
+      if (num_threads == 1)
+        jobs[i].sx = sexp->sx;
+      else if ((jobs[i].sx = rec_sex_new (sexp->case_insensitive)) == NULL
+               || !rec_sex_compile (jobs[i].sx, sexp->expr))
+        nomem = true;
+    }
+
+  if (nomem)
+    ;
+  else if (num_threads == 1)
+    recutils_query_worker (&jobs[0]);
+  else
+    {
+      self->busy++;
+      Py_BEGIN_ALLOW_THREADS
+      for (i = 0; i < num_threads; i++)
+        if (pthread_create (&workers[num_workers], NULL,
+                            recutils_query_worker, &jobs[i]) == 0)
+          num_workers++;
+        else
+          /* Do the work here if the thread could not be created.  */
+          recutils_query_worker (&jobs[i]);
+      for (i = 0; i < num_workers; i++)
+        pthread_join (workers[i], NULL);
+      Py_END_ALLOW_THREADS
+      self->busy--;
+    }
+
+  /* Merge the results in record set order.  */
+  *res = nomem ? NULL : rec_rset_new ();
+  descriptor = rec_rset_descriptor (rset);
+  if (*res && (flags & REC_F_DESCRIPTOR) && descriptor)
+    rec_rset_set_descriptor (*res, rec_record_dup (descriptor));
+  for (i = 0; i < num_threads; i++)
+    {
+      if (jobs[i].nomem && *res)
+        {
+          rec_rset_destroy (*res);
+          *res = NULL;
+        }
+      for (j = 0; j < jobs[i].num_results; j++)
+        {
+          if (*res && !rec_mset_append (rec_rset_mset (*res), MSET_RECORD,
+                                        (void *) jobs[i].results[j],
+                                        MSET_ANY))
+            {
+              rec_rset_destroy (*res);
+              *res = NULL;
+            }
+          if (*res == NULL)
+            rec_record_destroy (jobs[i].results[j]);
+        }
+      if (num_threads > 1 && jobs[i].sx)
+        rec_sex_destroy (jobs[i].sx);
+    }
+  free (records);
+  free (results);
+  free (jobs);
+  free (workers);
+
+  if (*res && sort_by)
+    *res = rec_rset_sort (*res, sort_by);
+  return true;
+}
+
+/* A record kept by a limited query, with its position in the record
+   set so that records comparing equal keep their order.  */
+
+struct recutils_ranked_s
+{
+  rec_record_t record;
+  size_t position;
+};
+
+/* How recutils_ranked_cmp compares records: by the first value of
+   the fields of SORT_BY, according to the types in TYPES, or as
+   strings for NULL types.  A record lacking a field sorts before one
+   featuring it, as in rec_rset_sort.  Like recutils_sorting, this is
+   passed in a static as qsort has no context argument.  */
+
+struct recutils_ranking_s
+{
+  rec_fex_t sort_by;
+  rec_type_t *types;
+};
+
+static struct recutils_ranking_s *recutils_ranking;
+
+/* Set up RANKING to compare the records of RSET by SORT_BY, typing
+   the fields by the descriptor of RSET if FLAGS ask for a descriptor.
+   Return 'false' if there is not enough memory.  */
+
+static bool
+recutils_ranking_init (struct recutils_ranking_s *ranking, rec_rset_t rset,
+                       rec_fex_t sort_by, int flags)
+{
+  size_t i;
+  ranking->sort_by = sort_by;
+  ranking->types = calloc (rec_fex_size (sort_by) + 1, sizeof (rec_type_t));
+  if (ranking->types == NULL)
+    return false;
+  for (i = 0; (flags & REC_F_DESCRIPTOR) && i < rec_fex_size (sort_by); i++)
+    ranking->types[i]
+      = rec_rset_get_field_type (rset, rec_fex_elem_field_name
+                                         (rec_fex_get (sort_by, i)));
+  return true;
+}
+
+static int
+recutils_ranked_cmp (const void *p1, const void *p2)
+{
+  const struct recutils_ranked_s *r1 = p1, *r2 = p2;
+  rec_field_t f1, f2;
+  const char *fname;
+  size_t i;
+  int res = 0;
+
+  for (i = 0; res == 0 && i < rec_fex_size (recutils_ranking->sort_by); i++)
+    {
+      fname = rec_fex_elem_field_name (rec_fex_get (recutils_ranking->sort_by,
+                                                    i));
+      f1 = rec_record_get_field_by_name (r1->record, fname, 0);
+      f2 = rec_record_get_field_by_name (r2->record, fname, 0);
+      if (f1 == NULL || f2 == NULL)
+        res = (f1 != NULL) - (f2 != NULL);
+      else if (recutils_ranking->types[i])
+        res = rec_type_values_cmp (recutils_ranking->types[i],
+                                   rec_field_value (f1), rec_field_value (f2));
+      else
+        res = strcmp (rec_field_value (f1), rec_field_value (f2));
+    }
+  if (res == 0)
+    res = (r1->position > r2->position) - (r1->position < r2->position);
+  return res;
+}
+
+/* Restore the order of the max-heap HEAP of NUM records after its
+   element I got smaller.  */
+
+static void
+recutils_heap_sift_down (struct recutils_ranked_s *heap, size_t num,
+                         size_t i)
+{
+  struct recutils_ranked_s tmp;
+  size_t child;
+  while ((child = 2 * i + 1) < num)
+    {
+      if (child + 1 < num
+          && recutils_ranked_cmp (&heap[child + 1], &heap[child]) > 0)
+        child++;
+      if (recutils_ranked_cmp (&heap[child], &heap[i]) <= 0)
+        break;
+      tmp = heap[i];
+      heap[i] = heap[child];
+      heap[child] = tmp;
+      i = child;
+    }
+}
+
+/* Restore the order of the max-heap HEAP after adding its element
+   I.  */
+
+static void
+recutils_heap_sift_up (struct recutils_ranked_s *heap, size_t i)
+{
+  struct recutils_ranked_s tmp;
+  while (i > 0 && recutils_ranked_cmp (&heap[(i - 1) / 2], &heap[i]) < 0)
+    {
+      tmp = heap[i];
+      heap[i] = heap[(i - 1) / 2];
+      heap[(i - 1) / 2] = tmp;
+      i = (i - 1) / 2;
+    }
+}
+
+/* Add CAND to the max-heap HEAP of *NUM records, keeping the K
+   smallest ones.  */
+
+static void
+recutils_heap_offer (struct recutils_ranked_s *heap, size_t *num, size_t k,
+                     const struct recutils_ranked_s *cand)
+{
+  if (*num < k)
+    {
+      heap[*num] = *cand;
+      recutils_heap_sift_up (heap, (*num)++);
+    }
+  else if (k > 0 && recutils_ranked_cmp (cand, &heap[0]) < 0)
+    {
+      heap[0] = *cand;
+      recutils_heap_sift_down (heap, *num, 0);
+    }
+}
+
+/* Return 'true' if RECORD contains NEEDLE, if not NULL, or else
+   matches SEXP, unless it is None.  */
+
+static bool
+recutils_record_match_p (rec_record_t record,
+                         const struct recutils_needle_s *needle, sex *sexp)
+{
+  bool status;
+  if (needle)
+    return recutils_record_contains_p (record, needle);
+  if ((PyObject *) sexp != Py_None)
+    return recutils_sex_eval (sexp, record, &status) && status;
+  return true;
+}
+
+/* Answer a query returning at most LIMIT records, or all of them if
+   LIMIT is negative, after skipping the first OFFSET, selecting
+   records of the record set of TYPE either with SEXP or with
+   FAST_STRING.  Without SORT_BY the scan stops as soon as enough
+   records are found.  With SORT_BY, which needs a LIMIT, the first
+   OFFSET + LIMIT records in sort order are kept in a max-heap while
+   scanning, whose top is replaced by any better record, so that only
+   those records are ever sorted or copied.  Records are compared by
+   the types declared in the descriptor only if FLAGS ask for it, like
+   the other query paths, which sort the resulting record set.  */
+
+static bool
+recutils_limit_query (recdb *self, const char *type, sex *sexp,
+                      const char *fast_string, rec_fex_t fex,
+                      rec_fex_t sort_by, int flags, Py_ssize_t limit,
+                      Py_ssize_t offset, rec_rset_t *res)
+{
+  struct recutils_needle_s needle;
+  struct recutils_ranking_s ranking;
+  struct recutils_ranked_s *heap = NULL, cand;
+  rec_rset_t rset;
+  rec_record_t *records;
+  rec_mset_iterator_t iter;
+  const void *data;
+  size_t i, k, num_records, num = 0, num_matches = 0, position = 0;
+
+  if (limit < 0 && (offset == 0 || sort_by))
+    return false;
+  if (fast_string)
+    {
+      if ((PyObject *) sexp != Py_None)
+        return false;
+      recutils_needle_init (&needle, fast_string, flags & REC_F_ICASE);
+    }
+  else if (flags & REC_F_ICASE)
+    return false;
+  if (!recutils_sort_kept_p (fex, sort_by))
+    return false;
+  rset = rec_db_get_rset_by_type (self->rdb, type);
+  if (rset == NULL)
+    return false;
+
+  /* K is the number of records to keep.  */
+  num_records = rec_rset_num_records (rset);
+  k = num_records;
+  if (limit >= 0 && (size_t) limit < num_records
+      && (size_t) offset < num_records - (size_t) limit)
+    k = (size_t) offset + (size_t) limit;
+  records = malloc ((k + 1) * sizeof (rec_record_t));
+  ranking.types = NULL;
+  if (sort_by)
+    heap = malloc ((k + 1) * sizeof (struct recutils_ranked_s));
+  if (records == NULL
+      || (sort_by && (heap == NULL
+                      || !recutils_ranking_init (&ranking, rset, sort_by,
+                                                 flags))))
+    {
+      free (records);
+      free (ranking.types);
+      free (heap);
+      *res = NULL;
+      return true;
+    }
+  recutils_ranking = &ranking;
+
+  iter = rec_mset_iterator (rec_rset_mset (rset));
+  while (k > 0 && rec_mset_iterator_next (&iter, MSET_RECORD, &data, NULL))
+    {
+      cand.record = (rec_record_t) data;
+      cand.position = position++;
+      if (!recutils_record_match_p (cand.record,
+                                    fast_string ? &needle : NULL, sexp))
+        continue;
+      if (sort_by)
+        recutils_heap_offer (heap, &num, k, &cand);
+      else if (num_matches++ >= (size_t) offset)
+        {
+          if (limit >= 0 && num >= (size_t) limit)
+            break;
+          records[num++] = cand.record;
+        }
+    }
+  rec_mset_iterator_free (&iter);
+
+  if (sort_by)
+    {
+      qsort (heap, num, sizeof (struct recutils_ranked_s),
+             recutils_ranked_cmp);
+      for (i = offset; i < num; i++)
+        records[i - offset] = heap[i].record;
+      num = num > (size_t) offset ? num - (size_t) offset : 0;
+    }
+  *res = recutils_index_result (rset, records, num, fex, flags);
+  free (records);
+  free (ranking.types);
+  free (heap);
+  return true;
+}
+
+/* Return a record set holding copies of the records of RSET from
+   OFFSET on, at most LIMIT of them unless LIMIT is negative, and of
+   its descriptor.  RSET is destroyed.  Return NULL if there is not
+   enough memory.  */
+
+static rec_rset_t
+recutils_rset_window (rec_rset_t rset, Py_ssize_t limit, Py_ssize_t offset)
+{
+  rec_rset_t res;
+  rec_record_t descriptor, rec;
+  rec_mset_iterator_t iter;
+  const void *data;
+  size_t position = 0;
+
+  res = rec_rset_new ();
+  descriptor = rec_rset_descriptor (rset);
+  if (res && descriptor)
+    {
+      descriptor = rec_record_dup (descriptor);
+      if (descriptor == NULL)
+        {
+          rec_rset_destroy (res);
+          res = NULL;
+        }
+      else
+        rec_rset_set_descriptor (res, descriptor);
+    }
+  iter = rec_mset_iterator (rec_rset_mset (rset));
+  while (res && (limit < 0 || position < (size_t) offset + (size_t) limit)
+         && rec_mset_iterator_next (&iter, MSET_RECORD, &data, NULL))
+    {
+      if (position++ < (size_t) offset)
+        continue;
+      rec = rec_record_dup ((rec_record_t) data);
+      if (rec == NULL
+          || !rec_mset_append (rec_rset_mset (res), MSET_RECORD,
+                               (void *) rec, MSET_ANY))
+        {
+          if (rec)
+            rec_record_destroy (rec);
+          rec_rset_destroy (res);
+          res = NULL;
+        }
+    }
+  rec_mset_iterator_free (&iter);
+  rec_rset_destroy (rset);
+  return res;
+}
+
+/* If the records selected by a delete or set operation are only
+   selected by FAST_STRING, store in *FOUND the index buffer selecting
+   them and return 'true'.  *FOUND is NULL if there was not enough
+   memory.  */
+
+static bool
+recutils_fast_string_select (recdb *self, const char *type, size_t *index,
+                             sex *sexp, const char *fast_string,
+                             size_t random, int flags, size_t **found)
+{
+  rec_rset_t rset;
+  if (fast_string == NULL || index || random || (PyObject *) sexp != Py_None)
+    return false;
+  rset = rec_db_get_rset_by_type (self->rdb, type);
+  if (rset == NULL)
+    return false;
+  *found = recutils_fast_string_index (rset, fast_string,
+                                       flags & REC_F_ICASE);
+  return true;
+}
+
+/*
+ * QUERY CACHE
+ *
+ * Databases count the mutations made through their methods.  Each
+ * record set type has its own generation, bumped by insert, delete
+ * and set on that type, and the EPOCH of the database is bumped by
+ * the calls which may replace whole record sets: loads,
+ * pyinsert_rset and pyremove_rset.  MUTATIONS counts them all.
+ *
+ * When enabled with set_query_cache_size, the results of queries are
+ * cached by their arguments along with the generation they were
+ * computed at, and served again as copies while the generation still
+ * holds.  Queries with a join depend on several record sets and are
+ * checked against MUTATIONS instead.  Random queries are never
+ * cached.  Changes made to records or fields outside the database
+ * methods are not noticed.
+ */
+
+struct recutils_generation_s
+{
+  char *type;
+  unsigned long generation;
+  struct recutils_generation_s *next;
+};
+
+struct recutils_query_cache_s
+{
+  PyObject *entries;
+  size_t maxsize;
+  size_t hits;
+  size_t misses;
+};
+
+/* Cached result of a query on TYPE, with a join if JOIN.  */
+
+struct recutils_cached_query_s
+{
+  rec_rset_t rset;
+  char *type;
+  bool join;
+  unsigned long epoch;
+  unsigned long generation;
+};
+
+static unsigned long
+recutils_generation (recdb *self, const char *type)
+{
+  struct recutils_generation_s *gen;
+  for (gen = self->generations; gen; gen = gen->next)
+    if (recutils_type_equal_p (gen->type, type))
+      return gen->generation;
+  return 0;
+}
+
+/* Record a mutation of the record sets of type TYPE, or of all the
+   record sets of SELF if ALL.  */
+
+static void
+recutils_generation_bump (recdb *self, const char *type, bool all)
+{
+  struct recutils_generation_s *gen;
+  self->mutations++;
+  if (all)
+    {
+      self->epoch++;
+      return;
+    }
+  for (gen = self->generations; gen; gen = gen->next)
+    if (recutils_type_equal_p (gen->type, type))
+      {
+        gen->generation++;
+        return;
+      }
+  gen = malloc (sizeof (struct recutils_generation_s));
+  if (gen == NULL || (type && (gen->type = strdup (type)) == NULL))
+    {
+      /* Without a counter for TYPE, forget everything.  */
+      free (gen);
+      self->epoch++;
+      return;
+    }
+  if (type == NULL)
+    gen->type = NULL;
+  gen->generation = 1;
+  gen->next = self->generations;
+  self->generations = gen;
+}
+
+static void
+recutils_generations_free (struct recutils_generation_s *gen)
+{
+  struct recutils_generation_s *next;
+  for (; gen; gen = next)
+    {
+      next = gen->next;
+      free (gen->type);
+      free (gen);
+    }
+}
+
+static void
+recutils_cached_query_destroy (PyObject *capsule)
+{
+  struct recutils_cached_query_s *entry
+    = PyCapsule_GetPointer (capsule, "recutils.cached_query");
+  rec_rset_destroy (entry->rset);
+  free (entry->type);
+  free (entry);
+}
+
+/* Return the current generation of the record sets a query on TYPE,
+   with or without a join, depends on.  */
+
+static unsigned long
+recutils_query_generation (recdb *self, const char *type, bool join)
+{
+  return join ? self->mutations : recutils_generation (self, type);
+}
+
+static bool
+recutils_cached_query_fresh_p (recdb *self,
+                               struct recutils_cached_query_s *entry)
+{
+  return entry->epoch == self->epoch
+    && entry->generation == recutils_query_generation (self, entry->type,
+                                                       entry->join);
+}
+
+/* Return the cache key of a query, or NULL if the query can't be
+   cached.  */
+
+static PyObject *
+recutils_query_key (const char *type, const char *join, const char *index,
+                    sex *sexp, const char *fast_string, size_t random,
+                    rec_fex_t fex, const char *password, rec_fex_t group_by,
+                    rec_fex_t sort_by, int flags, Py_ssize_t limit,
+                    Py_ssize_t offset)
+{
+  PyObject *key;
+  char *strs[3];
+  rec_fex_t fexes[3];
+  size_t i;
+
+  if (random || ((PyObject *) sexp != Py_None && sexp->expr == NULL))
+    return NULL;
+  fexes[0] = fex;
+  fexes[1] = group_by;
+  fexes[2] = sort_by;
+  for (i = 0; i < 3; i++)
+    strs[i] = fexes[i] ? rec_fex_str (fexes[i], REC_FEX_SUBSCRIPTS) : NULL;
+  if ((PyObject *) sexp == Py_None)
+    key = Py_BuildValue ("(zzzOzzzzzinn)", type, join, index, Py_None,
+                         fast_string, strs[0], password, strs[1], strs[2],
+                         flags, limit, offset);
+  else
+    key = Py_BuildValue ("(zzz(si)zzzzzinn)", type, join, index, sexp->expr,
+                         (int) sexp->case_insensitive, fast_string, strs[0],
+                         password, strs[1], strs[2], flags, limit, offset);
+  for (i = 0; i < 3; i++)
+    free (strs[i]);
+  if (key == NULL)
+    PyErr_Clear ();
+  return key;
+}
+
+/* Return a copy of the cached result of the query identified by KEY,
+   or NULL if there is none or it is stale.  */
+
+static rec_rset_t
+recutils_query_cache_get (recdb *self, PyObject *key)
+{
+  struct recutils_cached_query_s *entry;
+  PyObject *capsule;
+  rec_rset_t res;
+
+  capsule = PyDict_GetItem (self->query_cache->entries, key);
+  if (capsule == NULL)
+    {
+      self->query_cache->misses++;
+      return NULL;
+    }
+  entry = PyCapsule_GetPointer (capsule, "recutils.cached_query");
+  if (!recutils_cached_query_fresh_p (self, entry))
+    {
+      PyDict_DelItem (self->query_cache->entries, key);
+      self->query_cache->misses++;
+      return NULL;
+    }
+  res = rec_rset_dup (entry->rset);
+  if (res)
+    self->query_cache->hits++;
+  return res;
+}
+
+/* Remove the stale entries of the cache of SELF, and all of them if
+   that doesn't make room for a new one.  */
+
+static void
+recutils_query_cache_make_room (recdb *self)
+{
+  struct recutils_query_cache_s *cache = self->query_cache;
+  struct recutils_cached_query_s *entry;
+  PyObject *key, *capsule, *stale;
+  Py_ssize_t pos = 0, i;
+
+  if ((size_t) PyDict_Size (cache->entries) < cache->maxsize)
+    return;
+  stale = PyList_New (0);
+  while (stale && PyDict_Next (cache->entries, &pos, &key, &capsule))
+    {
+      entry = PyCapsule_GetPointer (capsule, "recutils.cached_query");
+      if (!recutils_cached_query_fresh_p (self, entry))
+        PyList_Append (stale, key);
+    }
+  for (i = 0; stale && i < PyList_GET_SIZE (stale); i++)
+    PyDict_DelItem (cache->entries, PyList_GET_ITEM (stale, i));
+  Py_XDECREF (stale);
+  if ((size_t) PyDict_Size (cache->entries) >= cache->maxsize)
+    PyDict_Clear (cache->entries);
+}
+
+/* Store a copy of RES, the result of the query identified by KEY, in
+   the cache of SELF.  */
+
+static void
+recutils_query_cache_put (recdb *self, PyObject *key, const char *type,
+                          const char *join, rec_rset_t res)
+{
+  struct recutils_cached_query_s *entry;
+  PyObject *capsule;
+
+  recutils_query_cache_make_room (self);
+  entry = malloc (sizeof (struct recutils_cached_query_s));
+  if (entry == NULL)
+    return;
+  entry->rset = rec_rset_dup (res);
+  entry->type = type ? strdup (type) : NULL;
+  entry->join = join != NULL;
+  entry->epoch = self->epoch;
+  entry->generation = recutils_query_generation (self, type, entry->join);
+  if (entry->rset == NULL || (type && entry->type == NULL))
+    {
+      if (entry->rset)
+        rec_rset_destroy (entry->rset);
+      free (entry->type);
+      free (entry);
+      return;
+    }
+  capsule = PyCapsule_New (entry, "recutils.cached_query",
+                           recutils_cached_query_destroy);
+  if (capsule == NULL)
+    {
+      rec_rset_destroy (entry->rset);
+      free (entry->type);
+      free (entry);
+      PyErr_Clear ();
+      return;
+    }
+  if (PyDict_SetItem (self->query_cache->entries, key, capsule) < 0)
+    PyErr_Clear ();
+  Py_DECREF (capsule);
+}
+
+static void
+recutils_query_cache_free (struct recutils_query_cache_s *cache)
+{
+  if (cache)
+    {
+      Py_XDECREF (cache->entries);
+      free (cache);
+    }
+}
+
+/*
+ * INCREMENTAL SYNC
+ *
+ * A database remembers the file it was last loaded from or written
+ * to, along with the size, modification time and inode of the file
+ * at that moment, the number of mutations made so far, and the number
+ * of records of its last record set.  recdb.sync appends the new
+ * records to that file when the only mutations since then are records
+ * appended by insert to the last record set, and the file is
+ * unchanged.  Otherwise the whole database is written.
+ */
+
+struct recutils_sync_s
+{
+  char *filename;
+  off_t size;
+  time_t mtime;
+  ino_t ino;
+  unsigned long mutations;
+  unsigned long appends;
+  rec_rset_t tail;
+  size_t tail_records;
+};
+
+static void
+recutils_sync_free (struct recutils_sync_s *sync)
+{
+  if (sync)
+    {
+      free (sync->filename);
+      free (sync);
+    }
+}
+
+/* Remember that the contents of SELF are the contents of the file
+   FILENAME.  */
+
+static void
+recutils_sync_mark (recdb *self, const char *filename)
+{
+  struct recutils_sync_s *sync;
+  struct stat st;
+  size_t num_rsets;
+
+  recutils_sync_free (self->sync);
+  self->sync = NULL;
+  if (stat (filename, &st) != 0)
+    return;
+  sync = malloc (sizeof (struct recutils_sync_s));
+  if (sync == NULL || (sync->filename = strdup (filename)) == NULL)
+    {
+      free (sync);
+      return;
+    }
+  sync->size = st.st_size;
+  sync->mtime = st.st_mtime;
+  sync->ino = st.st_ino;
+  sync->mutations = self->mutations;
+  sync->appends = self->appends;
+  num_rsets = rec_db_size (self->rdb);
+  sync->tail = num_rsets ? rec_db_get_rset (self->rdb, num_rsets - 1) : NULL;
+  sync->tail_records = sync->tail ? rec_rset_num_records (sync->tail) : 0;
+  self->sync = sync;
+}
+
+/* Return 'true' if FILENAME can be brought up to date by appending
+   the records added to the last record set of SELF.  */
+
+static bool
+recutils_sync_append_p (recdb *self, const char *filename)
+{
+  struct recutils_sync_s *sync = self->sync;
+  struct stat st;
+  size_t num_rsets = rec_db_size (self->rdb);
+
+  return sync
+    && strcmp (sync->filename, filename) == 0
+    && stat (filename, &st) == 0
+    && st.st_size == sync->size
+    && st.st_mtime == sync->mtime
+    && st.st_ino == sync->ino
+    && self->mutations - sync->mutations == self->appends - sync->appends
+    && num_rsets > 0
+    && rec_db_get_rset (self->rdb, num_rsets - 1) == sync->tail
+    && rec_rset_num_records (sync->tail)
+       == sync->tail_records + (self->appends - sync->appends);
+}
+
+/* Append the records added to the last record set of SELF since the
+   last sync to FILENAME.  */
+
+static bool
+recutils_sync_append (recdb *self, const char *filename)
+{
+  struct recutils_sync_s *sync = self->sync;
+  rec_writer_t writer;
+  rec_record_t record;
+  FILE *out;
+  size_t i, num_records;
+  int last = '\n';
+  bool success = true;
+
+  out = fopen (filename, "a+");
+  if (out == NULL)
+    {
+      PyErr_SetString (RecError, strerror (errno));
+      return false;
+    }
+  if (sync->size > 0 && fseeko (out, -1, SEEK_END) == 0)
+    last = fgetc (out);
+  fseeko (out, 0, SEEK_END);
+  writer = rec_writer_new (out);
+  if (writer == NULL)
+    {
+      fclose (out);
+      PyErr_NoMemory ();
+      return false;
+    }
+  /* Records are separated by a blank line.  */
+  if (last != '\n')
+    fputc ('\n', out);
+  num_records = rec_rset_num_records (sync->tail);
+  for (i = sync->tail_records; success && i < num_records; i++)
+    {
+      record = rec_mset_get_at (rec_rset_mset (sync->tail), MSET_RECORD, i);
+      success = record && fputc ('\n', out) != EOF
+        && rec_write_record (writer, record);
+    }
+  rec_writer_destroy (writer);
+  if (fclose (out) != 0 || !success)
+    {
+      PyErr_SetString (RecError, "error appending to the file");
+      return false;
+    }
+  return true;
+}
+
+/* Durability requested when writing a file: none, flush the data
+   (fdatasync), or flush the data, the metadata and, for atomic
+   writes, the directory entry (fsync).  */
+
+enum recutils_fsync_e
+{
+  RECUTILS_FSYNC_NONE,
+  RECUTILS_FSYNC_DATA,
+  RECUTILS_FSYNC_FULL
+};
+
+#define RECUTILS_WRITE_BUFFER_SIZE (1024 * 1024)
+
+static bool
+recutils_parse_fsync (const char *str, enum recutils_fsync_e *mode)
+{
+  if (strcmp (str, "none") == 0)
+    *mode = RECUTILS_FSYNC_NONE;
+  else if (strcmp (str, "data") == 0)
+    *mode = RECUTILS_FSYNC_DATA;
+  else if (strcmp (str, "full") == 0)
+    *mode = RECUTILS_FSYNC_FULL;
+  else
+    {
+      PyErr_SetString (PyExc_ValueError,
+                       "fsync must be 'none', 'data' or 'full'");
+      return false;
+    }
+  return true;
+}
+
+/*
+ * WRITE-AHEAD LOG
+ *
+ * A database can be bound to a log file with open_wal.  Every
+ * successful insert, delete or set is then appended to the log as a
+ * compact entry holding the operation and its arguments, so that the
+ * mutations survive without rewriting the database file.  The log
+ * applies on top of a base file: the file the database was loaded
+ * from or last written to.  Opening the log again after loading the
+ * base replays its entries, and compact_wal writes the database over
+ * the base and empties the log.
+ *
+ * The log starts with a header identifying the base by its size,
+ * modification time in nanoseconds and inode.  Before the database
+ * replaces the base, for instance in compact_wal, the header is marked
+ * as rebasing, so that a log whose base has been replaced by a write
+ * interrupted before the log could be emptied is known to be stale
+ * and discarded when opened.  A log whose base has been replaced in
+ * any other way still holds the only copy of its entries, and opening
+ * it is refused unless the caller asks to discard them.
+ *
+ * Each entry is made of the length of its payload and a checksum of
+ * it, both 32-bit, followed by the payload.  A torn entry at the end
+ * of the log, left by a crash, is dropped when the log is replayed.
+ */
+
+#define RECUTILS_WAL_MAGIC "RECWAL1\n"
+
+enum recutils_wal_op_e
+{
+  RECUTILS_WAL_INSERT = 1,
+  RECUTILS_WAL_DELETE,
+  RECUTILS_WAL_SET
+};
+
+struct recutils_wal_header_s
+{
+  char magic[8];
+  unsigned long long size;
+  long long mtime;
+  unsigned long long ino;
+  unsigned long long rebasing;
+};
+
+struct recutils_wal_s
+{
+  FILE *out;
+  char *filename;
+  char *base;
+  enum recutils_fsync_e mode;
+};
+
+/* Arguments of a logged mutation.  EXPR and CASE_INSENSITIVE describe
+   the sex, FEX the fex of set in REC_FEX_SUBSCRIPTS form, and RECORD
+   the record of insert in rec format.  */
+
+struct recutils_wal_entry_s
+{
+  int op;
+  const char *type;
+  const char *index;
+  const char *expr;
+  int case_insensitive;
+  const char *fast_string;
+  long long random;
+  const char *password;
+  const char *fex;
+  int action;
+  const char *action_arg;
+  const char *record;
+  int flags;
+};
+
+/* Growable buffer log entries, and snapshots (see SNAPSHOTS), are
+   encoded into.  Strings are stored as their length, or
+   RECUTILS_BUF_NULL for NULL, followed by their bytes and a NUL.  */
+
+#define RECUTILS_BUF_NULL 0xffffffffU
+
+struct recutils_buf_s
+{
+  char *data;
+  size_t size;
+  size_t allocated;
+  bool nomem;
+};
+
+static unsigned int
+recutils_wal_checksum (const char *data, size_t size)
+{
+  unsigned int hash = 2166136261U;
+  size_t i;
+  for (i = 0; i < size; i++)
+    hash = (hash ^ (unsigned char) data[i]) * 16777619U;
+  return hash;
+}
+
+static void
+recutils_buf_put (struct recutils_buf_s *buf, const void *data,
+                  size_t size)
+{
+  char *tmp;
+  size_t allocated;
+  if (buf->nomem)
+    return;
+  if (buf->size + size > buf->allocated)
+    {
+      allocated = buf->allocated ? buf->allocated : 256;
+      while (allocated < buf->size + size)
+        allocated *= 2;
+      tmp = realloc (buf->data, allocated);
+      if (tmp == NULL)
+        {
+          buf->nomem = true;
+          return;
+        }
+      buf->data = tmp;
+      buf->allocated = allocated;
+    }
+  memcpy (buf->data + buf->size, data, size);
+  buf->size += size;
+}
+
+static void
+recutils_buf_put_int (struct recutils_buf_s *buf, long long num)
+{
+  recutils_buf_put (buf, &num, sizeof (num));
+}
+
+/* Strings are stored with their terminating NUL, so that decoded
+   entries can point into the payload.  */
+
+static void
+recutils_buf_put_str (struct recutils_buf_s *buf, const char *str)
+{
+  unsigned int len = str ? strlen (str) : RECUTILS_BUF_NULL;
+  recutils_buf_put (buf, &len, sizeof (len));
+  if (str)
+    recutils_buf_put (buf, str, len + 1);
+}
+
+static bool
+recutils_buf_get (const char **p, const char *end, void *data, size_t size)
+{
+  if ((size_t) (end - *p) < size)
+    return false;
+  memcpy (data, *p, size);
+  *p += size;
+  return true;
+}
+
+static bool
+recutils_buf_get_int (const char **p, const char *end, long long *num)
+{
+  return recutils_buf_get (p, end, num, sizeof (*num));
+}
+
+static bool
+recutils_buf_get_str (const char **p, const char *end, const char **str)
+{
+  unsigned int len;
+  if (!recutils_buf_get (p, end, &len, sizeof (len)))
+    return false;
+  if (len == RECUTILS_BUF_NULL)
+    {
+      *str = NULL;
+      return true;
+    }
+  if ((size_t) (end - *p) < (size_t) len + 1 || (*p)[len] != '\0')
+    return false;
+  *str = *p;
+  *p += len + 1;
+  return true;
+}
+
+/* Decode the payload of SIZE bytes at DATA into ENTRY.  */
+
+static bool
+recutils_wal_decode (const char *data, size_t size,
+                     struct recutils_wal_entry_s *entry)
+{
+  const char *p = data, *end = data + size;
+  long long op, case_insensitive, action, flags;
+  bool success;
+
+  success = recutils_buf_get_int (&p, end, &op)
+    && recutils_buf_get_str (&p, end, &entry->type)
+    && recutils_buf_get_str (&p, end, &entry->index)
+    && recutils_buf_get_str (&p, end, &entry->expr)
+    && recutils_buf_get_int (&p, end, &case_insensitive)
+    && recutils_buf_get_str (&p, end, &entry->fast_string)
+    && recutils_buf_get_int (&p, end, &entry->random)
+    && recutils_buf_get_str (&p, end, &entry->password)
+    && recutils_buf_get_str (&p, end, &entry->fex)
+    && recutils_buf_get_int (&p, end, &action)
+    && recutils_buf_get_str (&p, end, &entry->action_arg)
+    && recutils_buf_get_str (&p, end, &entry->record)
+    && recutils_buf_get_int (&p, end, &flags)
+    && p == end;
+  entry->op = op;
+  entry->case_insensitive = case_insensitive;
+  entry->action = action;
+  entry->flags = flags;
+  return success;
+}
+
+/* Stamp the header HEADER with the identity of the file BASE.  */
+
+static bool
+recutils_wal_stamp (struct recutils_wal_header_s *header, const char *base)
+{
+  struct stat st;
+  memset (header, 0, sizeof (struct recutils_wal_header_s));
+  memcpy (header->magic, RECUTILS_WAL_MAGIC, sizeof (header->magic));
+  if (stat (base, &st) != 0)
+    return false;
+  header->size = st.st_size;
+  header->mtime = (long long) st.st_mtim.tv_sec * 1000000000
+    + st.st_mtim.tv_nsec;
+  header->ino = st.st_ino;
+  return true;
+}
+
+static bool
+recutils_wal_flush (struct recutils_wal_s *wal)
+{
+  if (fflush (wal->out) != 0)
+    return false;
+  if (wal->mode == RECUTILS_FSYNC_DATA)
+    return fdatasync (fileno (wal->out)) == 0;
+  if (wal->mode == RECUTILS_FSYNC_FULL)
+    return fsync (fileno (wal->out)) == 0;
+  return true;
+}
+
+/* Empty the log of WAL, stamping it with the current identity of its
+   base.  */
+
+static bool
+recutils_wal_reset (struct recutils_wal_s *wal)
+{
+  struct recutils_wal_header_s header;
+  if (!recutils_wal_stamp (&header, wal->base)
+      || ftruncate (fileno (wal->out), 0) != 0
+      || fseeko (wal->out, 0, SEEK_SET) != 0
+      || fwrite (&header, sizeof (header), 1, wal->out) != 1)
+    return false;
+  return recutils_wal_flush (wal);
+}
+
+/* Mark the header of the log of WAL as REBASING or not, keeping the
+   identity of its base.  */
+
+static bool
+recutils_wal_mark (struct recutils_wal_s *wal, bool rebasing)
+{
+  struct recutils_wal_header_s header;
+  if (!recutils_wal_stamp (&header, wal->base))
+    return false;
+  header.rebasing = rebasing;
+  if (fflush (wal->out) != 0
+      || fseeko (wal->out, 0, SEEK_SET) != 0
+      || fwrite (&header, sizeof (header), 1, wal->out) != 1
+      || !recutils_wal_flush (wal))
+    return false;
+  return fseeko (wal->out, 0, SEEK_END) == 0;
+}
+
+static void
+recutils_wal_free (struct recutils_wal_s *wal)
+{
+  if (wal)
+    {
+      if (wal->out)
+        fclose (wal->out);
+      free (wal->filename);
+      free (wal->base);
+      free (wal);
+    }
+}
+
+/* Append ENTRY to the log of SELF.  Return 'false' and set an
+   exception on error.  */
+
+static bool
+recutils_wal_append (recdb *self, struct recutils_wal_entry_s *entry)
+{
+  struct recutils_buf_s buf = { NULL, 0, 0, false };
+  unsigned int header[2];
+  bool success;
+
+  recutils_buf_put_int (&buf, entry->op);
+  recutils_buf_put_str (&buf, entry->type);
+  recutils_buf_put_str (&buf, entry->index);
+  recutils_buf_put_str (&buf, entry->expr);
+  recutils_buf_put_int (&buf, entry->case_insensitive);
+  recutils_buf_put_str (&buf, entry->fast_string);
+  recutils_buf_put_int (&buf, entry->random);
+  recutils_buf_put_str (&buf, entry->password);
+  recutils_buf_put_str (&buf, entry->fex);
+  recutils_buf_put_int (&buf, entry->action);
+  recutils_buf_put_str (&buf, entry->action_arg);
+  recutils_buf_put_str (&buf, entry->record);
+  recutils_buf_put_int (&buf, entry->flags);
+  if (buf.nomem)
+    {
+      free (buf.data);
+      PyErr_NoMemory ();
+      return false;
+    }
+  header[0] = buf.size;
+  header[1] = recutils_wal_checksum (buf.data, buf.size);
+  success = fwrite (header, sizeof (header), 1, self->wal->out) == 1
+    && fwrite (buf.data, buf.size, 1, self->wal->out) == 1
+    && recutils_wal_flush (self->wal);
+  free (buf.data);
+  if (!success)
+    PyErr_SetString (RecError, strerror (errno));
+  return success;
+}
+
+/* Log a mutation of SELF, if it has a log.  SEXP, FEX and RECORD may
+   be NULL.  Return 'false' and set an exception on error.  */
+
+static bool
+recutils_wal_log (recdb *self, int op, const char *type, const char *index,
+                  sex *sexp, const char *fast_string, size_t random,
+                  const char *password, rec_fex_t fex, int action,
+                  const char *action_arg, rec_record_t record, int flags)
+{
+  struct recutils_wal_entry_s entry;
+  rec_writer_t writer;
+  char *fex_str = NULL, *record_str = NULL;
+  size_t record_size;
+  bool success;
+
+  if (self->wal == NULL)
+    return true;
+  entry.op = op;
+  entry.type = type;
+  entry.index = index;
+  entry.expr = sexp && (PyObject *) sexp != Py_None ? sexp->expr : NULL;
+  entry.case_insensitive = entry.expr ? sexp->case_insensitive : 0;
+  entry.fast_string = fast_string;
+  entry.random = random;
+  entry.password = password;
+  entry.action = action;
+  entry.action_arg = action_arg;
+  entry.flags = flags;
+  if (fex)
+    fex_str = rec_fex_str (fex, REC_FEX_SUBSCRIPTS);
+  if (record)
+    {
+      writer = rec_writer_new_str (&record_str, &record_size);
+      if (writer)
+        {
+          rec_write_record (writer, record);
+          rec_writer_destroy (writer);
+        }
+    }
+  entry.fex = fex_str;
+  entry.record = record_str;
+  if ((fex && fex_str == NULL) || (record && record_str == NULL))
+    {
+      PyErr_NoMemory ();
+      success = false;
+    }
+  else
+    success = recutils_wal_append (self, &entry);
+  free (fex_str);
+  free (record_str);
+  return success;
+}
+
+/* Return 'true' if a mutation can be logged and replayed with the same
+   result, setting an exception otherwise.  Random selections and
+   passwords used to select records are refused.  */
+
+static bool
+recutils_wal_loggable_p (recdb *self, size_t random, const char *password)
+{
+  if (self->wal == NULL || (!random && !(password && *password)))
+    return true;
+  PyErr_SetString (RecError, "random selections and passwords can't be"
+                   " recorded in the write-ahead log");
+  return false;
+}
+
+/* Return 'true' if FILENAME is the base of the log of SELF.  The base
+   is then only ever replaced atomically, with at least the fsync mode
+   of the log, so that a crash never leaves it truncated while the log
+   still holds the entries to replay over it.  */
+
+static bool
+recutils_wal_base_p (recdb *self, const char *filename)
+{
+  return self->wal != NULL && strcmp (self->wal->base, filename) == 0;
+}
+
+/* Mark the log of SELF as rebasing if FILENAME, which the database is
+   about to be written to, is its base.  Return 'false' and set an
+   exception on error.  */
+
+static bool
+recutils_wal_begin_rebase (recdb *self, const char *filename)
+{
+  if (!recutils_wal_base_p (self, filename)
+      || recutils_wal_mark (self->wal, true))
+    return true;
+  PyErr_SetString (RecError, strerror (errno));
+  return false;
+}
+
+/* Undo recutils_wal_begin_rebase after the write of FILENAME failed,
+   leaving the base as it was.  */
+
+static void
+recutils_wal_abort_rebase (recdb *self, const char *filename)
+{
+  if (recutils_wal_base_p (self, filename))
+    recutils_wal_mark (self->wal, false);
+}
+
+/* Empty the log of SELF if FILENAME, which the database has just been
+   written to, is its base.  Return 'false' and set an exception on
+   error.  */
+
+static bool
+recutils_wal_rebase (recdb *self, const char *filename)
+{
+  if (self->wal == NULL || strcmp (self->wal->base, filename) != 0
+      || recutils_wal_reset (self->wal))
+    return true;
+  PyErr_SetString (RecError, strerror (errno));
+  return false;
+}
+
+/* Apply the mutation described by ENTRY to DB.  */
+
+static bool
+recutils_wal_apply (rec_db_t db, struct recutils_wal_entry_s *entry)
+{
+  rec_sex_t sx = NULL;
+  rec_fex_t fx = NULL;
+  rec_record_t record = NULL;
+  size_t *index = NULL;
+  bool success = false;
+
+  /* The payload doesn't keep the index buffer aligned.  */
+  if (entry->index && (index = (size_t *) strdup (entry->index)) == NULL)
+    return false;
+  if (entry->expr && ((sx = rec_sex_new (entry->case_insensitive)) == NULL
+                      || !rec_sex_compile (sx, entry->expr)))
+    goto exit;
+  if (entry->fex
+      && (fx = rec_fex_new (entry->fex, REC_FEX_SUBSCRIPTS)) == NULL)
+    goto exit;
+  if (entry->record
+      && (record = rec_parse_record_str (entry->record)) == NULL)
+    goto exit;
+
+  switch (entry->op)
+    {
+    case RECUTILS_WAL_INSERT:
+      success = record
+        && rec_db_insert (db, entry->type, index, sx,
+                          entry->fast_string, entry->random,
+                          entry->password, record, entry->flags);
+      break;
+    case RECUTILS_WAL_DELETE:
+      success = rec_db_delete (db, entry->type, index, sx,
+                               entry->fast_string, entry->random,
+                               entry->flags);
+      break;
+    case RECUTILS_WAL_SET:
+      success = rec_db_set (db, entry->type, index, sx,
+                            entry->fast_string, entry->random, fx,
+                            entry->action, entry->action_arg, entry->flags);
+      break;
+    }
+
+ exit:
+  if (sx)
+    rec_sex_destroy (sx);
+  if (fx)
+    rec_fex_destroy (fx);
+  if (record)
+    rec_record_destroy (record);
+  free (index);
+  return success;
+}
+
+/* Replay the entries of the log IN, positioned after its header, on
+   DB.  Store in *END the offset following the last complete entry and
+   in *NUM_ENTRIES the number of entries.  */
+
+static void
+recutils_wal_replay (FILE *in, rec_db_t db, off_t *end, size_t *num_entries)
+{
+  struct recutils_wal_entry_s entry;
+  unsigned int header[2];
+  char *payload = NULL, *tmp;
+  size_t allocated = 0;
+
+  *num_entries = 0;
+  *end = ftello (in);
+  while (fread (header, sizeof (header), 1, in) == 1)
+    {
+      if (header[0] > allocated)
+        {
+          tmp = realloc (payload, header[0]);
+          if (tmp == NULL)
+            break;
+          payload = tmp;
+          allocated = header[0];
+        }
+      if (fread (payload, 1, header[0], in) != header[0]
+          || recutils_wal_checksum (payload, header[0]) != header[1]
+          || !recutils_wal_decode (payload, header[0], &entry))
+        break;
+      recutils_wal_apply (db, &entry);
+      *end = ftello (in);
+      (*num_entries)++;
+    }
+  free (payload);
+}
+
+/*
+ * LAZY LOADING
+ *
+ * pyloadfile with LAZY maps the file in memory and only scans it for
+ * the boundaries of its record sets, building a directory of their
+ * types, offsets and lengths, after which the mapping is released.
+ * The database gets an empty record set of the right type in place
+ * of each of them, which is replaced by the record set read from the
+ * file and parsed the first time it is used.  Methods using a given
+ * type load that record set, and those using the whole database, such
+ * as pywritefile, load all of them.  The file is kept open until
+ * every record set is loaded.  Reading it, rather than keeping it
+ * mapped, turns a file truncated in the meantime into an error
+ * instead of a SIGBUS, and its size and modification time are checked
+ * before each read so that a file modified in place is not parsed.
+ */
+
+struct recutils_lazy_rset_s
+{
+  char *type;
+  size_t offset;
+  size_t length;
+  rec_rset_t placeholder;       /* NULL once loaded.  */
+};
+
+struct recutils_lazy_s
+{
+  char *filename;
+  char *data;                   /* Only mapped while scanning.  */
+  size_t size;
+  int fd;
+  struct timespec mtime;
+  struct recutils_lazy_rset_s *rsets;
+  size_t num_rsets;
+  size_t num_pending;
+};
+
+static void
+recutils_lazy_free (struct recutils_lazy_s *lazy)
+{
+  size_t i;
+  if (lazy)
+    {
+      if (lazy->data && lazy->size > 0)
+        munmap (lazy->data, lazy->size);
+      if (lazy->fd >= 0)
+        close (lazy->fd);
+      for (i = 0; i < lazy->num_rsets; i++)
+        free (lazy->rsets[i].type);
+      free (lazy->rsets);
+      free (lazy->filename);
+      free (lazy);
+    }
+}
+
+static bool
+recutils_lazy_add (struct recutils_lazy_s *lazy, size_t *allocated,
+                   const char *type, size_t type_len, size_t offset)
+{
+  struct recutils_lazy_rset_s *tmp;
+  if (lazy->num_rsets == *allocated)
+    {
+      *allocated = *allocated ? *allocated * 2 : 8;
+      tmp = realloc (lazy->rsets,
+                     *allocated * sizeof (struct recutils_lazy_rset_s));
+      if (tmp == NULL)
+        return false;
+      lazy->rsets = tmp;
+    }
+  tmp = &lazy->rsets[lazy->num_rsets];
+  tmp->type = NULL;
+  if (type && (tmp->type = strndup (type, type_len)) == NULL)
+    return false;
+  tmp->offset = offset;
+  tmp->length = 0;
+  tmp->placeholder = NULL;
+  if (lazy->num_rsets > 0)
+    tmp[-1].length = offset - tmp[-1].offset;
+  lazy->num_rsets++;
+  return true;
+}
+
+static bool
+recutils_lazy_blank_p (const char *line, const char *eol)
+{
+  for (; line < eol; line++)
+    if (*line != ' ' && *line != '\t')
+      return false;
+  return true;
+}
+
+/* Build the directory of the record sets of LAZY.  A record set
+   starts with the record holding its %rec field.  Records before the
+   first one form an anonymous record set, and comments before it are
+   left to it.  Return 'false' if there is not enough memory.  */
+
+static bool
+recutils_lazy_scan (struct recutils_lazy_s *lazy)
+{
+  const char *data = lazy->data, *end = lazy->data + lazy->size;
+  const char *line, *eol, *type, *type_end;
+  size_t allocated = 0, record_start = 0;
+  bool continued = false, blank = true;
+
+  for (line = data; line < end; line = eol + 1)
+    {
+      eol = memchr (line, '\n', end - line);
+      if (eol == NULL)
+        eol = end;
+      if (continued)
+        ;
+      else if (recutils_lazy_blank_p (line, eol))
+        blank = true;
+      else
+        {
+          if (blank)
+            record_start = line - data;
+          blank = false;
+          if (eol - line > 5 && memcmp (line, "%rec:", 5) == 0)
+            {
+              for (type = line + 5;
+                   type < eol && (*type == ' ' || *type == '\t'); type++)
+                ;
+              for (type_end = type;
+                   type_end < eol && !isspace ((unsigned char) *type_end);
+                   type_end++)
+                ;
+              if (!recutils_lazy_add (lazy, &allocated, type, type_end - type,
+                                      lazy->num_rsets ? record_start : 0))
+                return false;
+            }
+          else if (line[0] != '#' && lazy->num_rsets == 0
+                   && !recutils_lazy_add (lazy, &allocated, NULL, 0, 0))
+            return false;
+        }
+      continued = eol > line && eol[-1] == '\\';
+    }
+  if (lazy->num_rsets > 0)
+    lazy->rsets[lazy->num_rsets - 1].length
+      = lazy->size - lazy->rsets[lazy->num_rsets - 1].offset;
+  return true;
+}
+
+/* Read the record set ENTRY of LAZY from its file, returning it in a
+   newly allocated buffer.  Return NULL and set an exception if the
+   file has been modified since it was scanned or on error.  */
+
+static char *
+recutils_lazy_read (struct recutils_lazy_s *lazy,
+                    struct recutils_lazy_rset_s *entry)
+{
+  struct stat st;
+  char *buf;
+  size_t done = 0;
+  ssize_t n;
+
+  if (fstat (lazy->fd, &st) != 0)
+    {
+      PyErr_SetString (RecError, strerror (errno));
+      return NULL;
+    }
+  if ((size_t) st.st_size != lazy->size
+      || st.st_mtim.tv_sec != lazy->mtime.tv_sec
+      || st.st_mtim.tv_nsec != lazy->mtime.tv_nsec)
+    {
+      PyErr_Format (RecError, "%s has been modified since it was loaded",
+                    lazy->filename);
+      return NULL;
+    }
+  buf = malloc (entry->length ? entry->length : 1);
+  if (buf == NULL)
+    {
+      PyErr_NoMemory ();
+      return NULL;
+    }
+  while (done < entry->length)
+    {
+      n = pread (lazy->fd, buf + done, entry->length - done,
+                 entry->offset + done);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        {
+          if (n < 0)
+            PyErr_SetString (RecError, strerror (errno));
+          else
+            PyErr_Format (RecError, "%s has been modified since it was"
+                          " loaded", lazy->filename);
+          free (buf);
+          return NULL;
+        }
+      done += n;
+    }
+  return buf;
+}
+
+/* Parse the record set I of the directory of SELF and put it in place
+   of its placeholder.  Return 'false' and set an exception on
+   error.  */
+
+static bool
+recutils_lazy_load_rset (recdb *self, size_t i)
+{
+  struct recutils_lazy_s *lazy = self->lazy;
+  struct recutils_lazy_rset_s *entry = &lazy->rsets[i];
+  rec_parser_t parser;
+  rec_rset_t rset = NULL;
+  size_t pos, num_rsets = rec_db_size (self->rdb);
+  char *buf;
+  bool success;
+
+  for (pos = 0; pos < num_rsets; pos++)
+    if (rec_db_get_rset (self->rdb, pos) == entry->placeholder)
+      break;
+  /* The placeholder may have been removed from the database.  */
+  if (pos == num_rsets)
+    goto done;
+  buf = recutils_lazy_read (lazy, entry);
+  if (buf == NULL)
+    return false;
+  parser = rec_parser_new_mem (buf, entry->length, lazy->filename);
+  if (parser == NULL)
+    {
+      free (buf);
+      PyErr_NoMemory ();
+      return false;
+    }
+  success = rec_parse_rset (parser, &rset) && !rec_parser_error (parser);
+  rec_parser_destroy (parser);
+  free (buf);
+  if (!success)
+    {
+      if (rset)
+        rec_rset_destroy (rset);
+      PyErr_SetString (RecError, "parse error");
+      return false;
+    }
+  if (!rec_db_insert_rset (self->rdb, rset, pos))
+    {
+      rec_rset_destroy (rset);
+      PyErr_NoMemory ();
+      return false;
+    }
+  rec_db_remove_rset (self->rdb, pos + 1);
+
+ done:
+  entry->placeholder = NULL;
+  if (--lazy->num_pending == 0)
+    {
+      recutils_lazy_free (lazy);
+      self->lazy = NULL;
+    }
+  return true;
+}
+
+/* Load the record sets of type TYPE of SELF, or all of them if ALL,
+   that are still pending.  Return 'false' and set an exception on
+   error.  */
+
+static bool
+recutils_lazy_load (recdb *self, const char *type, bool all)
+{
+  size_t i;
+  for (i = 0; self->lazy && i < self->lazy->num_rsets; i++)
+    if (self->lazy->rsets[i].placeholder
+        && (all || recutils_type_equal_p (self->lazy->rsets[i].type, type))
+        && !recutils_lazy_load_rset (self, i))
+      return false;
+  return true;
+}
+
+/* Load the record set at position POS of SELF, if pending.  */
+
+static bool
+recutils_lazy_load_at (recdb *self, size_t pos)
+{
+  if (self->lazy == NULL || pos >= rec_db_size (self->rdb))
+    return true;
+  return recutils_lazy_load (self,
+                             rec_rset_type (rec_db_get_rset (self->rdb, pos)),
+                             false);
+}
+
+/* Build a database from the file FILENAME, open as FD and mapped at
+   DATA, with a placeholder for each of its record sets.  Store the
+   directory in *LAZY.  The mapping is released once scanned, and FD
+   is owned by *LAZY from then on.  Return NULL if there is not enough
+   memory.  */
+
+static rec_db_t
+recutils_lazy_new (const char *filename, int fd, char *data, size_t size,
+                   struct recutils_lazy_s **lazy)
+{
+  struct recutils_lazy_s *res;
+  struct stat st;
+  rec_db_t db;
+  size_t i;
+
+  res = calloc (1, sizeof (struct recutils_lazy_s));
+  if (res == NULL)
+    {
+      if (size > 0)
+        munmap (data, size);
+      close (fd);
+      return NULL;
+    }
+  res->data = data;
+  res->size = size;
+  res->fd = fd;
+  if (fstat (fd, &st) == 0)
+    res->mtime = st.st_mtim;
+  db = rec_db_new ();
+  if (db == NULL
+      || (res->filename = strdup (filename)) == NULL
+      || !recutils_lazy_scan (res))
+    goto error;
+  if (size > 0)
+    munmap (data, size);
+  res->data = NULL;
+  for (i = 0; i < res->num_rsets; i++)
+    {
+      res->rsets[i].placeholder = rec_rset_new ();
+      if (res->rsets[i].placeholder == NULL)
+        goto error;
+      if (res->rsets[i].type)
+        rec_rset_set_type (res->rsets[i].placeholder, res->rsets[i].type);
+      if (!rec_db_insert_rset (db, res->rsets[i].placeholder, i))
+        {
+          rec_rset_destroy (res->rsets[i].placeholder);
+          goto error;
+        }
+    }
+  res->num_pending = res->num_rsets;
+  if (res->num_pending == 0)
+    {
+      recutils_lazy_free (res);
+      res = NULL;
+    }
+  *lazy = res;
+  return db;
+
+ error:
+  if (db)
+    rec_db_destroy (db);
+  recutils_lazy_free (res);
+  return NULL;
+}
+
+/* Create an empty database.  */
+
+static PyObject *
+recdb_new (PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+  recdb *self;
+  self = (recdb *) type->tp_alloc (type, 0);
+  //Py_INCREF(self);
+  if (self != NULL) 
+    {
+        self->rdb = rec_db_new();
+        
+        if (self->rdb == NULL) 
+          {
+             /* Out of memory.  */
+            Py_DECREF(self);
+            return NULL;
+          }
+    }
+  return (PyObject *)self;
+}
+
+
+/* Destroy a database, freeing any used memory.
+ *
+ * This means that all the record sets contained in the database are
+ * also destroyed.
+ */
+
+static void
+recdb_dealloc (recdb* self)
+{
+  recutils_indexes_free (self->indexes);
+  recutils_generations_free (self->generations);
+  recutils_query_cache_free (self->query_cache);
+  recutils_sync_free (self->sync);
+  recutils_wal_free (self->wal);
+  recutils_lazy_free (self->lazy);
+  self->ob_type->tp_free ((PyObject*) self);
+}
+
+
+/* Return the number of record sets contained in a given database  */
+static PyObject*
+recdb_size (recdb* self)
+{
+  int s = rec_db_size (self->rdb);
+  return Py_BuildValue ("i", s);
+}
+
+
+/* Map the whole file FILENAME in memory for reading, storing the
+   address of the mapping in DATA and its length in SIZE.  Empty files
+   are not mapped: DATA is set to an empty string and SIZE to 0.  If
+   FDP is not NULL the file is left open and its descriptor stored
+   there.  Return 0 on success or an errno value otherwise.  */
+
+static int
+recutils_map_file (const char *filename, char **data, size_t *size,
+                   int *fdp)
+{
+  int fd;
+  struct stat st;
+  void *addr;
+
+  fd = open (filename, O_RDONLY);
+  if (fd < 0)
+    return errno;
+  if (fstat (fd, &st) < 0)
+    {
+      int errnum = errno;
+      close (fd);
+      return errnum;
+    }
+  if (st.st_size == 0)
+    {
+      if (fdp)
+        *fdp = fd;
+      else
+        close (fd);
+      *data = "";
+      *size = 0;
+      return 0;
+    }
+  addr = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED)
+    {
+      int errnum = errno;
+      close (fd);
+      return errnum;
+    }
+  if (fdp)
+    *fdp = fd;
+  else
+    close (fd);
+#ifdef MADV_SEQUENTIAL
+  madvise (addr, st.st_size, MADV_SEQUENTIAL);
+#endif
+  *data = addr;
+  *size = st.st_size;
+  return 0;
+}
+
+/* Parse all the record sets contained in the file FILENAME, storing
+   them in a newly allocated array in RSETS and its length in
+   NUM_RSETS.  If USE_MMAP is 'true' the file is mapped in memory and
+   parsed straight from the mapping instead of through a stdio
+   stream.  No Python object is touched, so the caller may release the
+   GIL around this function.  If the file cannot be opened ERRNUM is
+   set to the corresponding errno value, otherwise it is set to 0.
+   Return 'false' on any error.  */
+
+static bool
+recutils_parse_file (const char *filename,
+                     bool use_mmap,
+                     rec_rset_t **rsets,
+                     size_t *num_rsets,
+                     int *errnum)
+{
+  FILE *in = NULL;
+  char *data = NULL;
+  size_t size = 0;
+  rec_parser_t parser;
+  rec_rset_t res;
+  rec_rset_t *tmp;
+  size_t allocated = 0;
+  bool success = true;
+
+  *rsets = NULL;
+  *num_rsets = 0;
+  *errnum = 0;
+  if (use_mmap)
+    {
+      *errnum = recutils_map_file (filename, &data, &size, NULL);
+      if (*errnum)
+        return false;
+      parser = rec_parser_new_mem (data, size, filename);
+    }
+  else
+    {
+      in = fopen (filename, "r");
+      if (in == NULL)
+        {
+          *errnum = errno;
+          return false;
+        }
+      parser = rec_parser_new (in, filename);
+    }
+  if (parser == NULL)
+    {
+      success = false;
+      goto out;
+    }
+  while (rec_parse_rset (parser, &res))
+    {
+      if (*num_rsets == allocated)
+        {
+          allocated = allocated ? allocated * 2 : 8;
+          tmp = realloc (*rsets, allocated * sizeof (rec_rset_t));
+          if (tmp == NULL)
+            {
+              /* Out of memory.  */
+              rec_rset_destroy (res);
+              success = false;
+              break;
+            }
+          *rsets = tmp;
+        }
+      (*rsets)[(*num_rsets)++] = res;
+    }
+
+  if (rec_parser_error (parser))
+    {
+      /* Report parsing errors.  */
+      rec_parser_perror (parser, "%s", filename);
+      success = false;
+    }
+  rec_parser_destroy (parser);
+
+ out:
+  if (in)
+    fclose (in);
+  if (size > 0)
+    munmap (data, size);
+  return success;
+}
+
+/* Destroy the record sets of RSETS from position FIRST up to
+   NUM_RSETS, and then the array itself.  Record sets before FIRST are
+   assumed to be owned by somebody else.  */
+
+static void
+recutils_free_rsets (rec_rset_t *rsets, size_t first, size_t num_rsets)
+{
+  size_t i;
+  for (i = first; i < num_rsets; i++)
+    rec_rset_destroy (rsets[i]);
+  free (rsets);
+}
+
+/* Look for a record set in RSETS whose type is already present in DB
+   or in a previous element of RSETS.  Return its position, or
+   NUM_RSETS if there are no duplicated types.  */
+
+static size_t
+recutils_find_duplicated_rset (rec_db_t db,
+                               rec_rset_t *rsets,
+                               size_t num_rsets)
+{
+  size_t i, j;
+  for (i = 0; i < num_rsets; i++)
+    {
+      char *rset_type;
+      bool duplicated;
+      rset_type = rec_rset_type (rsets[i]);
+      duplicated = rec_db_type_p (db, rset_type);
+      for (j = 0; !duplicated && j < i; j++)
+        {
+          char *prev_type = rec_rset_type (rsets[j]);
+          duplicated = (prev_type == NULL && rset_type == NULL)
+            || (prev_type && rset_type && strcmp (prev_type, rset_type) == 0);
+        }
+      if (duplicated)
+        return i;
+    }
+  return num_rsets;
+}
+
+/* Look for an entry of the directory LAZY whose type is the type of
+   a previous one.  Return its position, or the number of entries if
+   there are no duplicated types.  */
+
+static size_t
+recutils_lazy_find_duplicated_rset (struct recutils_lazy_s *lazy)
+{
+  size_t i, j;
+  for (i = 0; lazy && i < lazy->num_rsets; i++)
+    for (j = 0; j < i; j++)
+      if (recutils_type_equal_p (lazy->rsets[i].type, lazy->rsets[j].type))
+        return i;
+  return lazy ? lazy->num_rsets : 0;
+}
+
+/* Load a file into a Database object.  The file is parsed into a new
+   database with the GIL released, and the new database replaces the
+   old one only if the whole file could be parsed.  If MMAP is true
+   the file is mapped in memory and parsed from the mapping.  If LAZY
+   is true the record sets are only parsed when used, see LAZY
+   LOADING.  */
+
+static PyObject*
+recdb_pyloadfile (recdb *self, PyObject *args, PyObject *kwds)
+{
+  char *string = NULL;
+  int use_mmap = 0;
+  bool success = true;
+  int errnum;
+  size_t i;
+  rec_db_t db;
+  rec_rset_t *rsets;
+  size_t num_rsets;
+  int use_lazy = 0;
+  struct recutils_lazy_s *lazy = NULL;
+  char *data;
+  size_t size = 0;
+  int fd;
+  size_t dup;
+  bool duplicated = false;
+  char str[100];
+  static char *kwlist[] = {"filename", "mmap", "lazy", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|ii", kwlist,
+                                   &string, &use_mmap, &use_lazy)) 
+    {
+      return NULL;
+    }
+  if (use_lazy)
+    {
+      Py_BEGIN_ALLOW_THREADS
+      errnum = recutils_map_file (string, &data, &size, &fd);
+      db = errnum ? NULL : recutils_lazy_new (string, fd, data, size,
+                                              &lazy);
+      Py_END_ALLOW_THREADS
+      if (errnum)
+        {
+          PyErr_SetString (RecError, strerror (errnum));
+          return NULL;
+        }
+      if (db == NULL)
+        {
+          return PyErr_NoMemory ();
+        }
+      dup = recutils_lazy_find_duplicated_rset (lazy);
+      if (lazy && dup < lazy->num_rsets)
+        {
+          snprintf (str, sizeof (str), "Duplicated record set '%s' from %s.",
+                    lazy->rsets[dup].type ? lazy->rsets[dup].type : "",
+                    string);
+          rec_db_destroy (db);
+          recutils_lazy_free (lazy);
+          PyErr_SetString (RecError, str);
+          return NULL;
+        }
+      goto loaded;
+    }
+  db = rec_db_new ();
+  if (db == NULL)
+    {
+      return PyErr_NoMemory ();
+    }
+
+  Py_BEGIN_ALLOW_THREADS
+  success = recutils_parse_file (string, use_mmap, &rsets, &num_rsets,
+                                 &errnum);
+  if (success)
+    {
+      dup = recutils_find_duplicated_rset (db, rsets, num_rsets);
+      if (dup < num_rsets)
+        {
+          snprintf (str, sizeof (str), "Duplicated record set '%s' from %s.",
+                    rec_rset_type (rsets[dup]) ? rec_rset_type (rsets[dup])
+                                               : "", string);
+          duplicated = true;
+          success = false;
+        }
+    }
+  for (i = 0; success && i < num_rsets; i++)
+    {
+      if (!rec_db_insert_rset (db, rsets[i], rec_db_size (db)))
+        {
+          success = false;
+          break;
+        }
+    }
+  /* The rsets already inserted are owned by DB from now on.  */
+  recutils_free_rsets (rsets, i, num_rsets);
+  if (!success)
+    {
+      rec_db_destroy (db);
+    }
+  Py_END_ALLOW_THREADS
+
+  if (errnum)
+    {
+      PyErr_SetString (RecError, strerror (errnum));
+      return NULL;
+    }
+  if (!success)
+    {
+      PyErr_SetString (RecError, duplicated ? str : "parse error");
+      return NULL;
+    }
+
+ loaded:
+  if (!recutils_check_idle (self))
+    {
+      rec_db_destroy (db);
+      recutils_lazy_free (lazy);
+      return NULL;
+    }
+  rec_db_destroy (self->rdb);
+  self->rdb = db;
+  recutils_lazy_free (self->lazy);
+  self->lazy = lazy;
+  recutils_indexes_invalidate (self->indexes, NULL, true);
+  recutils_generation_bump (self, NULL, true);
+  recutils_sync_mark (self, string);
+  /* The log doesn't apply to the new contents.  */
+  recutils_wal_free (self->wal);
+  self->wal = NULL;
+  return Py_BuildValue ("");
+}
+
+/* Append the record sets in RSETS at the end of DB, in order.  The
+   array is freed, along with any record set which could not be
+   inserted.  Return 'false' if some insertion failed.  */
+
+static bool
+recutils_append_rsets (rec_db_t db, rec_rset_t *rsets, size_t num_rsets)
+{
+  size_t i;
+  bool success = true;
+  for (i = 0; i < num_rsets; i++)
+    {
+      if (!rec_db_insert_rset (db, rsets[i], rec_db_size (db)))
+        {
+          /* Error.  */
+          success = false;
+          break;
+        }
+    }
+  recutils_free_rsets (rsets, i, num_rsets);
+  return success;
+}
+
+/* Append a file into a Database object.  The file is parsed with the
+   GIL released; the record sets are then checked for duplicated types
+   and inserted at the end of the database only once the GIL has been
+   reacquired, so no record set is appended if any of them clashes.
+   MMAP has the same meaning as in pyloadfile.  */
+
+static PyObject*
+recdb_pyappendfile (recdb *self, PyObject *args, PyObject *kwds)
+{
+  char *string = NULL;
+  int use_mmap = 0;
+  bool success = true;
+  int errnum;
+  size_t dup;
+  char str[100];
+  rec_rset_t *rsets;
+  size_t num_rsets;
+  static char *kwlist[] = {"filename", "mmap", NULL};
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "s|i", kwlist,
+                                    &string, &use_mmap)) 
+    {
+      return NULL;
+    }
+
+  Py_BEGIN_ALLOW_THREADS
+  success = recutils_parse_file (string, use_mmap, &rsets, &num_rsets,
+                                 &errnum);
+  Py_END_ALLOW_THREADS
+
+  if (errnum)
+    {
+      PyErr_SetString (RecError, strerror (errnum));
+      return NULL;
+    }
+  if (!success)
+    {
+      recutils_free_rsets (rsets, 0, num_rsets);
+      PyErr_SetString (RecError, "parse error");
+      return NULL;
+    }
+  if (!recutils_check_idle (self))
+    {
+      recutils_free_rsets (rsets, 0, num_rsets);
+      return NULL;
+    }
+
+  dup = recutils_find_duplicated_rset (self->rdb, rsets, num_rsets);
+  if (dup < num_rsets)
+    {
+      snprintf (str, sizeof (str), "Duplicated record set '%s' from %s.",
+                rec_rset_type (rsets[dup]), string);
+      recutils_free_rsets (rsets, 0, num_rsets);
+      PyErr_SetString (RecError, str);
+      return NULL;
+    }
+
+  recutils_indexes_invalidate (self->indexes, NULL, true);
+  recutils_generation_bump (self, NULL, true);
+  if (!recutils_append_rsets (self->rdb, rsets, num_rsets))
+    {
+      PyErr_SetString (RecError, "parse error");
+      return NULL;
+    }
+  return Py_BuildValue ("");
+}
+
+/* State shared by the worker threads of recdb_load_many.  Each job is
+   a file name; workers pick the next unclaimed job under LOCK and
+   store the parsed record sets in the slot of that job, so the
+   results do not depend on the scheduling of the threads.  */
+
+struct recutils_load_job_s
+{
+  const char *filename;
+  rec_rset_t *rsets;
+  size_t num_rsets;
+  int errnum;
+  bool success;
+};
+
+struct recutils_load_state_s
+{
+  pthread_mutex_t lock;
+  struct recutils_load_job_s *jobs;
+  size_t num_jobs;
+  size_t next_job;
+  bool use_mmap;
+};
+
+static void *
+recutils_load_worker (void *arg)
+{
+  struct recutils_load_state_s *state = arg;
+  struct recutils_load_job_s *job;
+
+  while (true)
+    {
+      pthread_mutex_lock (&state->lock);
+      job = NULL;
+      if (state->next_job < state->num_jobs)
+        job = &state->jobs[state->next_job++];
+      pthread_mutex_unlock (&state->lock);
+      if (job == NULL)
+        break;
+
+      job->success = recutils_parse_file (job->filename, state->use_mmap,
+                                          &job->rsets, &job->num_rsets,
+                                          &job->errnum);
+    }
+  return NULL;
+}
+
+/* Append several files into a Database object, parsing them in
+   parallel.  PATHS is a sequence of file names, each of which is
+   parsed by a worker thread with its own parser and the GIL released.
+   The resulting record sets are then appended to the database in the
+   order of PATHS, exactly as if pyappendfile had been called for each
+   file in turn, except that nothing is appended if any file fails to
+   parse or contains a record set whose type is duplicated.  */
+
+static PyObject*
+recdb_load_many (recdb *self, PyObject *args, PyObject *kwds)
+{
+  PyObject *paths;
+  PyObject *seq;
+  int threads = 0;
+  int use_mmap = 0;
+  size_t num_jobs, num_threads, num_rsets, i, j, dup;
+  struct recutils_load_state_s state;
+  struct recutils_load_job_s *jobs;
+  struct recutils_load_job_s *failed = NULL;
+  pthread_t *workers;
+  size_t num_workers = 0;
+  rec_rset_t *rsets = NULL;
+  size_t *owners = NULL;
+  char str[100];
+  static char *kwlist[] = {"paths", "threads", "mmap", NULL};
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "O|ii", kwlist,
+                                    &paths, &threads, &use_mmap))
+    {
+      return NULL;
+    }
+  seq = PySequence_Fast (paths, "paths must be a sequence of file names");
+  if (seq == NULL)
+    {
+      return NULL;
+    }
+  num_jobs = PySequence_Fast_GET_SIZE (seq);
+  jobs = calloc (num_jobs ? num_jobs : 1, sizeof (struct recutils_load_job_s));
+  if (jobs == NULL)
+    {
+      Py_DECREF (seq);
+      return PyErr_NoMemory ();
+    }
+  for (i = 0; i < num_jobs; i++)
+    {
+      jobs[i].filename = PyString_AsString (PySequence_Fast_GET_ITEM (seq, i));
+      if (jobs[i].filename == NULL)
+        {
+          free (jobs);
+          Py_DECREF (seq);
+          return NULL;
+        }
+    }
+
+  num_threads = recutils_num_threads (threads, num_jobs);
+  workers = malloc (num_threads * sizeof (pthread_t));
+  if (workers == NULL)
+    {
+      free (jobs);
+      Py_DECREF (seq);
+      return PyErr_NoMemory ();
+    }
+  state.jobs = jobs;
+  state.num_jobs = num_jobs;
+  state.next_job = 0;
+  state.use_mmap = use_mmap;
+  pthread_mutex_init (&state.lock, NULL);
+
+  Py_BEGIN_ALLOW_THREADS
+  for (i = 0; i < num_threads; i++)
+    {
+      if (pthread_create (&workers[num_workers], NULL,
+                          recutils_load_worker, &state) == 0)
+        num_workers++;
+    }
+  /* If no thread could be created do the work here.  */
+  if (num_workers == 0)
+    recutils_load_worker (&state);
+  for (i = 0; i < num_workers; i++)
+    pthread_join (workers[i], NULL);
+  Py_END_ALLOW_THREADS
+
+  pthread_mutex_destroy (&state.lock);
+  free (workers);
+
+  /* Merge the results in the order of PATHS.  */
+  num_rsets = 0;
+  for (i = 0; i < num_jobs; i++)
+    {
+      if (!jobs[i].success && failed == NULL)
+        failed = &jobs[i];
+      num_rsets += jobs[i].num_rsets;
+    }
+  if (failed == NULL)
+    {
+      rsets = malloc ((num_rsets ? num_rsets : 1) * sizeof (rec_rset_t));
+      owners = malloc ((num_rsets ? num_rsets : 1) * sizeof (size_t));
+      if (rsets == NULL || owners == NULL)
+        {
+          free (rsets);
+          free (owners);
+          for (i = 0; i < num_jobs; i++)
+            recutils_free_rsets (jobs[i].rsets, 0, jobs[i].num_rsets);
+          free (jobs);
+          Py_DECREF (seq);
+          return PyErr_NoMemory ();
+        }
+      num_rsets = 0;
+      for (i = 0; i < num_jobs; i++)
+        {
+          for (j = 0; j < jobs[i].num_rsets; j++)
+            {
+              owners[num_rsets] = i;
+              rsets[num_rsets++] = jobs[i].rsets[j];
+            }
+          free (jobs[i].rsets);
+        }
+    }
+  else
+    {
+      if (failed->errnum)
+        snprintf (str, sizeof (str), "%s: %s", failed->filename,
+                  strerror (failed->errnum));
+      else
+        snprintf (str, sizeof (str), "parse error in %s", failed->filename);
+      for (i = 0; i < num_jobs; i++)
+        recutils_free_rsets (jobs[i].rsets, 0, jobs[i].num_rsets);
+      free (jobs);
+      Py_DECREF (seq);
+      PyErr_SetString (RecError, str);
+      return NULL;
+    }
+
+  dup = recutils_find_duplicated_rset (self->rdb, rsets, num_rsets);
+  if (dup < num_rsets)
+    {
+      snprintf (str, sizeof (str), "Duplicated record set '%s' from %s.",
+                rec_rset_type (rsets[dup]), jobs[owners[dup]].filename);
+      recutils_free_rsets (rsets, 0, num_rsets);
+      free (owners);
+      free (jobs);
+      Py_DECREF (seq);
+      PyErr_SetString (RecError, str);
+      return NULL;
+    }
+  free (owners);
+  free (jobs);
+  Py_DECREF (seq);
+  if (!recutils_check_idle (self))
+    {
+      recutils_free_rsets (rsets, 0, num_rsets);
+      return NULL;
+    }
+
+  recutils_indexes_invalidate (self->indexes, NULL, true);
+  recutils_generation_bump (self, NULL, true);
+  if (!recutils_append_rsets (self->rdb, rsets, num_rsets))
+    {
+      PyErr_SetString (RecError, "parse error");
+      return NULL;
+    }
+  return Py_BuildValue ("");
+}
+
+/* Flush the directory containing FILENAME, so that a rename into it
+   is durable.  */
+
+static int
+recutils_sync_dir (const char *filename)
+{
+  const char *slash = strrchr (filename, '/');
+  char *dir;
+  int fd, res;
+
+  if (slash == NULL)
+    dir = strdup (".");
+  else if (slash == filename)
+    dir = strdup ("/");
+  else
+    dir = strndup (filename, slash - filename);
+  if (dir == NULL)
+    return ENOMEM;
+  fd = open (dir, O_RDONLY);
+  free (dir);
+  if (fd < 0)
+    return errno;
+  res = fsync (fd) == 0 ? 0 : errno;
+  close (fd);
+  return res;
+}
+
+/* Write the contents of a database to the stream OUT, opened on the
+   file descriptor FD, with a stdio buffer of BUFFER_SIZE bytes (the
+   default one if 0) and flushing it to disk as asked by MODE.
+   Return 0 or an errno value.  OUT is closed in any case.  */
+
+static int
+recutils_write_db_stream (recdb *self, FILE *out, int fd,
+                          size_t buffer_size, enum recutils_fsync_e mode)
+{
+  rec_writer_t writer;
+  char *buf = NULL;
+  int err = 0;
+
+  if (buffer_size > 0)
+    {
+      buf = malloc (buffer_size);
+      if (buf)
+        setvbuf (out, buf, _IOFBF, buffer_size);
+    }
+  writer = rec_writer_new (out);
+  if (writer == NULL)
+    err = ENOMEM;
+  else
+    {
+      if (!rec_write_db (writer, self->rdb))
+        err = EIO;
+      rec_writer_destroy (writer);
+    }
+  if (fflush (out) != 0 && err == 0)
+    err = errno;
+  if (err == 0 && mode != RECUTILS_FSYNC_NONE)
+    {
+      Py_BEGIN_ALLOW_THREADS
+      if ((mode == RECUTILS_FSYNC_DATA ? fdatasync (fd) : fsync (fd)) != 0)
+        err = errno;
+      Py_END_ALLOW_THREADS
+    }
+  if (fclose (out) != 0 && err == 0)
+    err = errno;
+  free (buf);
+  return err;
+}
+
+/* Write the contents of a database to the file FILENAME.  If ATOMIC,
+   the database is written to a temporary file in the same directory
+   which is then renamed over FILENAME, so that FILENAME holds either
+   its previous contents or the new ones, even after a crash if MODE
+   asks for the data to be flushed.  Return 'false' and set an
+   exception on error.  */
+
+static bool
+recutils_write_db_file (recdb *self, const char *filename, bool atomic,
+                        enum recutils_fsync_e mode, size_t buffer_size)
+{
+  char *tmpname = NULL;
+  struct stat st;
+  mode_t mask;
+  FILE *out;
+  int fd, err;
+
+  if (!recutils_lazy_load (self, NULL, true))
+    return false;
+  if (!atomic)
+    {
+      out = fopen (filename, "w");
+      err = out ? recutils_write_db_stream (self, out, fileno (out),
+                                            buffer_size, mode)
+                : errno;
+    }
+  else
+    {
+      tmpname = malloc (strlen (filename) + sizeof (".XXXXXX"));
+      if (tmpname == NULL)
+        {
+          PyErr_NoMemory ();
+          return false;
+        }
+      strcpy (tmpname, filename);
+      strcat (tmpname, ".XXXXXX");
+      fd = mkstemp (tmpname);
+      if (fd < 0)
+        err = errno;
+      else
+        {
+          /* mkstemp creates the file with mode 0600.  Keep the mode
+             of the file being replaced, or use the default one.  */
+          if (stat (filename, &st) == 0)
+            fchmod (fd, st.st_mode & 07777);
+          else
+            {
+              mask = umask (0);
+              umask (mask);
+              fchmod (fd, 0666 & ~mask);
+            }
+          out = fdopen (fd, "w");
+          if (out == NULL)
+            {
+              err = errno;
+              close (fd);
+            }
+          else
+            err = recutils_write_db_stream (self, out, fd, buffer_size,
+                                            mode);
+          if (err == 0 && rename (tmpname, filename) != 0)
+            err = errno;
+          if (err != 0)
+            unlink (tmpname);
+          else if (mode == RECUTILS_FSYNC_FULL)
+            err = recutils_sync_dir (filename);
+        }
+      free (tmpname);
+    }
+  if (err != 0)
+    {
+      PyErr_SetString (RecError, strerror (err));
+      return false;
+    }
+  return true;
+}
+
+/* Write to file from a DB object.  With ATOMIC the file is replaced
+   atomically, see recutils_write_db_file, as is always the base of
+   the write-ahead log.  FSYNC is one of "none", "data" or "full", and
+   BUFFER_SIZE the size of the output buffer.  */
+
+static PyObject*
+recdb_pywritefile (recdb *self, PyObject *args, PyObject *kwds)
+{
+  char *string = NULL;
+  int atomic = 0;
+  const char *fsync_str = "none";
+  Py_ssize_t buffer_size = RECUTILS_WRITE_BUFFER_SIZE;
+  enum recutils_fsync_e mode;
+  static char *kwlist[] = {"filename", "atomic", "fsync", "buffer_size",
+                           NULL};
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "s|isn", kwlist, &string,
+                                    &atomic, &fsync_str, &buffer_size))
+    {
+      return NULL;
+    }
+  if (!recutils_parse_fsync (fsync_str, &mode))
+    {
+      return NULL;
+    }
+  if (buffer_size < 0)
+    {
+      PyErr_SetString (PyExc_ValueError, "buffer_size must not be negative");
+      return NULL;
+    }
+  if (recutils_wal_base_p (self, string))
+    {
+      atomic = 1;
+      if (mode < self->wal->mode)
+        mode = self->wal->mode;
+    }
+  if (!recutils_wal_begin_rebase (self, string))
+    {
+      return NULL;
+    }
+  if (!recutils_write_db_file (self, string, atomic, mode, buffer_size))
+    {
+      recutils_wal_abort_rebase (self, string);
+      return NULL;
+    }
+  recutils_sync_mark (self, string);
+  if (!recutils_wal_rebase (self, string))
+    {
+      return NULL;
+    }
+  return Py_BuildValue ("");
+
+}
+
+/* Save a database into the file FILENAME, appending only the records
+   added since it was last loaded from or written to FILENAME when
+   possible.  The base of the write-ahead log is always rewritten
+   atomically, see recutils_wal_base_p.  Return True if the file was
+   appended to and False if it was rewritten.  */
+
+static PyObject*
+recdb_sync (recdb *self, PyObject *args, PyObject *kwds)
+{
+  char *filename;
+  bool append, base;
+  static char *kwlist[] = {"filename", NULL};
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "s", kwlist, &filename))
+    {
+      return NULL;
+    }
+  base = recutils_wal_base_p (self, filename);
+  append = !base && recutils_sync_append_p (self, filename);
+  if (!recutils_wal_begin_rebase (self, filename))
+    {
+      return NULL;
+    }
+  if (append ? !recutils_sync_append (self, filename)
+             : !recutils_write_db_file (self, filename, base,
+                                        base ? self->wal->mode
+                                             : RECUTILS_FSYNC_NONE,
+                                        RECUTILS_WRITE_BUFFER_SIZE))
+    {
+      recutils_wal_abort_rebase (self, filename);
+      recutils_sync_free (self->sync);
+      self->sync = NULL;
+      return NULL;
+    }
+  recutils_sync_mark (self, filename);
+  if (!recutils_wal_rebase (self, filename))
+    {
+      return NULL;
+    }
+  return PyBool_FromLong (append);
+}
+
+/* Bind a write-ahead log stored in FILENAME to a database, see
+   WRITE-AHEAD LOG.  The base of the log is the file the database was
+   last loaded from or written to.  The entries of an existing log for
+   that base are replayed.  A log for another base is emptied if it
+   has no entries, was left by an interrupted rewrite of the base or
+   DISCARD is true, and refused otherwise.  FSYNC is one of "none",
+   "data" or "full" and tells how every entry is flushed to disk.
+   Return the number of replayed entries.  */
+
+static PyObject*
+recdb_open_wal (recdb *self, PyObject *args, PyObject *kwds)
+{
+  char *filename;
+  const char *fsync_str = "none";
+  enum recutils_fsync_e mode;
+  struct recutils_wal_s *wal;
+  struct recutils_wal_header_s header, stamp;
+  struct stat st;
+  size_t num_entries = 0;
+  off_t end;
+  int fd, discard = 0;
+  bool valid, rebasing;
+  static char *kwlist[] = {"filename", "fsync", "discard", NULL};
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "s|si", kwlist, &filename,
+                                    &fsync_str, &discard))
+    {
+      return NULL;
+    }
+  if (!recutils_check_idle (self))
+    {
+      return NULL;
+    }
+  if (!recutils_parse_fsync (fsync_str, &mode))
+    {
+      return NULL;
+    }
+  if (self->sync == NULL)
+    {
+      PyErr_SetString (RecError, "the database must be loaded from or"
+                       " written to a file first");
+      return NULL;
+    }
+  if (self->mutations != self->sync->mutations)
+    {
+      PyErr_SetString (RecError, "the database has been modified since it"
+                       " was loaded or written");
+      return NULL;
+    }
+  if (!recutils_lazy_load (self, NULL, true))
+    {
+      return NULL;
+    }
+  wal = calloc (1, sizeof (struct recutils_wal_s));
+  if (wal == NULL
+      || (wal->filename = strdup (filename)) == NULL
+      || (wal->base = strdup (self->sync->filename)) == NULL)
+    {
+      recutils_wal_free (wal);
+      return PyErr_NoMemory ();
+    }
+  wal->mode = mode;
+  fd = open (filename, O_RDWR | O_CREAT, 0666);
+  if (fd < 0 || (wal->out = fdopen (fd, "r+")) == NULL)
+    {
+      PyErr_SetString (RecError, strerror (errno));
+      if (fd >= 0)
+        close (fd);
+      recutils_wal_free (wal);
+      return NULL;
+    }
+
+  valid = fread (&header, sizeof (header), 1, wal->out) == 1
+    && memcmp (header.magic, RECUTILS_WAL_MAGIC, sizeof (header.magic)) == 0;
+  rebasing = valid && header.rebasing;
+  header.rebasing = 0;
+  if (valid && recutils_wal_stamp (&stamp, wal->base)
+      && memcmp (&header, &stamp, sizeof (header)) == 0)
+    {
+      recutils_wal_replay (wal->out, self->rdb, &end, &num_entries);
+      /* Drop a torn entry left at the end of the log.  */
+      if (ftruncate (fd, end) != 0 || fseeko (wal->out, end, SEEK_SET) != 0)
+        {
+          PyErr_SetString (RecError, strerror (errno));
+          recutils_wal_free (wal);
+          return NULL;
+        }
+    }
+  else if (!rebasing && !discard && fstat (fd, &st) == 0
+           && st.st_size > (off_t) (valid ? sizeof (header) : 0))
+    {
+      PyErr_SetString (RecError, "the write-ahead log holds entries for"
+                       " another version of its base, pass discard=True"
+                       " to drop them");
+      recutils_wal_free (wal);
+      return NULL;
+    }
+  else if (!recutils_wal_reset (wal))
+    {
+      PyErr_SetString (RecError, strerror (errno));
+      recutils_wal_free (wal);
+      return NULL;
+    }
+  if (num_entries > 0)
+    {
+      recutils_indexes_invalidate (self->indexes, NULL, true);
+      recutils_generation_bump (self, NULL, true);
+    }
+  recutils_wal_free (self->wal);
+  self->wal = wal;
+  return Py_BuildValue ("n", (Py_ssize_t) num_entries);
+}
+
+/* Stop logging the mutations of a database.  The log file is left
+   as it is.  */
+
+static PyObject*
+recdb_close_wal (recdb *self)
+{
+  recutils_wal_free (self->wal);
+  self->wal = NULL;
+  return Py_BuildValue ("");
+}
+
+/* Write a database atomically over the base of its write-ahead log
+   and empty the log.  */
+
+static PyObject*
+recdb_compact_wal (recdb *self)
+{
+  if (self->wal == NULL)
+    {
+      PyErr_SetString (RecError, "the database has no write-ahead log");
+      return NULL;
+    }
+  if (!recutils_wal_begin_rebase (self, self->wal->base))
+    {
+      return NULL;
+    }
+  if (!recutils_write_db_file (self, self->wal->base, true,
+                               RECUTILS_FSYNC_FULL,
+                               RECUTILS_WRITE_BUFFER_SIZE))
+    {
+      recutils_wal_abort_rebase (self, self->wal->base);
+      return NULL;
+    }
+  recutils_sync_mark (self, self->wal->base);
+  if (!recutils_wal_reset (self->wal))
+    {
+      PyErr_SetString (RecError, strerror (errno));
+      return NULL;
+    }
+  return Py_BuildValue ("");
+}
+
+
+
+
+/*
+ * SNAPSHOTS
+ *
+ * save_snapshot stores a database in a binary file that load_snapshot
+ * reads back without going through the rec parser.  The file starts
+ * with a header holding a magic string, the version of the format, a
+ * byte order mark, and the size and checksum of the payload.
+ *
+ * The payload is the list of record sets, each made of its descriptor
+ * and its elements, records and comments.  A record is the list of
+ * its elements: comments, tagged RECUTILS_SNAPSHOT_COMMENT, and fields,
+ * tagged with the number of their name.  Names are numbered in the
+ * order they first appear, and a field using a new name is followed
+ * by the name itself.  Numbers are 32-bit in the byte order of the
+ * writer, and strings a length followed by the bytes and a NUL, so
+ * that they are used in place from the mapping of the file.
+ */
+
+#define RECUTILS_SNAPSHOT_MAGIC "RECSNAP\n"
+#define RECUTILS_SNAPSHOT_VERSION 1
+#define RECUTILS_SNAPSHOT_BOM 0x01020304U
+#define RECUTILS_SNAPSHOT_COMMENT 0xffffffffU
+
+struct recutils_snapshot_header_s
+{
+  char magic[8];
+  unsigned int version;
+  unsigned int bom;
+  unsigned long long size;
+  unsigned long long checksum;
+};
+
+/* Field names seen so far while writing or reading a snapshot.  HINT
+   is where the search for the next name starts, since the records of
+   a record set tend to list their fields in the same order.  */
+
+struct recutils_snapshot_names_s
+{
+  const char **names;
+  size_t num;
+  size_t allocated;
+  size_t hint;
+};
+
+/* FNV-1a over 64-bit words.  */
+
+static unsigned long long
+recutils_snapshot_checksum (const char *data, size_t size)
+{
+  unsigned long long hash = 14695981039346656037ULL, word;
+  size_t i;
+  for (i = 0; i + sizeof (word) <= size; i += sizeof (word))
+    {
+      memcpy (&word, data + i, sizeof (word));
+      hash = (hash ^ word) * 1099511628211ULL;
+    }
+  for (; i < size; i++)
+    hash = (hash ^ (unsigned char) data[i]) * 1099511628211ULL;
+  return hash;
+}
+
+static bool
+recutils_snapshot_add_name (struct recutils_snapshot_names_s *names,
+                            const char *name)
+{
+  const char **tmp;
+  if (names->num == names->allocated)
+    {
+      names->allocated = names->allocated ? names->allocated * 2 : 16;
+      tmp = realloc (names->names, names->allocated * sizeof (char *));
+      if (tmp == NULL)
+        return false;
+      names->names = tmp;
+    }
+  names->names[names->num++] = name;
+  return true;
+}
+
+/* Return the number of NAME, or NAMES->num if it is new.  */
+
+static size_t
+recutils_snapshot_find_name (struct recutils_snapshot_names_s *names,
+                             const char *name)
+{
+  size_t i, j;
+  for (j = 0; j < names->num; j++)
+    {
+      i = (names->hint + j) % names->num;
+      if (names->names[i][0] == name[0] && strcmp (names->names[i], name) == 0)
+        {
+          names->hint = i + 1;
+          return i;
+        }
+    }
+  return names->num;
+}
+
+static void
+recutils_snapshot_put_num (struct recutils_buf_s *buf, unsigned int num)
+{
+  recutils_buf_put (buf, &num, sizeof (num));
+}
+
+static void
+recutils_snapshot_put_record (struct recutils_buf_s *buf,
+                              struct recutils_snapshot_names_s *names,
+                              rec_record_t record)
+{
+  rec_mset_t mset = rec_record_mset (record);
+  rec_mset_iterator_t iter;
+  rec_mset_elem_t elem;
+  const void *data;
+  const char *name;
+  size_t id;
+
+  recutils_snapshot_put_num (buf, rec_mset_count (mset, MSET_ANY));
+  iter = rec_mset_iterator (mset);
+  while (rec_mset_iterator_next (&iter, MSET_ANY, &data, &elem))
+    {
+      if (rec_mset_elem_type (elem) == MSET_COMMENT)
+        {
+          recutils_snapshot_put_num (buf, RECUTILS_SNAPSHOT_COMMENT);
+          recutils_buf_put_str (buf, rec_comment_text ((rec_comment_t) data));
+          continue;
+        }
+      name = rec_field_name ((rec_field_t) data);
+      id = recutils_snapshot_find_name (names, name);
+      recutils_snapshot_put_num (buf, id);
+      if (id == names->num)
+        {
+          if (!recutils_snapshot_add_name (names, name))
+            buf->nomem = true;
+          recutils_buf_put_str (buf, name);
+        }
+      recutils_buf_put_str (buf, rec_field_value ((rec_field_t) data));
+    }
+  rec_mset_iterator_free (&iter);
+}
+
+/* Encode the contents of DB into BUF, after room for the header.  */
+
+static void
+recutils_snapshot_encode (rec_db_t db, struct recutils_buf_s *buf)
+{
+  struct recutils_snapshot_header_s header;
+  struct recutils_snapshot_names_s names = { NULL, 0, 0, 0 };
+  rec_rset_t rset;
+  rec_record_t descriptor;
+  rec_mset_iterator_t iter;
+  rec_mset_elem_t elem;
+  const void *data;
+  size_t i;
+
+  memset (&header, 0, sizeof (header));
+  recutils_buf_put (buf, &header, sizeof (header));
+  recutils_snapshot_put_num (buf, rec_db_size (db));
+  for (i = 0; i < rec_db_size (db); i++)
+    {
+      rset = rec_db_get_rset (db, i);
+      descriptor = rec_rset_descriptor (rset);
+      recutils_snapshot_put_num (buf, descriptor != NULL);
+      if (descriptor)
+        recutils_snapshot_put_record (buf, &names, descriptor);
+      recutils_snapshot_put_num (buf, rec_mset_count (rec_rset_mset (rset),
+                                                      MSET_ANY));
+      iter = rec_mset_iterator (rec_rset_mset (rset));
+      while (rec_mset_iterator_next (&iter, MSET_ANY, &data, &elem))
+        {
+          if (rec_mset_elem_type (elem) == MSET_COMMENT)
+            {
+              recutils_snapshot_put_num (buf, RECUTILS_SNAPSHOT_COMMENT);
+              recutils_buf_put_str (buf,
+                                    rec_comment_text ((rec_comment_t) data));
+            }
+          else
+            {
+              recutils_snapshot_put_num (buf, 0);
+              recutils_snapshot_put_record (buf, &names,
+                                            (rec_record_t) data);
+            }
+        }
+      rec_mset_iterator_free (&iter);
+    }
+  free (names.names);
+}
+
+static bool
+recutils_snapshot_get_num (const char **p, const char *end,
+                           unsigned int *num)
+{
+  return recutils_buf_get (p, end, num, sizeof (*num));
+}
+
+/* Decode a record from *P, or return NULL.  NAMES holds the field
+   names decoded so far.  */
+
+static rec_record_t
+recutils_snapshot_get_record (const char **p, const char *end,
+                              struct recutils_snapshot_names_s *names)
+{
+  rec_record_t record;
+  rec_field_t field;
+  rec_comment_t comment;
+  const char *name, *value;
+  unsigned int num, tag, i;
+
+  if (!recutils_snapshot_get_num (p, end, &num)
+      || (record = rec_record_new ()) == NULL)
+    return NULL;
+  for (i = 0; i < num; i++)
+    {
+      if (!recutils_snapshot_get_num (p, end, &tag))
+        break;
+      if (tag == RECUTILS_SNAPSHOT_COMMENT)
+        {
+          if (!recutils_buf_get_str (p, end, &value) || value == NULL
+              || (comment = rec_comment_new ((char *) value)) == NULL)
+            break;
+          if (!rec_mset_append (rec_record_mset (record), MSET_COMMENT,
+                                (void *) comment, MSET_ANY))
+            {
+              rec_comment_destroy (comment);
+              break;
+            }
+          continue;
+        }
+      if (tag == names->num)
+        {
+          if (!recutils_buf_get_str (p, end, &name) || name == NULL
+              || !recutils_snapshot_add_name (names, name))
+            break;
+        }
+      else if (tag > names->num)
+        break;
+      if (!recutils_buf_get_str (p, end, &value) || value == NULL
+          || (field = rec_field_new (names->names[tag], value)) == NULL)
+        break;
+      if (!rec_mset_append (rec_record_mset (record), MSET_FIELD,
+                            (void *) field, MSET_ANY))
+        {
+          rec_field_destroy (field);
+          break;
+        }
+    }
+  if (i < num)
+    {
+      rec_record_destroy (record);
+      return NULL;
+    }
+  return record;
+}
+
+static rec_rset_t
+recutils_snapshot_get_rset (const char **p, const char *end,
+                            struct recutils_snapshot_names_s *names)
+{
+  rec_rset_t rset;
+  rec_record_t record;
+  rec_comment_t comment;
+  const char *text;
+  unsigned int has_descriptor, num, tag, i;
+
+  if (!recutils_snapshot_get_num (p, end, &has_descriptor)
+      || (rset = rec_rset_new ()) == NULL)
+    return NULL;
+  if (has_descriptor)
+    {
+      record = recutils_snapshot_get_record (p, end, names);
+      if (record == NULL)
+        {
+          rec_rset_destroy (rset);
+          return NULL;
+        }
+      rec_rset_set_descriptor (rset, record);
+    }
+  if (!recutils_snapshot_get_num (p, end, &num))
+    {
+      rec_rset_destroy (rset);
+      return NULL;
+    }
+  for (i = 0; i < num; i++)
+    {
+      if (!recutils_snapshot_get_num (p, end, &tag))
+        break;
+      if (tag == RECUTILS_SNAPSHOT_COMMENT)
+        {
+          if (!recutils_buf_get_str (p, end, &text) || text == NULL
+              || (comment = rec_comment_new ((char *) text)) == NULL)
+            break;
+          if (!rec_mset_append (rec_rset_mset (rset), MSET_COMMENT,
+                                (void *) comment, MSET_ANY))
+            {
+              rec_comment_destroy (comment);
+              break;
+            }
+          continue;
+        }
+      record = recutils_snapshot_get_record (p, end, names);
+      if (record == NULL)
+        break;
+      if (!rec_mset_append (rec_rset_mset (rset), MSET_RECORD,
+                            (void *) record, MSET_ANY))
+        {
+          rec_record_destroy (record);
+          break;
+        }
+    }
+  if (i < num)
+    {
+      rec_rset_destroy (rset);
+      return NULL;
+    }
+  return rset;
+}
+
+/* Build a database from the snapshot of SIZE bytes at DATA.  Return
+   NULL and store in *ERROR the reason, or NULL if there is not enough
+   memory.  */
+
+static rec_db_t
+recutils_snapshot_decode (const char *data, size_t size, const char **error)
+{
+  struct recutils_snapshot_header_s header;
+  struct recutils_snapshot_names_s names = { NULL, 0, 0, 0 };
+  const char *p = data, *end = data + size;
+  rec_db_t db;
+  rec_rset_t rset;
+  unsigned int num, i;
+
+  *error = "not a snapshot";
+  if (!recutils_buf_get (&p, end, &header, sizeof (header))
+      || memcmp (header.magic, RECUTILS_SNAPSHOT_MAGIC,
+                 sizeof (header.magic)) != 0)
+    return NULL;
+  *error = "unsupported snapshot version or byte order";
+  if (header.version != RECUTILS_SNAPSHOT_VERSION
+      || header.bom != RECUTILS_SNAPSHOT_BOM)
+    return NULL;
+  *error = "corrupted snapshot";
+  if (header.size != (unsigned long long) (end - p)
+      || header.checksum != recutils_snapshot_checksum (p, end - p)
+      || !recutils_snapshot_get_num (&p, end, &num))
+    return NULL;
+
+  *error = NULL;
+  db = rec_db_new ();
+  if (db == NULL)
+    return NULL;
+  for (i = 0; i < num; i++)
+    {
+      rset = recutils_snapshot_get_rset (&p, end, &names);
+      if (rset == NULL)
+        break;
+      if (!rec_db_insert_rset (db, rset, rec_db_size (db)))
+        {
+          rec_rset_destroy (rset);
+          break;
+        }
+    }
+  free (names.names);
+  if (i < num || p != end)
+    {
+      *error = "corrupted snapshot";
+      rec_db_destroy (db);
+      return NULL;
+    }
+  return db;
+}
+
+/* Save a database into the snapshot file FILENAME, see SNAPSHOTS.  */
+
+static PyObject*
+recdb_save_snapshot (recdb *self, PyObject *args, PyObject *kwds)
+{
+  char *filename;
+  struct recutils_buf_s buf = { NULL, 0, 0, false };
+  struct recutils_snapshot_header_s *header;
+  FILE *out;
+  int err = 0;
+  static char *kwlist[] = {"filename", NULL};
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "s", kwlist, &filename))
+    {
+      return NULL;
+    }
+  if (!recutils_lazy_load (self, NULL, true))
+    {
+      return NULL;
+    }
+  recutils_snapshot_encode (self->rdb, &buf);
+  if (buf.nomem)
+    {
+      free (buf.data);
+      return PyErr_NoMemory ();
+    }
+  header = (struct recutils_snapshot_header_s *) buf.data;
+  memcpy (header->magic, RECUTILS_SNAPSHOT_MAGIC, sizeof (header->magic));
+  header->version = RECUTILS_SNAPSHOT_VERSION;
+  header->bom = RECUTILS_SNAPSHOT_BOM;
+  header->size = buf.size - sizeof (*header);
+  header->checksum = recutils_snapshot_checksum (buf.data + sizeof (*header),
+                                                 header->size);
+
+  Py_BEGIN_ALLOW_THREADS
+  out = fopen (filename, "w");
+  if (out == NULL)
+    err = errno;
+  else
+    {
+      if (fwrite (buf.data, buf.size, 1, out) != 1)
+        err = errno;
+      if (fclose (out) != 0 && err == 0)
+        err = errno;
+    }
+  Py_END_ALLOW_THREADS
+
+  free (buf.data);
+  if (err)
     {
-      PyErr_SetString (RecError, "parse error");
+      PyErr_SetString (RecError, strerror (err));
       return NULL;
     }
   return Py_BuildValue ("");
 }
 
-/*Write to file from a DB object */ 
+/* Replace the contents of a database with the snapshot stored in
+   FILENAME by save_snapshot.  The file is mapped in memory and
+   decoded with the GIL released.  */
 
 static PyObject*
-recdb_pywritefile (recdb *self, PyObject *args, PyObject *kwds)
+recdb_load_snapshot (recdb *self, PyObject *args, PyObject *kwds)
 {
-  char *string = NULL;
-  bool success;
+  char *filename;
+  char *data;
+  size_t size = 0;
+  const char *error = NULL;
+  rec_db_t db = NULL;
+  int errnum;
   static char *kwlist[] = {"filename", NULL};
-  if (!PyArg_ParseTupleAndKeywords (args, kwds, "s", kwlist, &string))
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "s", kwlist, &filename))
     {
       return NULL;
     }
-  FILE *out = fopen (string,"w");
-  if (out == NULL)
+
+  Py_BEGIN_ALLOW_THREADS
+  errnum = recutils_map_file (filename, &data, &size, NULL);
+  if (errnum == 0)
     {
-      PyErr_SetString (RecError, strerror (errno));
+      db = recutils_snapshot_decode (data, size, &error);
+      if (size > 0)
+        munmap (data, size);
+    }
+  Py_END_ALLOW_THREADS
+
+  if (errnum)
+    {
+      PyErr_SetString (RecError, strerror (errnum));
       return NULL;
     }
-  rec_writer_t writer = rec_writer_new (out);
-  success = rec_write_db (writer, self->rdb);
-  if (!success)
+  if (db == NULL)
     {
-      PyErr_SetString (RecError, "parse error");
+      if (error == NULL)
+        return PyErr_NoMemory ();
+      PyErr_SetString (RecError, error);
+      return NULL;
+    }
+  if (!recutils_check_idle (self))
+    {
+      rec_db_destroy (db);
       return NULL;
     }
-  fclose (out);
+  rec_db_destroy (self->rdb);
+  self->rdb = db;
+  recutils_indexes_invalidate (self->indexes, NULL, true);
+  recutils_generation_bump (self, NULL, true);
+  recutils_lazy_free (self->lazy);
+  self->lazy = NULL;
+  /* The database no longer matches a rec file.  */
+  recutils_sync_free (self->sync);
+  self->sync = NULL;
+  recutils_wal_free (self->wal);
+  self->wal = NULL;
   return Py_BuildValue ("");
-
 }
 
 
@@ -244,8 +6135,14 @@ recdb_get_rset (recdb *self, PyObject *args, PyObject *kwds)
     {
       return NULL;
     }
+  if (pos >= 0 && !recutils_lazy_load_at (self, pos))
+    {
+      return NULL;
+    }
   res = rec_db_get_rset (self->rdb, pos);
   tmp->rst = res;
+  tmp->owner = (PyObject *) self;
+  Py_INCREF (self);
   result =  Py_BuildValue ("O",tmp);
   return result;
 }
@@ -277,7 +6174,13 @@ recdb_pyinsert_rset (recdb *self, PyObject *args, PyObject *kwds)
     {
       return NULL; 
     }
+  if (!recutils_check_idle (self))
+    {
+      return NULL;
+    }
   success = rec_db_insert_rset (self->rdb, recset->rst, position);
+  recutils_indexes_invalidate (self->indexes, NULL, true);
+  recutils_generation_bump (self, NULL, true);
   if (!success)
     {
       PyErr_SetString (RecError, "Record set insertion failed");
@@ -306,7 +6209,17 @@ recdb_pyremove_rset (recdb *self, PyObject *args, PyObject *kwds)
     {
       return NULL;
     }
+  if (!recutils_check_idle (self))
+    {
+      return NULL;
+    }
+  if (!recutils_lazy_load_at (self, position))
+    {
+      return NULL;
+    }
   success = rec_db_remove_rset (self->rdb, position);
+  recutils_indexes_invalidate (self->indexes, NULL, true);
+  recutils_generation_bump (self, NULL, true);
   if (!success)
     {
       PyErr_SetString (RecError, "Record set deletion failed");
@@ -347,12 +6260,87 @@ recdb_get_rset_by_type (recdb *self, PyObject *args, PyObject *kwds)
       {
         return NULL;
       }
+    if (!recutils_lazy_load (self, type, false))
+      {
+        return NULL;
+      }
     res = rec_db_get_rset_by_type (self->rdb,type);
     tmp->rst = res;
+    tmp->owner = (PyObject *) self;
+    Py_INCREF (self);
     result =  Py_BuildValue ("O",tmp);
     return result;
 }
 
+/* Create an index on the field FIELD of the record set of type TYPE
+   (None for the default record set).  KIND is either "hash" (the
+   default) or "ordered".  With a hash index, queries whose selection
+   expression is a case-sensitive equality between FIELD and a string
+   or integer literal are answered from the index, without scanning
+   the record set.  With an ordered index the same happens for range
+   comparisons and anchored prefix matches on FIELD, and sorting by
+   FIELD becomes a walk of the index.  The index is kept up to date by
+   the mutation functions of the database.  Creating an index which
+   already exists just rebuilds it.  */
+
+static PyObject*
+recdb_create_index (recdb *self, PyObject *args, PyObject *kwds)
+{
+  const char *type;
+  const char *field;
+  const char *kind_str = "hash";
+  enum recutils_index_kind_e kind;
+  struct recutils_index_s *index;
+  static char *kwlist[] = {"type", "field", "kind", NULL};
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "zs|s", kwlist,
+                                    &type, &field, &kind_str))
+    {
+      return NULL;
+    }
+  if (strcmp (kind_str, "hash") == 0)
+    kind = RECUTILS_INDEX_HASH;
+  else if (strcmp (kind_str, "ordered") == 0)
+    kind = RECUTILS_INDEX_ORDERED;
+  else
+    {
+      PyErr_SetString (PyExc_ValueError, "kind must be 'hash' or 'ordered'");
+      return NULL;
+    }
+  if (!recutils_lazy_load (self, type, false))
+    {
+      return NULL;
+    }
+  if (!rec_db_type_p (self->rdb, type))
+    {
+      PyErr_SetString (RecError, "No such record set");
+      return NULL;
+    }
+  index = recutils_index_find (self->indexes, type, field, kind);
+  if (index == NULL)
+    {
+      index = calloc (1, sizeof (struct recutils_index_s));
+      if (index == NULL)
+        {
+          return PyErr_NoMemory ();
+        }
+      index->type = type ? strdup (type) : NULL;
+      index->field = strdup (field);
+      index->kind = kind;
+      if ((type && index->type == NULL) || index->field == NULL)
+        {
+          recutils_indexes_free (index);
+          return PyErr_NoMemory ();
+        }
+      index->next = self->indexes;
+      self->indexes = index;
+    }
+  if (!recutils_index_build (index, self->rdb))
+    {
+      return PyErr_NoMemory ();
+    }
+  return Py_BuildValue ("");
+}
+
 /******************** Database High-Level functions *******************/
 
 /* Query for some data in a database.  The resulting data is returned
@@ -452,57 +6440,853 @@ recdb_get_rset_by_type (recdb *self, PyObject *args, PyObject *kwds)
 
       REC_Q_ICASE
 
-      If set the string operations in the selection expression will be
-      case-insensitive.  If FALSE any string operation will be
-      case-sensitive.
+      If set the string operations in the selection expression will be
+      case-insensitive.  If FALSE any string operation will be
+      case-sensitive.
+
+   THREADS
+
+      Number of threads evaluating the selection and projection of
+      plain queries over a single record set, 1 by default.  A value
+      less than 1 means one thread per online processor.
+
+   LIMIT
+
+      If not negative, the maximum number of records returned.  -1 by
+      default.
+
+   OFFSET
+
+      Number of records of the result skipped before the returned
+      ones, 0 by default.  Plain queries with a LIMIT or an OFFSET
+      are answered in a single thread, stopping once enough records
+      are found, or keeping the best records in a bounded heap if
+      they are sorted.
+
+  This function returns NULL if there is not enough memory to
+  perform the operation.  */
+
+static PyObject*
+recdb_query (recdb *self, PyObject *args, PyObject *kwds)
+{
+  const char  *type;
+  const char  *join;
+  size_t      *index;
+  sex         *sexp;
+  const char  *fast_string;
+  size_t       random = 0;
+  fex         *fexp;
+  const char  *password;
+  fex         *group_by;
+  fex         *sort_by;
+  int          flags;
+  int          threads = 1;
+  Py_ssize_t   limit = -1;
+  Py_ssize_t   offset = 0;
+  rset        *tmp;
+  rec_rset_t res = NULL;
+  PyObject    *key = NULL;
+  bool         windowed;
+  static char *kwlist[] = {"type", "join", "index", "sexp",
+                           "fast_string", "random", "fexp",
+                           "password", "group_by", "sort_by",
+                           "flags", "threads", "limit", "offset", NULL};
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "zzzOziOzOOi|inn", kwlist,
+                                    &type, &join, &index, &sexp, &fast_string, 
+                                    &random, &fexp, &password, &group_by, 
+                                    &sort_by, &flags, &threads, &limit,
+                                    &offset))
+    { 
+
+      return NULL;
+    }
+  if (offset < 0)
+    {
+      PyErr_SetString (PyExc_ValueError, "offset must not be negative");
+      return NULL;
+    }
+  if (!recutils_lazy_load (self, type, join != NULL))
+    {
+      return NULL;
+    }
+  if (self->query_cache && self->query_cache->maxsize > 0)
+    {
+      key = recutils_query_key (type, join, (const char *) index, sexp,
+                                fast_string, random, recutils_fex (fexp),
+                                password, recutils_fex (group_by),
+                                recutils_fex (sort_by), flags, limit,
+                                offset);
+      if (key)
+        res = recutils_query_cache_get (self, key);
+      if (res)
+        {
+          Py_DECREF (key);
+          key = NULL;
+        }
+    }
+  /* Cached results are already windowed.  */
+  windowed = res != NULL;
+  if (res == NULL
+      && !recutils_index_query (self, type, join, index, sexp, fast_string,
+                                random, recutils_fex (fexp), password,
+                                recutils_fex (group_by), recutils_fex (sort_by),
+                                flags, &res)
+      && !(windowed
+           = recutils_plain_query_p (self, join, index, random,
+                                     recutils_fex (fexp), password,
+                                     recutils_fex (group_by), flags)
+             && recutils_limit_query (self, type, sexp, fast_string,
+                                      recutils_fex (fexp),
+                                      recutils_fex (sort_by), flags, limit,
+                                      offset, &res))
+      && !(recutils_plain_query_p (self, join, index, random,
+                                   recutils_fex (fexp), password,
+                                   recutils_fex (group_by), flags)
+           && recutils_scan_query (self, type, sexp, fast_string,
+                                   recutils_fex (fexp),
+                                   recutils_fex (sort_by), flags, threads,
+                                   &res))
+      && !recutils_join_query (self, type, join, index, sexp, fast_string,
+                               random, recutils_fex (fexp), password,
+                               recutils_fex (group_by),
+                               recutils_fex (sort_by), flags, &res))
+    {
+      res = rec_db_query (self->rdb, type, join, index,
+                          recutils_sex (sexp), fast_string, random,
+                          recutils_fex (fexp), password,
+                          recutils_fex (group_by),
+                          recutils_fex (sort_by), flags);
+    }
+  if (res && !windowed && (limit >= 0 || offset > 0))
+    res = recutils_rset_window (res, limit, offset);
+  if (key)
+    {
+      if (res)
+        recutils_query_cache_put (self, key, type, join, res);
+      Py_DECREF (key);
+    }
+  tmp = PyObject_NEW (rset, &rsetType);
+  if (tmp == NULL)
+    {
+      if (res)
+        rec_rset_destroy (res);
+      return NULL;
+    }
+  tmp->rst = res;
+  tmp->owner = NULL;
+  return Py_BuildValue ("O",tmp);
+}
+
+/*
+ * AGGREGATION
+ *
+ * recdb.aggregate computes counts, sums, averages, minimums and
+ * maximums of fields over the records of a record set matching a
+ * selection expression, grouped by the values of some fields, in a
+ * single pass.  Each matching record updates the accumulators of its
+ * group, found in a hash table keyed by its group-by values, so that
+ * neither the matching records nor the groups are ever copied.
+ */
+
+enum recutils_agg_func_e
+{
+  RECUTILS_AGG_COUNT,
+  RECUTILS_AGG_SUM,
+  RECUTILS_AGG_AVG,
+  RECUTILS_AGG_MIN,
+  RECUTILS_AGG_MAX
+};
+
+static const char *recutils_agg_names[] = { "count", "sum", "avg", "min",
+                                            "max" };
+
+struct recutils_agg_s
+{
+  enum recutils_agg_func_e func;
+  char *field;
+  PyObject *name;
+};
+
+/* COUNT counts the occurrences of the field and NUM_VALUES those
+   holding a number.  INTEGRAL tells whether they are all integers,
+   whose sum, minimum and maximum are then also kept exactly in ISUM,
+   IMIN and IMAX, as long as the sum does not overflow.  */
+
+struct recutils_acc_s
+{
+  size_t count;
+  size_t num_values;
+  double sum;
+  double min;
+  double max;
+  long long isum;
+  long long imin;
+  long long imax;
+  bool integral;
+};
+
+/* The key of a group holds, for every group-by field, a byte telling
+   whether the record has the field, followed by its value and a NUL
+   if it does.  */
+
+struct recutils_group_s
+{
+  char *key;
+  size_t key_size;
+  unsigned int hash;
+  struct recutils_acc_s *accs;
+  struct recutils_group_s *next;
+};
+
+struct recutils_groups_s
+{
+  struct recutils_group_s **buckets;
+  size_t num_buckets;
+  struct recutils_group_s **groups;     /* In order of appearance.  */
+  size_t num_groups;
+  size_t allocated;
+};
+
+/* Parse AGG, "Func(Field)", into *RES.  */
+
+static bool
+recutils_agg_parse (PyObject *agg, struct recutils_agg_s *res)
+{
+  const char *str, *open, *close;
+  size_t i, len;
+
+  str = PyString_Check (agg) ? PyString_AsString (agg) : NULL;
+  open = str ? strchr (str, '(') : NULL;
+  close = open ? strchr (open, ')') : NULL;
+  if (close && close[1] == '\0' && close > open + 1)
+    for (i = 0; i < sizeof (recutils_agg_names) / sizeof (char *); i++)
+      {
+        len = strlen (recutils_agg_names[i]);
+        if ((size_t) (open - str) == len
+            && strncasecmp (str, recutils_agg_names[i], len) == 0)
+          {
+            res->func = i;
+            res->field = strndup (open + 1, close - open - 1);
+            if (res->field == NULL)
+              {
+                PyErr_NoMemory ();
+                return false;
+              }
+            res->name = agg;
+            return true;
+          }
+      }
+  PyErr_SetString (PyExc_ValueError, "aggregates must be strings like"
+                   " 'Count(Field)', 'Sum(Field)', 'Avg(Field)',"
+                   " 'Min(Field)' or 'Max(Field)'");
+  return false;
+}
+
+/* Return the group of KEY in GROUPS, adding it with NUM_AGGS empty
+   accumulators if needed, or NULL if there is not enough memory.  */
+
+static struct recutils_group_s *
+recutils_groups_get (struct recutils_groups_s *groups, const char *key,
+                     size_t key_size, size_t num_aggs)
+{
+  struct recutils_group_s *group, *next, **tmp;
+  unsigned int hash = recutils_wal_checksum (key, key_size);
+  size_t i;
+
+  if (groups->num_buckets > 0)
+    for (group = groups->buckets[hash % groups->num_buckets]; group;
+         group = group->next)
+      if (group->hash == hash && group->key_size == key_size
+          && memcmp (group->key, key, key_size) == 0)
+        return group;
+
+  if (groups->num_groups == groups->allocated)
+    {
+      groups->allocated = groups->allocated ? groups->allocated * 2 : 64;
+      tmp = realloc (groups->groups,
+                     groups->allocated * sizeof (struct recutils_group_s *));
+      if (tmp == NULL)
+        return NULL;
+      groups->groups = tmp;
+      /* Rehash with as many buckets as the room for groups.  */
+      tmp = calloc (groups->allocated, sizeof (struct recutils_group_s *));
+      if (tmp == NULL)
+        return NULL;
+      free (groups->buckets);
+      groups->buckets = tmp;
+      groups->num_buckets = groups->allocated;
+      for (i = 0; i < groups->num_groups; i++)
+        {
+          next = groups->groups[i];
+          next->next = tmp[next->hash % groups->num_buckets];
+          tmp[next->hash % groups->num_buckets] = next;
+        }
+    }
+  group = calloc (1, sizeof (struct recutils_group_s));
+  if (group == NULL)
+    return NULL;
+  group->key = malloc (key_size + 1);
+  group->accs = calloc (num_aggs ? num_aggs : 1,
+                        sizeof (struct recutils_acc_s));
+  if (group->key == NULL || group->accs == NULL)
+    {
+      free (group->key);
+      free (group->accs);
+      free (group);
+      return NULL;
+    }
+  memcpy (group->key, key, key_size);
+  group->key_size = key_size;
+  group->hash = hash;
+  for (i = 0; i < num_aggs; i++)
+    group->accs[i].integral = true;
+  group->next = groups->buckets[hash % groups->num_buckets];
+  groups->buckets[hash % groups->num_buckets] = group;
+  groups->groups[groups->num_groups++] = group;
+  return group;
+}
+
+static void
+recutils_groups_free (struct recutils_groups_s *groups)
+{
+  size_t i;
+  for (i = 0; i < groups->num_groups; i++)
+    {
+      free (groups->groups[i]->key);
+      free (groups->groups[i]->accs);
+      free (groups->groups[i]);
+    }
+  free (groups->groups);
+  free (groups->buckets);
+}
+
+/* Add the fields of RECORD to the accumulators ACCS of the aggregates
+   AGGS.  */
+
+static void
+recutils_acc_add (struct recutils_acc_s *accs, struct recutils_agg_s *aggs,
+                  size_t num_aggs, rec_record_t record)
+{
+  struct recutils_acc_s *acc;
+  const char *value;
+  long long n;
+  double d;
+  size_t i, j, num;
+  bool integral;
+
+  for (i = 0; i < num_aggs; i++)
+    {
+      acc = &accs[i];
+      num = rec_record_get_num_fields_by_name (record, aggs[i].field);
+      acc->count += num;
+      if (aggs[i].func == RECUTILS_AGG_COUNT)
+        continue;
+      for (j = 0; j < num; j++)
+        {
+          value = rec_field_value (rec_record_get_field_by_name (record,
+                                                                 aggs[i].field,
+                                                                 j));
+          if ((integral = recutils_parse_int (value, &n)))
+            d = n;
+          else if (!recutils_parse_real (value, &d))
+            continue;
+          if (integral && acc->integral
+              && ((n > 0 && acc->isum > LLONG_MAX - n)
+                  || (n < 0 && acc->isum < LLONG_MIN - n)))
+            integral = false;
+          acc->integral = acc->integral && integral;
+          if (acc->integral)
+            {
+              acc->isum += n;
+              if (acc->num_values == 0 || n < acc->imin)
+                acc->imin = n;
+              if (acc->num_values == 0 || n > acc->imax)
+                acc->imax = n;
+            }
+          acc->sum += d;
+          if (acc->num_values == 0 || d < acc->min)
+            acc->min = d;
+          if (acc->num_values == 0 || d > acc->max)
+            acc->max = d;
+          acc->num_values++;
+        }
+    }
+}
+
+static PyObject *
+recutils_acc_value (struct recutils_acc_s *acc, enum recutils_agg_func_e func)
+{
+  long long n;
+  switch (func)
+    {
+    case RECUTILS_AGG_COUNT:
+      return Py_BuildValue ("n", (Py_ssize_t) acc->count);
+    case RECUTILS_AGG_AVG:
+      if (acc->num_values == 0)
+        return Py_BuildValue ("");
+      return Py_BuildValue ("d", acc->sum / acc->num_values);
+    default:
+      if (func != RECUTILS_AGG_SUM && acc->num_values == 0)
+        return Py_BuildValue ("");
+      if (!acc->integral)
+        return Py_BuildValue ("d", func == RECUTILS_AGG_SUM ? acc->sum
+                              : func == RECUTILS_AGG_MIN ? acc->min
+                              : acc->max);
+      n = func == RECUTILS_AGG_SUM ? acc->isum
+        : func == RECUTILS_AGG_MIN ? acc->imin : acc->imax;
+      if (n >= LONG_MIN && n <= LONG_MAX)
+        return Py_BuildValue ("l", (long) n);
+      return PyLong_FromLongLong (n);
+    }
+}
+
+/* Compute the aggregates AGGREGATES, a sequence of strings such as
+   "Count(Id)", "Sum(Amount)", "Avg(Rating)", "Min(Date)" or
+   "Max(Date)", over the records of type TYPE matching SEXP (all of
+   them if None), grouped by the fields of the fex GROUP_BY (a single
+   group if None).  Return a list of dictionaries, one per group in
+   order of appearance, mapping the group-by fields to their values,
+   or None for records lacking them, and the aggregates to their
+   values.  See AGGREGATION.  */
+
+static PyObject*
+recdb_aggregate (recdb *self, PyObject *args, PyObject *kwds)
+{
+  const char *type;
+  PyObject *group_by;
+  PyObject *aggregates;
+  PyObject *sexp = Py_None;
+  PyObject *seq = NULL, *result = NULL, *dict, *val, *key;
+  struct recutils_agg_s *aggs = NULL;
+  struct recutils_groups_s groups = { NULL, 0, NULL, 0, 0 };
+  struct recutils_buf_s buf = { NULL, 0, 0, false };
+  struct recutils_group_s *group;
+  rec_fex_t fx = NULL;
+  rec_rset_t rset;
+  rec_record_t record;
+  rec_field_t fld;
+  rec_mset_iterator_t iter;
+  const void *data;
+  const char *p, *fname;
+  size_t i, j, num_aggs = 0, num_fields = 0;
+  bool status, success = true;
+  static char *kwlist[] = {"type", "group_by", "aggregates", "sexp", NULL};
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "zOO|O", kwlist, &type,
+                                    &group_by, &aggregates, &sexp))
+    {
+      return NULL;
+    }
+  if ((group_by != Py_None && !PyObject_TypeCheck (group_by, &fexType))
+      || (sexp != Py_None && !PyObject_TypeCheck (sexp, &sexType)))
+    {
+      PyErr_SetString (PyExc_TypeError, "group_by must be a fex and sexp"
+                       " a sex, or None");
+      return NULL;
+    }
+  if (group_by != Py_None)
+    {
+      fx = recutils_fex ((fex *) group_by);
+      num_fields = rec_fex_size (fx);
+    }
+  seq = PySequence_Fast (aggregates, "aggregates must be a sequence");
+  if (seq == NULL || !recutils_lazy_load (self, type, false))
+    goto exit;
+  aggs = calloc (PySequence_Fast_GET_SIZE (seq) + 1,
+                 sizeof (struct recutils_agg_s));
+  if (aggs == NULL)
+    {
+      PyErr_NoMemory ();
+      goto exit;
+    }
+  for (; num_aggs < (size_t) PySequence_Fast_GET_SIZE (seq); num_aggs++)
+    if (!recutils_agg_parse (PySequence_Fast_GET_ITEM (seq, num_aggs),
+                             &aggs[num_aggs]))
+      goto exit;
+
+  rset = rec_db_get_rset_by_type (self->rdb, type);
+  iter = rec_mset_iterator (rset ? rec_rset_mset (rset) : NULL);
+  while (success && rset
+         && rec_mset_iterator_next (&iter, MSET_RECORD, &data, NULL))
+    {
+      record = (rec_record_t) data;
+      if (sexp != Py_None
+          && (!recutils_sex_eval ((sex *) sexp, record, &status) || !status))
+        continue;
+      buf.size = 0;
+      for (i = 0; i < num_fields; i++)
+        {
+          fname = rec_fex_elem_field_name (rec_fex_get (fx, i));
+          fld = rec_record_get_field_by_name (record, fname, 0);
+          recutils_buf_put (&buf, fld ? "\1" : "", 1);
+          if (fld)
+            recutils_buf_put (&buf, rec_field_value (fld),
+                              strlen (rec_field_value (fld)) + 1);
+        }
+      group = buf.nomem ? NULL
+        : recutils_groups_get (&groups, buf.data, buf.size, num_aggs);
+      if (group == NULL)
+        success = false;
+      else
+        recutils_acc_add (group->accs, aggs, num_aggs, record);
+    }
+  if (rset)
+    rec_mset_iterator_free (&iter);
+  /* Without grouping there is always a result.  */
+  if (success && num_fields == 0 && groups.num_groups == 0)
+    success = recutils_groups_get (&groups, "", 0, num_aggs) != NULL;
+  if (!success)
+    {
+      PyErr_NoMemory ();
+      goto exit;
+    }
+
+  result = PyList_New (groups.num_groups);
+  for (i = 0; result && i < groups.num_groups; i++)
+    {
+      group = groups.groups[i];
+      dict = PyDict_New ();
+      if (dict == NULL)
+        {
+          Py_CLEAR (result);
+          break;
+        }
+      PyList_SET_ITEM (result, i, dict);
+      p = group->key;
+      for (j = 0; j < num_fields; j++)
+        {
+          if (*p++)
+            {
+              val = PyString_FromString (p);
+              p += strlen (p) + 1;
+            }
+          else
+            val = Py_BuildValue ("");
+          key = PyString_FromString
+            (rec_fex_elem_field_name (rec_fex_get (fx, j)));
+          if (val == NULL || key == NULL || PyDict_SetItem (dict, key, val))
+            success = false;
+          Py_XDECREF (key);
+          Py_XDECREF (val);
+        }
+      for (j = 0; j < num_aggs; j++)
+        {
+          val = recutils_acc_value (&group->accs[j], aggs[j].func);
+          if (val == NULL || PyDict_SetItem (dict, aggs[j].name, val))
+            success = false;
+          Py_XDECREF (val);
+        }
+      if (!success)
+        Py_CLEAR (result);
+    }
+
+ exit:
+  for (i = 0; aggs && i < num_aggs; i++)
+    free (aggs[i].field);
+  free (aggs);
+  free (buf.data);
+  recutils_groups_free (&groups);
+  Py_XDECREF (seq);
+  return result;
+}
+
+/*
+ * CURSORS
+ *
+ * A cursor returned by recdb.cursor pages through the records of a
+ * record set matching a selection expression.  Each call to fetch
+ * resumes from where the previous one stopped, instead of running
+ * the whole query again: unsorted cursors keep an iterator over the
+ * record set, and sorted cursors keep the last record they returned,
+ * fetching the next page by scanning for the records sorting after
+ * it into a bounded heap (see recutils_limit_query).  No copy of the
+ * result is ever held.
+ *
+ * Cursors remember the generation of their record set and the epoch
+ * of the database (see QUERY CACHE), and refuse to fetch once any of
+ * them changed.
+ */
+
+/* Check that the record set of the cursor SELF didn't change since
+   it was created, setting an exception if it did.  */
+
+static bool
+cursor_check (cursor *self)
+{
+  if (self->epoch == self->db->epoch
+      && self->generation == recutils_generation (self->db, self->type))
+    return true;
+  PyErr_SetString (RecError, "record set modified since the cursor was"
+                   " created");
+  return false;
+}
+
+/* Return a cursor over the records of type TYPE matching SEXP, or
+   containing FAST_STRING, or all of them if both are None, projected
+   through FEXP if not None and sorted by SORT_BY if not None.  FLAGS
+   work as for query.  See CURSORS.  */
+
+static PyObject*
+recdb_cursor (recdb *self, PyObject *args, PyObject *kwds)
+{
+  const char *type;
+  PyObject *sexp = Py_None;
+  const char *fast_string = NULL;
+  PyObject *fexp = Py_None;
+  PyObject *sort_by = Py_None;
+  int flags = 0;
+  rec_rset_t rset;
+  cursor *tmp;
+  static char *kwlist[] = {"type", "sexp", "fast_string", "fexp",
+                           "sort_by", "flags", NULL};
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "z|OzOOi", kwlist, &type,
+                                    &sexp, &fast_string, &fexp, &sort_by,
+                                    &flags))
+    {
+      return NULL;
+    }
+  if (sexp != Py_None && fast_string)
+    {
+      PyErr_SetString (PyExc_ValueError,
+                       "sexp and fast_string are mutually exclusive");
+      return NULL;
+    }
+  if (!recutils_lazy_load (self, type, false))
+    {
+      return NULL;
+    }
+  rset = rec_db_get_rset_by_type (self->rdb, type);
+  if (rset == NULL)
+    {
+      PyErr_SetString (RecError, "No such record set");
+      return NULL;
+    }
+  tmp = PyObject_NEW (cursor, &cursorType);
+  if (tmp == NULL)
+    {
+      return NULL;
+    }
+  tmp->db = self;
+  Py_INCREF (self);
+  tmp->type = type ? strdup (type) : NULL;
+  tmp->fast_string = fast_string ? strdup (fast_string) : NULL;
+  tmp->sexp = sexp;
+  Py_INCREF (sexp);
+  tmp->fexp = fexp;
+  Py_INCREF (fexp);
+  tmp->sort_by = sort_by;
+  Py_INCREF (sort_by);
+  tmp->flags = flags;
+  tmp->epoch = self->epoch;
+  tmp->generation = recutils_generation (self, type);
+  tmp->iter = rec_mset_iterator (rec_rset_mset (rset));
+  tmp->last = NULL;
+  tmp->last_position = 0;
+  tmp->done = false;
+  if ((type && tmp->type == NULL) || (fast_string && tmp->fast_string == NULL))
+    {
+      Py_DECREF (tmp);
+      return PyErr_NoMemory ();
+    }
+  return (PyObject *) tmp;
+}
+
+static void
+cursor_dealloc (cursor *self)
+{
+  /* The iterator is left alone if its record set may be gone.  */
+  if (self->epoch == self->db->epoch
+      && self->generation == recutils_generation (self->db, self->type))
+    rec_mset_iterator_free (&self->iter);
+  Py_DECREF (self->db);
+  free (self->type);
+  free (self->fast_string);
+  Py_DECREF (self->sexp);
+  Py_DECREF (self->fexp);
+  Py_DECREF (self->sort_by);
+  self->ob_type->tp_free ((PyObject*) self);
+}
+
+/* Store in RECORDS the next records of the sorted cursor SELF, N of
+   them at most, and their number in *NUM.  Return 'false' if there is
+   not enough memory.  */
+
+static bool
+cursor_fetch_sorted (cursor *self, rec_rset_t rset,
+                     const struct recutils_needle_s *needle,
+                     rec_record_t *records, size_t n, size_t *num)
+{
+  struct recutils_ranking_s ranking;
+  struct recutils_ranked_s *heap, cand, last;
+  rec_mset_iterator_t iter;
+  const void *data;
+  size_t i, position = 0;
+
+  *num = 0;
+  heap = malloc ((n + 1) * sizeof (struct recutils_ranked_s));
+  if (heap == NULL
+      || !recutils_ranking_init (&ranking, rset,
+                                 recutils_fex ((fex *) self->sort_by),
+                                 self->flags))
+    {
+      free (heap);
+      return false;
+    }
+  recutils_ranking = &ranking;
+  last.record = self->last;
+  last.position = self->last_position;
+  iter = rec_mset_iterator (rec_rset_mset (rset));
+  while (rec_mset_iterator_next (&iter, MSET_RECORD, &data, NULL))
+    {
+      cand.record = (rec_record_t) data;
+      cand.position = position++;
+      if ((last.record == NULL || recutils_ranked_cmp (&cand, &last) > 0)
+          && recutils_record_match_p (cand.record, needle,
+                                      (sex *) self->sexp))
+        recutils_heap_offer (heap, num, n, &cand);
+    }
+  rec_mset_iterator_free (&iter);
+
+  qsort (heap, *num, sizeof (struct recutils_ranked_s), recutils_ranked_cmp);
+  for (i = 0; i < *num; i++)
+    records[i] = heap[i].record;
+  if (*num > 0)
+    {
+      self->last = heap[*num - 1].record;
+      self->last_position = heap[*num - 1].position;
+    }
+  free (heap);
+  free (ranking.types);
+  return true;
+}
 
-  This function returns NULL if there is not enough memory to
-  perform the operation.  */
+/* Return the next N records of the cursor, or less if there are no
+   more of them, in a record set.  */
 
 static PyObject*
-recdb_query (recdb *self, PyObject *args, PyObject *kwds)
+cursor_fetch (cursor *self, PyObject *args, PyObject *kwds)
 {
-  const char  *type;
-  const char  *join;
-  size_t      *index;
-  sex         *sexp;
-  const char  *fast_string;
-  size_t       random;
-  fex         *fexp;
-  const char  *password;
-  fex         *group_by;
-  fex         *sort_by;
-  int          flags;
-  rset        *tmp = PyObject_NEW (rset, &rsetType); //return type
-  rec_rset_t res;
-  static char *kwlist[] = {"type", "join", "index", "sexp",
-                           "fast_string", "random", "fexp",
-                           "password", "group_by", "sort_by",
-                           "flags", NULL};
-  if (!PyArg_ParseTupleAndKeywords (args, kwds, "zzzOziOzOOi", kwlist,
-                                    &type, &join, &index, &sexp, &fast_string, 
-                                    &random, &fexp, &password, &group_by, 
-                                    &sort_by, &flags))
-    { 
+  struct recutils_needle_s needle;
+  Py_ssize_t n;
+  rec_rset_t rst, res;
+  rec_record_t *records;
+  const void *data;
+  size_t num = 0;
+  rset *tmp;
+  static char *kwlist[] = {"n", NULL};
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "n", kwlist, &n))
+    {
+      return NULL;
+    }
+  if (n < 0)
+    {
+      PyErr_SetString (PyExc_ValueError, "n must not be negative");
+      return NULL;
+    }
+  if (!cursor_check (self))
+    {
+      return NULL;
+    }
+  rst = rec_db_get_rset_by_type (self->db->rdb, self->type);
+  if ((size_t) n > rec_rset_num_records (rst))
+    n = rec_rset_num_records (rst);
+  records = malloc ((n + 1) * sizeof (rec_record_t));
+  if (records == NULL)
+    {
+      return PyErr_NoMemory ();
+    }
+  if (self->fast_string)
+    recutils_needle_init (&needle, self->fast_string,
+                          self->flags & REC_F_ICASE);
+
+  if (self->done)
+    ;
+  else if (self->sort_by != Py_None)
+    {
+      if (!cursor_fetch_sorted (self, rst,
+                                self->fast_string ? &needle : NULL,
+                                records, n, &num))
+        {
+          free (records);
+          return PyErr_NoMemory ();
+        }
+      self->done = num < (size_t) n;
+    }
+  else
+    {
+      while (num < (size_t) n
+             && !(self->done = !rec_mset_iterator_next (&self->iter,
+                                                       MSET_RECORD, &data,
+                                                       NULL)))
+        if (recutils_record_match_p ((rec_record_t) data,
+                                     self->fast_string ? &needle : NULL,
+                                     (sex *) self->sexp))
+          records[num++] = (rec_record_t) data;
+    }
 
+  res = recutils_index_result (rst, records, num,
+                               recutils_fex ((fex *) self->fexp),
+                               self->flags);
+  free (records);
+  if (res == NULL)
+    {
+      return PyErr_NoMemory ();
+    }
+  tmp = PyObject_NEW (rset, &rsetType);
+  if (tmp == NULL)
+    {
+      rec_rset_destroy (res);
       return NULL;
     }
-  if ((PyObject *)sexp == Py_None)
-      sexp->sx = NULL;
-  if ((PyObject *)fexp == Py_None)
-      fexp->fx = NULL;
-  if ((PyObject *)group_by == Py_None)
-      group_by->fx = NULL;
-  if ((PyObject *)sort_by == Py_None)
-      sort_by->fx = NULL;
-  res = rec_db_query (self->rdb, type, join, index,
-                      sexp->sx, fast_string, random,
-                      fexp->fx, password, group_by->fx,
-                      sort_by->fx, flags);
   tmp->rst = res;
-  return Py_BuildValue ("O",tmp);
+  tmp->owner = NULL;
+  return (PyObject *) tmp;
 }
 
+static PyMethodDef cursor_methods[] = {
+    {"fetch", (PyCFunction)cursor_fetch, METH_VARARGS | METH_KEYWORDS,
+     "Return the next records of the cursor in a record set"
+    },
+    {NULL}  /* Sentinel */
+};
+
+/*cursor doc string */
+static char cursor_doc[] =
+  "Cursor paging through the records of a record set matching a selection expression.";
+
+/* Define the cursor object type */
+static PyTypeObject cursorType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "recutils.cursor",         /*tp_name*/
+    sizeof(cursor),            /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)cursor_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    cursor_doc,                /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    cursor_methods,            /* tp_methods */
+};
+
+
 
 /* Insert a new record into a database, either appending it to some
    record set or replacing one or more existing records.
@@ -597,11 +7381,14 @@ recdb_insert (recdb *self, PyObject *args, PyObject *kwds)
   size_t      *index;
   sex         *sexp;
   const char  *fast_string;
-  size_t       random;
+  size_t       random = 0;
   const char  *password;
   record      *recp;
   int          flags;
   bool success; 
+  bool append;
+  rec_rset_t rset;
+  rec_record_t stored;
   static char *kwlist[] = {"type", "index", "sexp",
                            "fast_string", "random",
                            "password", "recp",
@@ -614,11 +7401,52 @@ recdb_insert (recdb *self, PyObject *args, PyObject *kwds)
 
       return NULL;
     }
-  if ((PyObject *)sexp == Py_None)
-      sexp->sx = NULL;
+  if (!recutils_check_idle (self))
+    {
+      return NULL;
+    }
+  if (!recutils_lazy_load (self, type, false))
+    {
+      return NULL;
+    }
+  append = !(index || (PyObject *) sexp != Py_None || fast_string || random);
+  if (!recutils_wal_loggable_p (self, random, append ? NULL : password))
+    {
+      return NULL;
+    }
   success = rec_db_insert (self->rdb, type, index,
-                           sexp->sx, fast_string, random,
+                           recutils_sex (sexp), fast_string, random,
                            password, recp->rcd, flags);
+  if (!append)
+    recutils_indexes_invalidate (self->indexes, type, false);
+  else if (success)
+    {
+      recutils_indexes_record_appended (self->indexes, self->rdb, type);
+      self->appends++;
+    }
+  recutils_generation_bump (self, type, false);
+  if (success && self->wal)
+    {
+      /* An appended record is logged as stored, with its automatic
+         fields and encrypted values, so that replaying it gives the
+         same record.  */
+      stored = NULL;
+      rset = append ? rec_db_get_rset_by_type (self->rdb, type) : NULL;
+      if (rset && rec_rset_num_records (rset) > 0)
+        stored = rec_mset_get_at (rec_rset_mset (rset), MSET_RECORD,
+                                  rec_rset_num_records (rset) - 1);
+      if (stored
+          ? !recutils_wal_log (self, RECUTILS_WAL_INSERT, type, NULL, NULL,
+                               NULL, 0, NULL, NULL, 0, NULL, stored,
+                               flags | REC_F_NOAUTO)
+          : !recutils_wal_log (self, RECUTILS_WAL_INSERT, type,
+                               (const char *) index, sexp, fast_string,
+                               random, password, NULL, 0, NULL, recp->rcd,
+                               flags))
+        {
+          return NULL;
+        }
+    }
   return Py_BuildValue ("i",success);
 }
 
@@ -697,9 +7525,10 @@ recdb_delete (recdb *self, PyObject *args, PyObject *kwds)
   size_t      *index;
   sex         *sexp;
   const char  *fast_string;
-  size_t       random;
+  size_t       random = 0;
   int          flags;
   bool success; 
+  size_t      *found = NULL;
   static char *kwlist[] = {"type", "index", "sexp",
                            "fast_string", "random",
                            "flags", NULL};
@@ -711,11 +7540,39 @@ recdb_delete (recdb *self, PyObject *args, PyObject *kwds)
 
       return NULL;
     }
-  if ((PyObject *)sexp == Py_None)
-      sexp->sx = NULL;
-  success = rec_db_delete (self->rdb, type, index,
-                           sexp->sx, fast_string, 
+  if (!recutils_check_idle (self))
+    {
+      return NULL;
+    }
+  if (!recutils_lazy_load (self, type, false)
+      || !recutils_wal_loggable_p (self, random, NULL))
+    {
+      return NULL;
+    }
+  if (recutils_fast_string_select (self, type, index, sexp, fast_string,
+                                   random, flags, &found))
+    {
+      if (found == NULL)
+        return PyErr_NoMemory ();
+      if (found[0] == REC_Q_NOINDEX)
+        {
+          free (found);
+          return Py_BuildValue ("i", true);
+        }
+    }
+  success = rec_db_delete (self->rdb, type, found ? found : index,
+                           recutils_sex (sexp), found ? NULL : fast_string,
                            random, flags);
+  free (found);
+  recutils_indexes_invalidate (self->indexes, type, false);
+  recutils_generation_bump (self, type, false);
+  if (success
+      && !recutils_wal_log (self, RECUTILS_WAL_DELETE, type,
+                            (const char *) index, sexp, fast_string, random,
+                            NULL, NULL, 0, NULL, NULL, flags))
+    {
+      return NULL;
+    }
   return Py_BuildValue ("i",success);
 }
 
@@ -835,12 +7692,13 @@ recdb_set (recdb *self, PyObject *args, PyObject *kwds)
   size_t      *index;
   sex         *sexp;
   const char  *fast_string;
-  size_t       random;
+  size_t       random = 0;
   fex         *fexp;
   int          action;
   const char   *action_arg;
   int          flags;
   bool success; 
+  size_t      *found = NULL;
   static char *kwlist[] = {"type", "index", "sexp",
                            "fast_string", "random", 
                            "fexp", "action", "action_arg",
@@ -853,16 +7711,107 @@ recdb_set (recdb *self, PyObject *args, PyObject *kwds)
 
       return NULL;
     }
-  if ((PyObject *)sexp == Py_None)
-      sexp->sx = NULL;
-  if ((PyObject *)fexp == Py_None)
-      fexp->fx = NULL;
-  success = rec_db_set (self->rdb, type, index,
-                        sexp->sx, fast_string, random,
-                        fexp->fx, action, action_arg, flags);
+  if (!recutils_check_idle (self))
+    {
+      return NULL;
+    }
+  if (!recutils_lazy_load (self, type, false)
+      || !recutils_wal_loggable_p (self, random, NULL))
+    {
+      return NULL;
+    }
+  if (recutils_fast_string_select (self, type, index, sexp, fast_string,
+                                   random, flags, &found))
+    {
+      if (found == NULL)
+        return PyErr_NoMemory ();
+      if (found[0] == REC_Q_NOINDEX)
+        {
+          free (found);
+          return Py_BuildValue ("i", true);
+        }
+    }
+  success = rec_db_set (self->rdb, type, found ? found : index,
+                        recutils_sex (sexp), found ? NULL : fast_string,
+                        random, recutils_fex (fexp), action, action_arg,
+                        flags);
+  free (found);
+  recutils_indexes_invalidate (self->indexes, type, false);
+  recutils_generation_bump (self, type, false);
+  if (success
+      && !recutils_wal_log (self, RECUTILS_WAL_SET, type,
+                            (const char *) index, sexp, fast_string, random,
+                            NULL, recutils_fex (fexp), action, action_arg,
+                            NULL, flags))
+    {
+      return NULL;
+    }
   return Py_BuildValue ("i",success);
 }
 
+/* Set the maximum number of query results cached by a database.  A
+   size of 0, the default, disables the cache.  */
+
+static PyObject*
+recdb_set_query_cache_size (recdb *self, PyObject *args, PyObject *kwds)
+{
+  int maxsize;
+  static char *kwlist[] = {"maxsize", NULL};
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "i", kwlist, &maxsize))
+    {
+      return NULL;
+    }
+  if (maxsize < 0)
+    {
+      PyErr_SetString (PyExc_ValueError, "maxsize must not be negative");
+      return NULL;
+    }
+  if (self->query_cache == NULL)
+    {
+      self->query_cache = calloc (1, sizeof (struct recutils_query_cache_s));
+      if (self->query_cache == NULL)
+        return PyErr_NoMemory ();
+      self->query_cache->entries = PyDict_New ();
+      if (self->query_cache->entries == NULL)
+        {
+          free (self->query_cache);
+          self->query_cache = NULL;
+          return NULL;
+        }
+    }
+  self->query_cache->maxsize = maxsize;
+  if ((size_t) PyDict_Size (self->query_cache->entries) > (size_t) maxsize)
+    PyDict_Clear (self->query_cache->entries);
+  return Py_BuildValue ("");
+}
+
+/* Return the query cache counters as a dict.  */
+
+static PyObject*
+recdb_query_cache_info (recdb *self)
+{
+  struct recutils_query_cache_s *cache = self->query_cache;
+  return Py_BuildValue ("{s:n,s:n,s:n,s:n}",
+                        "hits", (Py_ssize_t) (cache ? cache->hits : 0),
+                        "misses", (Py_ssize_t) (cache ? cache->misses : 0),
+                        "size", cache ? PyDict_Size (cache->entries) : 0,
+                        "maxsize", (Py_ssize_t) (cache ? cache->maxsize : 0));
+}
+
+/* Empty the query cache and reset its counters.  */
+
+static PyObject*
+recdb_query_cache_clear (recdb *self)
+{
+  if (self->query_cache)
+    {
+      PyDict_Clear (self->query_cache->entries);
+      self->query_cache->hits = 0;
+      self->query_cache->misses = 0;
+    }
+  return Py_BuildValue ("");
+}
+
 /* Check the integrity of all the record sets stored in a given
    database.  This function returns the number of errors found.
    Descriptive messages about the errors are appended to ERRORS.  */
@@ -884,6 +7833,10 @@ recdb_int_check (recdb *self, PyObject *args, PyObject *kwds)
       return NULL;
     }
 
+   if (!recutils_lazy_load (self, NULL, true))
+     {
+       return NULL;
+     }
    num = rec_int_check_db (self->rdb, check_descriptors_p, remote_descriptors_p, errors->buf);
    return Py_BuildValue ("i", num);
  }
@@ -898,17 +7851,43 @@ static PyMethodDef recdb_methods[] = {
      "Return the size of the DB"
     },
     {"pyloadfile", (PyCFunction)recdb_pyloadfile, 
-     METH_VARARGS, 
-     "Load data from file into DB"
+     METH_VARARGS | METH_KEYWORDS, 
+     "Load data from file into DB, optionally through a memory mapping"
     },
     {"pywritefile", (PyCFunction)recdb_pywritefile, 
-     METH_VARARGS, 
+     METH_VARARGS | METH_KEYWORDS, 
      "Write data from DB to file"
     },
+    {"sync", (PyCFunction)recdb_sync, 
+     METH_VARARGS | METH_KEYWORDS, 
+     "Save DB to a file, appending only the new records when possible"
+    },
+    {"open_wal", (PyCFunction)recdb_open_wal, 
+     METH_VARARGS | METH_KEYWORDS, 
+     "Log the mutations of DB to a write-ahead log, replaying it first"
+    },
+    {"close_wal", (PyCFunction)recdb_close_wal, METH_NOARGS,
+     "Stop logging the mutations of DB"
+    },
+    {"compact_wal", (PyCFunction)recdb_compact_wal, METH_NOARGS,
+     "Write DB over the base of its write-ahead log and empty the log"
+    },
+    {"save_snapshot", (PyCFunction)recdb_save_snapshot, 
+     METH_VARARGS | METH_KEYWORDS, 
+     "Save DB into a binary snapshot file"
+    },
+    {"load_snapshot", (PyCFunction)recdb_load_snapshot, 
+     METH_VARARGS | METH_KEYWORDS, 
+     "Load DB from a binary snapshot file"
+    },
     {"pyappendfile", (PyCFunction)recdb_pyappendfile, 
-     METH_VARARGS, 
+     METH_VARARGS | METH_KEYWORDS, 
      "Append data from DB to file"
     },
+    {"load_many", (PyCFunction)recdb_load_many, 
+     METH_VARARGS | METH_KEYWORDS, 
+     "Append data from several files into DB, parsing them in parallel"
+    },
     {"get_rset", (PyCFunction)recdb_get_rset, 
      METH_VARARGS, 
      "Get rset by position"
@@ -929,10 +7908,34 @@ static PyMethodDef recdb_methods[] = {
      METH_VARARGS, 
      "Get rset by type"
     },
+    {"create_index", (PyCFunction)recdb_create_index, 
+     METH_VARARGS | METH_KEYWORDS, 
+     "Create a hash or ordered index on a field of a record set"
+    },
     {"query", (PyCFunction)recdb_query, 
-     METH_VARARGS, 
+     METH_VARARGS | METH_KEYWORDS, 
      "Query the DB"
     },
+    {"aggregate", (PyCFunction)recdb_aggregate, 
+     METH_VARARGS | METH_KEYWORDS, 
+     "Compute grouped aggregates over a record set"
+    },
+    {"cursor", (PyCFunction)recdb_cursor, 
+     METH_VARARGS | METH_KEYWORDS, 
+     "Create a cursor paging through the records of a record set"
+    },
+    {"set_query_cache_size", (PyCFunction)recdb_set_query_cache_size, 
+     METH_VARARGS | METH_KEYWORDS, 
+     "Set the maximum number of cached query results"
+    },
+    {"query_cache_info", (PyCFunction)recdb_query_cache_info, 
+     METH_NOARGS, 
+     "Return the query cache counters"
+    },
+    {"query_cache_clear", (PyCFunction)recdb_query_cache_clear, 
+     METH_NOARGS, 
+     "Empty the query cache"
+    },
     {"insert", (PyCFunction)recdb_insert, 
      METH_VARARGS, 
      "Insert a record into DB"
@@ -999,6 +8002,403 @@ static PyTypeObject recdbType = {
 
 
 
+/* Create an iterator over the elements of type ELEM_TYPE in MSET,
+   which belongs to the Python object OWNER.  Every element is
+   returned wrapped in a borrowed object of type ITEM_TYPE.  */
+
+static PyObject *
+msetiter_new (PyObject *owner, rec_mset_t mset,
+              rec_mset_type_t elem_type, PyTypeObject *item_type)
+{
+  msetiter *self = PyObject_NEW (msetiter, &msetiterType);
+  if (self == NULL)
+    {
+      return NULL;
+    }
+  self->owner = owner;
+  Py_INCREF (owner);
+  self->iter = rec_mset_iterator (mset);
+  self->elem_type = elem_type;
+  self->item_type = item_type;
+  return (PyObject *) self;
+}
+
+static void
+msetiter_dealloc (msetiter *self)
+{
+  rec_mset_iterator_free (&self->iter);
+  Py_DECREF (self->owner);
+  self->ob_type->tp_free ((PyObject*) self);
+}
+
+/* Return the next element, or NULL without setting an exception once
+   the mset is exhausted.  */
+
+static PyObject *
+msetiter_next (msetiter *self)
+{
+  const void *data;
+  if (!rec_mset_iterator_next (&self->iter, self->elem_type, &data, NULL))
+    {
+      return NULL;
+    }
+  if (self->item_type == &recordType)
+    {
+      record *tmp = PyObject_NEW (record, &recordType);
+      if (tmp == NULL)
+        return NULL;
+      tmp->rcd = (rec_record_t) data;
+      tmp->owner = self->owner;
+      Py_INCREF (self->owner);
+      return (PyObject *) tmp;
+    }
+  else
+    {
+      field *tmp = PyObject_NEW (field, &fieldType);
+      if (tmp == NULL)
+        return NULL;
+      tmp->fld = (rec_field_t) data;
+      tmp->owner = self->owner;
+      Py_INCREF (self->owner);
+      return (PyObject *) tmp;
+    }
+}
+
+/*mset iterator doc string */
+static char msetiter_doc[] =
+  "Iterator over the records of a record set or the fields of a record.";
+
+/* Define the mset iterator object type */
+static PyTypeObject msetiterType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "recutils.mset_iterator",  /*tp_name*/
+    sizeof(msetiter),          /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)msetiter_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    msetiter_doc,              /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    PyObject_SelfIter,         /* tp_iter */
+    (iternextfunc)msetiter_next, /* tp_iternext */
+};
+
+
+/*
+ * COLUMNS
+ *
+ * Columns are read-only contiguous arrays built by rset.to_columns.
+ * They support the buffer protocol, so they can be wrapped in a
+ * memoryview or handed to numpy without copying.
+ */
+
+/* Create a column of LEN items of ITEMSIZE bytes described by FORMAT,
+   taking ownership of the malloc'ed block DATA.  */
+
+static PyObject *
+column_new_internal (char *data, Py_ssize_t len, Py_ssize_t itemsize,
+                     char format)
+{
+  column *self = PyObject_NEW (column, &columnType);
+  if (self == NULL)
+    {
+      free (data);
+      return NULL;
+    }
+  self->data = data;
+  self->len = len;
+  self->itemsize = itemsize;
+  self->format[0] = format;
+  self->format[1] = '\0';
+  return (PyObject *) self;
+}
+
+static void
+column_dealloc (column *self)
+{
+  free (self->data);
+  self->ob_type->tp_free ((PyObject*) self);
+}
+
+static Py_ssize_t
+column_length (column *self)
+{
+  return self->len;
+}
+
+static int
+column_getbuffer (column *self, Py_buffer *view, int flags)
+{
+  if (flags & PyBUF_WRITABLE)
+    {
+      PyErr_SetString (PyExc_BufferError, "columns are read-only");
+      return -1;
+    }
+  view->obj = (PyObject *) self;
+  Py_INCREF (self);
+  view->buf = self->data;
+  view->len = self->len * self->itemsize;
+  view->readonly = 1;
+  view->itemsize = self->itemsize;
+  view->format = (flags & PyBUF_FORMAT) ? self->format : NULL;
+  view->ndim = 1;
+  view->shape = (flags & PyBUF_ND) ? &self->len : NULL;
+  view->strides = (flags & PyBUF_STRIDES) ? &self->itemsize : NULL;
+  view->suboffsets = NULL;
+  view->internal = NULL;
+  return 0;
+}
+
+static PySequenceMethods column_as_sequence = {
+    (lenfunc)column_length,    /* sq_length */
+};
+
+static PyBufferProcs column_as_buffer = {
+    0,                         /* bf_getreadbuffer */
+    0,                         /* bf_getwritebuffer */
+    0,                         /* bf_getsegcount */
+    0,                         /* bf_getcharbuffer */
+    (getbufferproc)column_getbuffer, /* bf_getbuffer */
+    0,                         /* bf_releasebuffer */
+};
+
+/*column doc string */
+static char column_doc[] =
+  "A read-only contiguous array supporting the buffer protocol.";
+
+/* Define the column object type */
+static PyTypeObject columnType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "recutils.column",         /*tp_name*/
+    sizeof(column),            /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)column_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    &column_as_sequence,       /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    &column_as_buffer,         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /*tp_flags*/
+    column_doc,                /* tp_doc */
+};
+
+/* Kinds of columns built by rset.to_columns.  */
+
+enum recutils_column_kind_e
+{
+  RECUTILS_COLUMN_INT,
+  RECUTILS_COLUMN_REAL,
+  RECUTILS_COLUMN_BOOL,
+  RECUTILS_COLUMN_STR
+};
+
+/* Parse VALUE as a rec boolean, storing 1 for yes, true and 1 and 0
+   for no, false and 0 in NUM.  Return 'false' if VALUE is not a
+   boolean.  */
+
+static bool
+recutils_parse_bool (const char *value, long long *num)
+{
+  const char *p = value + strspn (value, " \t\n");
+  size_t len = strcspn (p, " \t\n");
+  if (p[len + strspn (p + len, " \t\n")] != '\0')
+    return false;
+  if ((len == 3 && strncmp (p, "yes", 3) == 0)
+      || (len == 4 && strncmp (p, "true", 4) == 0)
+      || (len == 1 && *p == '1'))
+    *num = 1;
+  else if ((len == 2 && strncmp (p, "no", 2) == 0)
+           || (len == 5 && strncmp (p, "false", 5) == 0)
+           || (len == 1 && *p == '0'))
+    *num = 0;
+  else
+    return false;
+  return true;
+}
+
+/* Decide the kind of column to build for the field FNAME of RSET.
+   TYPES, if not None, is a dict mapping field names to one of "int",
+   "real", "bool" or "str".  Fields not in TYPES get their kind from the type
+   declared in the record descriptor, defaulting to strings.  Return
+   -1 with an exception set on error.  */
+
+static int
+recutils_column_kind (rec_rset_t rset, const char *fname, PyObject *types)
+{
+  PyObject *kind;
+  rec_type_t type;
+  if (types != Py_None)
+    {
+      kind = PyDict_GetItemString (types, fname);
+      if (kind != NULL)
+        {
+          const char *str = PyString_AsString (kind);
+          if (str == NULL)
+            return -1;
+          if (strcmp (str, "int") == 0)
+            return RECUTILS_COLUMN_INT;
+          if (strcmp (str, "real") == 0)
+            return RECUTILS_COLUMN_REAL;
+          if (strcmp (str, "bool") == 0)
+            return RECUTILS_COLUMN_BOOL;
+          if (strcmp (str, "str") == 0)
+            return RECUTILS_COLUMN_STR;
+          PyErr_Format (PyExc_ValueError,
+                        "invalid column type '%s' for field %s", str, fname);
+          return -1;
+        }
+    }
+  type = rec_rset_get_field_type (rset, fname);
+  if (type != NULL)
+    {
+      switch (rec_type_kind (type))
+        {
+        case REC_TYPE_INT:
+        case REC_TYPE_RANGE:
+        case REC_TYPE_SIZE:
+          return RECUTILS_COLUMN_INT;
+        case REC_TYPE_REAL:
+          return RECUTILS_COLUMN_REAL;
+        case REC_TYPE_BOOL:
+          return RECUTILS_COLUMN_BOOL;
+        default:
+          break;
+        }
+    }
+  return RECUTILS_COLUMN_STR;
+}
+
+/* Build the column for the N-th occurrence of field FNAME in the
+   records of RSET.  Integer and real columns are single int64/float64
+   columns where missing or malformed values are stored as 0 and NaN
+   respectively.  Boolean columns are int64 columns holding 1 for true
+   values and 0 otherwise.  String columns are returned as a tuple (offsets,
+   data): OFFSETS is an int64 column of num_records + 1 items and the
+   value of the i-th record is data[offsets[i]:offsets[i+1]].  */
+
+static PyObject *
+recutils_build_column (rec_rset_t rset, const char *fname, size_t n,
+                       int kind)
+{
+  size_t num_records = rec_rset_num_records (rset);
+  size_t i = 0;
+  rec_mset_iterator_t iter;
+  const void *data;
+  long long *ints = NULL;
+  double *reals = NULL;
+  long long *offsets = NULL;
+  char *chars = NULL;
+  size_t chars_size = 0, chars_allocated = 0;
+  PyObject *result, *offsets_col, *chars_col;
+
+  if (kind == RECUTILS_COLUMN_INT || kind == RECUTILS_COLUMN_BOOL)
+    ints = malloc ((num_records ? num_records : 1) * sizeof (long long));
+  else if (kind == RECUTILS_COLUMN_REAL)
+    reals = malloc ((num_records ? num_records : 1) * sizeof (double));
+  else
+    offsets = malloc ((num_records + 1) * sizeof (long long));
+  if (ints == NULL && reals == NULL && offsets == NULL)
+    return PyErr_NoMemory ();
+
+  iter = rec_mset_iterator (rec_rset_mset (rset));
+  while (i < num_records
+         && rec_mset_iterator_next (&iter, MSET_RECORD, &data, NULL))
+    {
+      rec_field_t fld
+        = rec_record_get_field_by_name ((rec_record_t) data, fname, n);
+      const char *value = fld ? rec_field_value (fld) : NULL;
+      if (kind == RECUTILS_COLUMN_INT)
+        {
+          if (value == NULL || !recutils_parse_int (value, &ints[i]))
+            ints[i] = 0;
+        }
+      else if (kind == RECUTILS_COLUMN_BOOL)
+        {
+          if (value == NULL || !recutils_parse_bool (value, &ints[i]))
+            ints[i] = 0;
+        }
+      else if (kind == RECUTILS_COLUMN_REAL)
+        {
+          if (value == NULL || !recutils_parse_real (value, &reals[i]))
+            reals[i] = NAN;
+        }
+      else
+        {
+          size_t len = value ? strlen (value) : 0;
+          offsets[i] = chars_size;
+          if (chars_size + len > chars_allocated)
+            {
+              char *tmp;
+              chars_allocated = (chars_size + len) * 2 + 64;
+              tmp = realloc (chars, chars_allocated);
+              if (tmp == NULL)
+                {
+                  rec_mset_iterator_free (&iter);
+                  free (chars);
+                  free (offsets);
+                  return PyErr_NoMemory ();
+                }
+              chars = tmp;
+            }
+          if (len > 0)
+            memcpy (chars + chars_size, value, len);
+          chars_size += len;
+        }
+      i++;
+    }
+  rec_mset_iterator_free (&iter);
+
+  if (kind == RECUTILS_COLUMN_INT || kind == RECUTILS_COLUMN_BOOL)
+    return column_new_internal ((char *) ints, i, sizeof (long long), 'q');
+  if (kind == RECUTILS_COLUMN_REAL)
+    return column_new_internal ((char *) reals, i, sizeof (double), 'd');
+
+  offsets[i] = chars_size;
+  if (chars == NULL)
+    chars = malloc (1);
+  offsets_col = column_new_internal ((char *) offsets, i + 1,
+                                     sizeof (long long), 'q');
+  chars_col = column_new_internal (chars, chars_size, 1, 'B');
+  if (offsets_col == NULL || chars_col == NULL)
+    {
+      Py_XDECREF (offsets_col);
+      Py_XDECREF (chars_col);
+      return NULL;
+    }
+  result = PyTuple_Pack (2, offsets_col, chars_col);
+  Py_DECREF (offsets_col);
+  Py_DECREF (chars_col);
+  return result;
+}
+
+
 /* Create a new empty record set and return a reference to it.  NULL
    is returned if there is no enough memory to perform the
    operation.  */
@@ -1029,7 +8429,10 @@ rset_new (PyTypeObject *type, PyObject *args, PyObject *kwds)
 static void
 rset_dealloc (rset* self)
 {
-  rec_rset_destroy (self->rst);
+  if (self->owner)
+    Py_DECREF (self->owner);
+  else
+    rec_rset_destroy (self->rst);
   self->ob_type->tp_free ((PyObject*)self);
 }
 
@@ -1056,6 +8459,8 @@ rset_descriptor (rset* self)
   reco = rec_rset_descriptor (self->rst);
   //printf("The desc is: %s", reco->source);
   tmp->rcd = reco;
+  tmp->owner = (PyObject *) self;
+  Py_INCREF (self);
   result = Py_BuildValue ("O",tmp);
   return result;
 }
@@ -1073,6 +8478,117 @@ rset_type (rset* self)
   return result;
 }
 
+/* Return an iterator over the records stored in the record set.  The
+   records are not copied: the yielded record objects refer to the
+   records in the set, which must not be modified while iterating.  */
+
+static PyObject*
+rset_iter (rset *self)
+{
+  return msetiter_new ((PyObject *) self, rec_rset_mset (self->rst),
+                       MSET_RECORD, &recordType);
+}
+
+/* Convert all the records of the record set into a list of dicts in
+   a single call.  Each dict maps field names to field values; fields
+   appearing several times in a record are mapped to a list of their
+   values.  If FEXP is not None only the fields selected by it are
+   converted.  Field names are interned once per call.  */
+
+static PyObject*
+rset_to_dicts (rset *self, PyObject *args, PyObject *kwds)
+{
+  PyObject *fexp = Py_None;
+  PyObject *result, *dict;
+  rec_fex_t fx = NULL;
+  rec_mset_iterator_t iter;
+  const void *data;
+  size_t i = 0;
+  struct recutils_names_s names = {NULL, 0, 0};
+  static char *kwlist[] = {"fexp", NULL};
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "|O", kwlist, &fexp))
+    {
+      return NULL;
+    }
+  if (fexp != Py_None)
+    fx = ((fex *) fexp)->fx;
+  result = PyList_New (rec_rset_num_records (self->rst));
+  if (result == NULL)
+    {
+      return NULL;
+    }
+  iter = rec_mset_iterator (rec_rset_mset (self->rst));
+  while (rec_mset_iterator_next (&iter, MSET_RECORD, &data, NULL))
+    {
+      dict = recutils_record_to_dict ((rec_record_t) data, fx, &names);
+      if (dict == NULL)
+        {
+          Py_CLEAR (result);
+          break;
+        }
+      PyList_SET_ITEM (result, i++, dict);
+    }
+  rec_mset_iterator_free (&iter);
+  recutils_names_free (&names);
+  return result;
+}
+
+/* Export the fields selected by FEXP as columns, returning a dict
+   mapping each field name (or its rewrite) to a column.  Only the
+   first field selected by each fex element is exported, i.e. the
+   field with the element's min index.  TYPES optionally maps field
+   names to "int", "real" or "str"; by default the kind of each column
+   follows the types declared in the record descriptor.  */
+
+static PyObject*
+rset_to_columns (rset *self, PyObject *args, PyObject *kwds)
+{
+  fex *fexp;
+  PyObject *types = Py_None;
+  PyObject *result, *col;
+  size_t i;
+  static char *kwlist[] = {"fexp", "types", NULL};
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "O|O", kwlist,
+                                    &fexp, &types))
+    {
+      return NULL;
+    }
+  if (types != Py_None && !PyDict_Check (types))
+    {
+      PyErr_SetString (PyExc_TypeError, "types must be a dict");
+      return NULL;
+    }
+  result = PyDict_New ();
+  if (result == NULL)
+    {
+      return NULL;
+    }
+  for (i = 0; i < rec_fex_size (fexp->fx); i++)
+    {
+      rec_fex_elem_t elem = rec_fex_get (fexp->fx, i);
+      const char *fname = rec_fex_elem_field_name (elem);
+      const char *rewrite_to = rec_fex_elem_rewrite_to (elem);
+      int min = rec_fex_elem_min (elem);
+      int kind = recutils_column_kind (self->rst, fname, types);
+      if (kind < 0)
+        {
+          Py_DECREF (result);
+          return NULL;
+        }
+      col = recutils_build_column (self->rst, fname, min < 0 ? 0 : min, kind);
+      if (col == NULL
+          || PyDict_SetItemString (result, rewrite_to ? rewrite_to : fname,
+                                   col) < 0)
+        {
+          Py_XDECREF (col);
+          Py_DECREF (result);
+          return NULL;
+        }
+      Py_DECREF (col);
+    }
+  return result;
+}
+
 /*rset doc string */
 static char rset_doc[] =
   "This type refers to the record set structure of recutils";
@@ -1087,6 +8603,12 @@ static PyMethodDef rset_methods[] = {
     },
     {"type", (PyCFunction)rset_type, METH_NOARGS,
      "Return the type name of a record set"
+   },
+    {"to_dicts", (PyCFunction)rset_to_dicts, METH_VARARGS | METH_KEYWORDS,
+     "Return the records of the record set as a list of dicts"
+   },
+    {"to_columns", (PyCFunction)rset_to_columns, METH_VARARGS | METH_KEYWORDS,
+     "Export the fields selected by a fex as buffer-protocol columns"
    },
     {NULL}
 };
@@ -1120,7 +8642,7 @@ static PyTypeObject rsetType = {
     0,                         /* tp_clear */
     0,                         /* tp_richcompare */
     0,                         /* tp_weaklistoffset */
-    0,                         /* tp_iter */
+    (getiterfunc)rset_iter,    /* tp_iter */
     0,                         /* tp_iternext */
     rset_methods,             /* tp_methods */
     0,                         /* tp_members */
@@ -1163,7 +8685,10 @@ record_new (PyTypeObject *type, PyObject *args, PyObject *kwds)
 static void
 record_dealloc (record* self)
 {
-  rec_record_destroy (self->rcd);
+  if (self->owner)
+    Py_DECREF (self->owner);
+  else
+    rec_record_destroy (self->rcd);
   self->ob_type->tp_free ((PyObject*)self);
 }  
 
@@ -1218,6 +8743,17 @@ record_contains_field (record* self, PyObject *args, PyObject *kwds)
 
 
 
+/* Return an iterator over the fields stored in the record.  The
+   fields are not copied: the yielded field objects refer to the
+   fields in the record.  */
+
+static PyObject*
+record_iter (record *self)
+{
+  return msetiter_new ((PyObject *) self, rec_record_mset (self->rcd),
+                       MSET_FIELD, &fieldType);
+}
+
 /*record doc string */
 static char record_doc[] =
   "This type refers to the record structure of recutils";
@@ -1267,7 +8803,7 @@ static PyTypeObject recordType = {
     0,                         /* tp_clear */
     0,                         /* tp_richcompare */
     0,                         /* tp_weaklistoffset */
-    0,                         /* tp_iter */
+    (getiterfunc)record_iter,  /* tp_iter */
     0,                         /* tp_iternext */
     record_methods,             /* tp_methods */
     0,                         /* tp_members */
@@ -1288,93 +8824,366 @@ static PyTypeObject recordType = {
 static PyObject *
 sex_new (PyTypeObject *type, PyObject *args, PyObject *kwds) 
 {
-  bool case_insensitive;
+  int case_insensitive;
   sex *self;
   static char *kwlist[] = {"case_insensitive",NULL};
   if (!PyArg_ParseTupleAndKeywords(args, kwds, "i", kwlist, &case_insensitive)) 
     {
       return NULL;
     }
-  self = (sex *) type->tp_alloc (type, 0);
-  if (self != NULL) 
+  self = (sex *) type->tp_alloc (type, 0);
+  if (self != NULL) 
+    {
+      self->sx = rec_sex_new(case_insensitive);
+      self->expr = NULL;
+      self->prog = NULL;
+      self->case_insensitive = case_insensitive;
+      self->shared = false;
+      
+      if (self->sx == NULL) 
+        {
+           /* Out of memory.  */
+          Py_DECREF (self);
+          return NULL;
+        }
+    }
+  return (PyObject *)self;
+}
+
+/* Destroy a sex, freeing any used resources.  */
+static void
+sex_dealloc (sex* self)
+{
+  rec_sex_destroy (self->sx);
+  free (self->expr);
+  recutils_program_free (self->prog);
+  self->ob_type->tp_free ((PyObject*)self);
+}
+
+/* Compile a sex.  Sexes must be compiled before being used.  If there
+   is a parse error return false.  */
+
+static PyObject*
+sex_pycompile (sex *self, PyObject *args, PyObject *kwds)
+{
+  const char *expr;
+  static char *kwlist[] = {"expr",NULL};
+  bool success;
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "z", kwlist, &expr)) 
+    {
+      return NULL;
+    }
+  if (self->shared)
+    {
+      PyErr_SetString (RecError, "Cached sexes can't be recompiled");
+      return NULL;
+    }
+  success = rec_sex_compile (self->sx,expr);
+  if (success)
+    {
+      free (self->expr);
+      self->expr = expr ? strdup (expr) : NULL;
+      recutils_program_free (self->prog);
+      self->prog = recutils_program_compile (expr, self->case_insensitive);
+    }
+  return Py_BuildValue ("i",success);
+}
+
+/* Apply a sex expression to a record, setting STATUS in accordance:
+   'true' if the record matched the sex, 'false' otherwise.  The
+   function returns the same value that is stored in STATUS.  */
+
+static PyObject*
+sex_pyeval (sex *self, PyObject *args, PyObject *kwds)
+{
+  bool status;
+  int status_arg;
+  record *rec;
+  bool success;
+  static char *kwlist[] = {"rec", "status",NULL};
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "Oi", kwlist, 
+                                    &rec,
+                                    &status_arg))
+    {
+      return NULL; 
+    }
+  success = recutils_sex_eval (self, rec->rcd, &status);
+  return Py_BuildValue ("i",success);
+}
+
+/* Apply a sex expression and get the result as an allocated
+   string.  */
+
+static PyObject*
+sex_eval_str (sex *self, PyObject *args, PyObject *kwds)
+{
+  record *rec;
+  char *str;  
+  PyObject *result;
+  int res = -1;
+  static char *kwlist[] = {"rec",NULL};
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "O", kwlist, 
+                                    &rec))
+    {
+    return NULL; 
+    }
+  if (self->prog)
+    res = recutils_program_run (self->prog, rec->rcd);
+  if (res >= 0)
+    return Py_BuildValue ("s", res ? "1" : "0");
+  str = rec_sex_eval_str (self->sx, rec->rcd);   
+  result = Py_BuildValue ("z",str);
+  free (str);
+  return result;
+}
+
+
+/* Evaluate the sex on every record of the record set RECSET in a
+   single call, and return a bitmap of the matches as a string of
+   (num_records + 7) / 8 bytes: bit I % 8 of byte I / 8 (least
+   significant bit first) is set if the I-th record matched.  Records
+   for which the evaluation fails don't match.  */
+
+static PyObject*
+sex_eval_many (sex *self, PyObject *args, PyObject *kwds)
+{
+  rset *recset;
+  PyObject *result;
+  unsigned char *bits;
+  rec_mset_iterator_t iter;
+  const void *data;
+  size_t num_records, i = 0;
+  bool status;
+  static char *kwlist[] = {"recset", NULL};
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "O!", kwlist,
+                                    &rsetType, &recset))
+    {
+      return NULL;
+    }
+  num_records = rec_rset_num_records (recset->rst);
+  result = PyString_FromStringAndSize (NULL, (num_records + 7) / 8);
+  if (result == NULL)
+    {
+      return NULL;
+    }
+  bits = (unsigned char *) PyString_AS_STRING (result);
+  memset (bits, 0, (num_records + 7) / 8);
+  iter = rec_mset_iterator (rec_rset_mset (recset->rst));
+  while (i < num_records
+         && rec_mset_iterator_next (&iter, MSET_RECORD, &data, NULL))
+    {
+      if (recutils_sex_eval (self, (rec_record_t) data, &status) && status)
+        bits[i / 8] |= 1 << (i % 8);
+      i++;
+    }
+  rec_mset_iterator_free (&iter);
+  return result;
+}
+
+/*
+ * SEX CACHE
+ *
+ * Compiled sexes shared by expression text and case sensitivity, kept
+ * in least-recently-used order in a doubly linked list.  The dict
+ * SEX_CACHE.MAP maps (expr, case_insensitive) tuples to the address of
+ * the list node holding the sex.
+ */
+
+struct recutils_sex_node_s
+{
+  PyObject *key;
+  PyObject *sex;
+  struct recutils_sex_node_s *prev;
+  struct recutils_sex_node_s *next;
+};
+
+static struct
+{
+  PyObject *map;
+  struct recutils_sex_node_s *head;
+  struct recutils_sex_node_s *tail;
+  size_t size;
+  size_t maxsize;
+  size_t hits;
+  size_t misses;
+} sex_cache = {NULL, NULL, NULL, 0, 128, 0, 0};
+
+static void
+sex_cache_unlink (struct recutils_sex_node_s *node)
+{
+  if (node->prev)
+    node->prev->next = node->next;
+  else
+    sex_cache.head = node->next;
+  if (node->next)
+    node->next->prev = node->prev;
+  else
+    sex_cache.tail = node->prev;
+  node->prev = node->next = NULL;
+}
+
+static void
+sex_cache_push_front (struct recutils_sex_node_s *node)
+{
+  node->prev = NULL;
+  node->next = sex_cache.head;
+  if (sex_cache.head)
+    sex_cache.head->prev = node;
+  sex_cache.head = node;
+  if (sex_cache.tail == NULL)
+    sex_cache.tail = node;
+}
+
+/* Drop least recently used entries until the cache holds at most
+   MAXSIZE sexes.  Sexes still referenced elsewhere stay alive.  */
+
+static void
+sex_cache_trim (size_t maxsize)
+{
+  struct recutils_sex_node_s *node;
+  while (sex_cache.size > maxsize && sex_cache.tail)
+    {
+      node = sex_cache.tail;
+      sex_cache_unlink (node);
+      PyDict_DelItem (sex_cache.map, node->key);
+      Py_DECREF (node->key);
+      Py_DECREF (node->sex);
+      free (node);
+      sex_cache.size--;
+    }
+}
+
+/* Return a compiled sex for EXPR, shared with any other caller asking
+   for the same expression and case sensitivity.  Expressions are
+   compiled only on a cache miss.  Raise recutils.error if EXPR does
+   not compile.  The returned sex must not be recompiled.  */
+
+static PyObject*
+sex_cached (PyObject *cls, PyObject *args, PyObject *kwds)
+{
+  const char *expr;
+  int case_insensitive = 0;
+  PyObject *key, *addr;
+  struct recutils_sex_node_s *node;
+  sex *tmp;
+  static char *kwlist[] = {"expr", "case_insensitive", NULL};
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "s|i", kwlist,
+                                    &expr, &case_insensitive))
+    {
+      return NULL;
+    }
+  if (sex_cache.map == NULL)
+    {
+      sex_cache.map = PyDict_New ();
+      if (sex_cache.map == NULL)
+        return NULL;
+    }
+  key = Py_BuildValue ("(si)", expr, case_insensitive != 0);
+  if (key == NULL)
+    {
+      return NULL;
+    }
+  addr = PyDict_GetItem (sex_cache.map, key);
+  if (addr != NULL)
+    {
+      Py_DECREF (key);
+      node = PyLong_AsVoidPtr (addr);
+      sex_cache_unlink (node);
+      sex_cache_push_front (node);
+      sex_cache.hits++;
+      Py_INCREF (node->sex);
+      return node->sex;
+    }
+
+  sex_cache.misses++;
+  tmp = (sex *) PyObject_CallFunction ((PyObject *) &sexType, "i",
+                                       case_insensitive);
+  if (tmp == NULL)
+    {
+      Py_DECREF (key);
+      return NULL;
+    }
+  if (!rec_sex_compile (tmp->sx, expr))
+    {
+      Py_DECREF (key);
+      Py_DECREF (tmp);
+      PyErr_SetString (RecError, "Invalid selection expression");
+      return NULL;
+    }
+  tmp->expr = strdup (expr);
+  tmp->prog = recutils_program_compile (expr, case_insensitive);
+  tmp->shared = true;
+  if (sex_cache.maxsize == 0)
     {
-      self->sx = rec_sex_new(case_insensitive);
-      
-      if (self->sx == NULL) 
-        {
-           /* Out of memory.  */
-          Py_DECREF (self);
-          return NULL;
-        }
+      Py_DECREF (key);
+      return (PyObject *) tmp;
     }
-  return (PyObject *)self;
-}
 
-/* Destroy a sex, freeing any used resources.  */
-static void
-sex_dealloc (sex* self)
-{
-  rec_sex_destroy (self->sx);
-  self->ob_type->tp_free ((PyObject*)self);
+  node = malloc (sizeof (struct recutils_sex_node_s));
+  addr = node ? PyLong_FromVoidPtr (node) : NULL;
+  if (addr == NULL || PyDict_SetItem (sex_cache.map, key, addr) < 0)
+    {
+      Py_XDECREF (addr);
+      free (node);
+      Py_DECREF (key);
+      Py_DECREF (tmp);
+      return node ? NULL : PyErr_NoMemory ();
+    }
+  Py_DECREF (addr);
+  node->key = key;
+  node->sex = (PyObject *) tmp;
+  Py_INCREF (tmp);
+  sex_cache_push_front (node);
+  sex_cache.size++;
+  sex_cache_trim (sex_cache.maxsize);
+  return (PyObject *) tmp;
 }
 
-/* Compile a sex.  Sexes must be compiled before being used.  If there
-   is a parse error return false.  */
+/* Set the maximum number of sexes kept by the cache.  A size of 0
+   disables caching.  */
 
 static PyObject*
-sex_pycompile (sex *self, PyObject *args, PyObject *kwds)
+sex_set_cache_size (PyObject *cls, PyObject *args, PyObject *kwds)
 {
-  const char *expr;
-  static char *kwlist[] = {"expr",NULL};
-  bool success;
-  if (!PyArg_ParseTupleAndKeywords (args, kwds, "z", kwlist, &expr)) 
+  int maxsize;
+  static char *kwlist[] = {"maxsize", NULL};
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "i", kwlist, &maxsize))
     {
       return NULL;
     }
-  success = rec_sex_compile (self->sx,expr);
-  return Py_BuildValue ("i",success);
+  if (maxsize < 0)
+    {
+      PyErr_SetString (PyExc_ValueError, "maxsize must not be negative");
+      return NULL;
+    }
+  sex_cache.maxsize = maxsize;
+  sex_cache_trim (sex_cache.maxsize);
+  return Py_BuildValue ("");
 }
 
-/* Apply a sex expression to a record, setting STATUS in accordance:
-   'true' if the record matched the sex, 'false' otherwise.  The
-   function returns the same value that is stored in STATUS.  */
+/* Return the cache counters as a dict.  */
 
 static PyObject*
-sex_pyeval (sex *self, PyObject *args, PyObject *kwds)
+sex_cache_info (PyObject *cls)
 {
-  bool status;
-  record *rec;
-  bool success;
-  static char *kwlist[] = {"rec", "status",NULL};
-  if (!PyArg_ParseTupleAndKeywords (args, kwds, "Oi", kwlist, 
-                                    &rec,
-                                    &status))
-    {
-      return NULL; 
-    }
-  success = rec_sex_eval (self->sx, rec->rcd, &status);
-  return Py_BuildValue ("i",success);
+  return Py_BuildValue ("{s:n,s:n,s:n,s:n}",
+                        "hits", (Py_ssize_t) sex_cache.hits,
+                        "misses", (Py_ssize_t) sex_cache.misses,
+                        "size", (Py_ssize_t) sex_cache.size,
+                        "maxsize", (Py_ssize_t) sex_cache.maxsize);
 }
 
-/* Apply a sex expression and get the result as an allocated
-   string.  */
+/* Empty the cache and reset its counters.  */
 
 static PyObject*
-sex_eval_str (sex *self, PyObject *args, PyObject *kwds)
+sex_cache_clear (PyObject *cls)
 {
-  record *rec;
-  char *str;  
-  static char *kwlist[] = {"rec",NULL};
-  if (!PyArg_ParseTupleAndKeywords (args, kwds, "O", kwlist, 
-                                    &rec))
-    {
-    return NULL; 
-    }
-  str = rec_sex_eval_str (self->sx, rec->rcd);   
-  return Py_BuildValue ("z",str);
+  sex_cache_trim (0);
+  sex_cache.hits = 0;
+  sex_cache.misses = 0;
+  return Py_BuildValue ("");
 }
 
-
 /*record doc string */
 static char sex_doc[] =
   "This type refers to the selection expression structure of recutils";
@@ -1390,6 +9199,23 @@ static PyMethodDef sex_methods[] = {
     {"eval_str", (PyCFunction)sex_eval_str, METH_VARARGS,
      "Apply a sex expression and get the result as an allocated string."  
     },
+    {"eval_many", (PyCFunction)sex_eval_many, METH_VARARGS | METH_KEYWORDS,
+     "Evaluate a sex over every record of an rset and return a bitmap of the matches."  
+    },
+    {"cached", (PyCFunction)sex_cached,
+     METH_VARARGS | METH_KEYWORDS | METH_CLASS,
+     "Return a shared compiled sex for an expression, compiling it only on a cache miss."  
+    },
+    {"set_cache_size", (PyCFunction)sex_set_cache_size,
+     METH_VARARGS | METH_KEYWORDS | METH_CLASS,
+     "Set the maximum number of sexes kept by the sex cache."  
+    },
+    {"cache_info", (PyCFunction)sex_cache_info, METH_NOARGS | METH_CLASS,
+     "Return the hit and miss counters and the size of the sex cache."  
+    },
+    {"cache_clear", (PyCFunction)sex_cache_clear, METH_NOARGS | METH_CLASS,
+     "Empty the sex cache and reset its counters."  
+    },
     {NULL}
 };
 
@@ -1717,7 +9543,10 @@ field_new (PyTypeObject *type, PyObject *args, PyObject *kwds)
 static void
 field_dealloc (field* self)
 {
-  rec_field_destroy (self->fld);
+  if (self->owner)
+    Py_DECREF (self->owner);
+  else
+    rec_field_destroy (self->fld);
   self->ob_type->tp_free ((PyObject*)self);
 }
 
@@ -1766,6 +9595,34 @@ field_value (field *self)
 }
 
 
+/* Raise an exception and return 'false' if the borrowed field SELF
+   belongs, through the chain of its owners, to a record set of a
+   database.  Changing it in place would bypass the indexes, the query
+   cache, sync, the write-ahead log and the cursors of the database,
+   which must be modified with recdb.set instead.  */
+
+static bool
+field_check_writable (field *self)
+{
+  PyObject *owner = self->owner;
+  while (owner)
+    {
+      if (PyObject_TypeCheck (owner, &recdbType))
+        {
+          PyErr_SetString (RecError, "field owned by a database,"
+                           " use recdb.set to modify it");
+          return false;
+        }
+      if (PyObject_TypeCheck (owner, &recordType))
+        owner = ((record *) owner)->owner;
+      else if (PyObject_TypeCheck (owner, &rsetType))
+        owner = ((rset *) owner)->owner;
+      else
+        break;
+    }
+  return true;
+}
+
 /* Set the name of a field.  This function returns 'false' if there is
    not enough memory to perform the operation.  */
 
@@ -1779,6 +9636,10 @@ field_set_name (field *self, PyObject *args, PyObject *kwds)
     {
       return NULL;
     }
+  if (!field_check_writable (self))
+    {
+      return NULL;
+    }
   success = rec_field_set_name (self->fld, name);
   if (!success)
     {
@@ -1802,6 +9663,10 @@ field_set_value (field *self, PyObject *args, PyObject *kwds)
     {
       return NULL;
     }
+  if (!field_check_writable (self))
+    {
+      return NULL;
+    }
   success = rec_field_set_value (self->fld, value);
   if (!success)
     {
@@ -2225,6 +10090,543 @@ static PyTypeObject bufferType = {
 };
 
 
+/*
+ * STREAMING SCANNER
+ *
+ * A scanner walks a recfile record by record, without building a
+ * database, and yields the records matching a selection expression.
+ */
+
+/* Scan the file FILENAME for records of type TYPE (None for the
+   default record set) matching SEXP, yielding them one by one.  If
+   SEXP is None every record matches.  If FEXP is not None the yielded
+   records only contain the fields selected by it.  Only one record is
+   held in memory at any time.  */
+
+static PyObject*
+recutils_scan (PyObject *self, PyObject *args, PyObject *kwds)
+{
+  const char *filename;
+  const char *type;
+  PyObject *sexp = Py_None;
+  PyObject *fexp = Py_None;
+  scanner *tmp;
+  FILE *in;
+  static char *kwlist[] = {"filename", "type", "sexp", "fexp", NULL};
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "sz|OO", kwlist,
+                                    &filename, &type, &sexp, &fexp))
+    {
+      return NULL;
+    }
+  in = fopen (filename, "r");
+  if (in == NULL)
+    {
+      PyErr_SetString (RecError, strerror (errno));
+      return NULL;
+    }
+  tmp = PyObject_NEW (scanner, &scannerType);
+  if (tmp == NULL)
+    {
+      fclose (in);
+      return NULL;
+    }
+  tmp->in = in;
+  tmp->parser = rec_parser_new (in, filename);
+  tmp->type = type ? strdup (type) : NULL;
+  tmp->cur_type = NULL;
+  tmp->sexp = sexp;
+  Py_INCREF (sexp);
+  tmp->fexp = fexp;
+  Py_INCREF (fexp);
+  tmp->done = false;
+  if (tmp->parser == NULL || (type && tmp->type == NULL))
+    {
+      Py_DECREF (tmp);
+      return PyErr_NoMemory ();
+    }
+  return (PyObject *) tmp;
+}
+
+static void
+scanner_dealloc (scanner *self)
+{
+  if (self->parser)
+    rec_parser_destroy (self->parser);
+  fclose (self->in);
+  free (self->type);
+  free (self->cur_type);
+  Py_DECREF (self->sexp);
+  Py_DECREF (self->fexp);
+  self->ob_type->tp_free ((PyObject*) self);
+}
+
+/* If RECORD is a record descriptor set the current type of the
+   scanner from its %rec field and return 'true'.  */
+
+static bool
+scanner_descriptor_p (scanner *self, rec_record_t record)
+{
+  rec_field_t fld;
+  const char *value;
+  size_t len;
+  fld = rec_record_get_field_by_name (record, "%rec", 0);
+  if (fld == NULL)
+    return false;
+  value = rec_field_value (fld);
+  value += strspn (value, " \t");
+  len = strcspn (value, " \t\n");
+  free (self->cur_type);
+  self->cur_type = strndup (value, len);
+  return true;
+}
+
+/* Return the next matching record, or NULL once the file has been
+   exhausted.  */
+
+static PyObject*
+scanner_next (scanner *self)
+{
+  rec_record_t rec;
+  sex *sx = NULL;
+  rec_fex_t fx = NULL;
+  bool in_rset, status;
+  record *tmp;
+
+  if (self->sexp != Py_None)
+    sx = (sex *) self->sexp;
+  if (self->fexp != Py_None)
+    fx = ((fex *) self->fexp)->fx;
+
+  while (!self->done)
+    {
+      if (!rec_parse_record (self->parser, &rec))
+        {
+          self->done = true;
+          if (rec_parser_error (self->parser))
+            {
+              rec_parser_perror (self->parser, "scan");
+              PyErr_SetString (RecError, "parse error");
+            }
+          return NULL;
+        }
+      if (scanner_descriptor_p (self, rec))
+        {
+          rec_record_destroy (rec);
+          continue;
+        }
+      in_rset = (self->type == NULL && self->cur_type == NULL)
+        || (self->type && self->cur_type
+            && strcmp (self->type, self->cur_type) == 0);
+      if (!in_rset)
+        {
+          rec_record_destroy (rec);
+          continue;
+        }
+      if (sx && (!recutils_sex_eval (sx, rec, &status) || !status))
+        {
+          rec_record_destroy (rec);
+          continue;
+        }
+      if (fx)
+        {
+          rec_record_t projected = recutils_record_project (rec, fx);
+          rec_record_destroy (rec);
+          if (projected == NULL)
+            return PyErr_NoMemory ();
+          rec = projected;
+        }
+      tmp = PyObject_NEW (record, &recordType);
+      if (tmp == NULL)
+        {
+          rec_record_destroy (rec);
+          return NULL;
+        }
+      tmp->rcd = rec;
+      tmp->owner = NULL;
+      return (PyObject *) tmp;
+    }
+  return NULL;
+}
+
+/*scanner doc string */
+static char scanner_doc[] =
+  "Generator yielding the records of a recfile matching a selection expression.";
+
+/* Define the scanner object type */
+static PyTypeObject scannerType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "recutils.scanner",        /*tp_name*/
+    sizeof(scanner),           /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)scanner_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    scanner_doc,               /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    PyObject_SelfIter,         /* tp_iter */
+    (iternextfunc)scanner_next, /* tp_iternext */
+};
+
+
+/*
+ * RECORD OFFSETS
+ *
+ * read_record reads the record N of a record set of a file without
+ * parsing anything else.  It relies on a sidecar file, FILE.recidx,
+ * holding the byte offset of every record of every record set of
+ * FILE, which is built, or rebuilt when FILE has changed, on demand.
+ *
+ * The sidecar starts with a header holding the size and modification
+ * time in nanoseconds of FILE when it was indexed.  Then comes a
+ * directory with, for each record set, the position of its first
+ * offset, its number of records and its type, and finally the
+ * offsets, as 64-bit numbers.  Reading a record thus takes reading
+ * the header and the directory, one offset, and the record.
+ */
+
+#define RECUTILS_RECIDX_MAGIC "RECIDX1\n"
+
+struct recutils_recidx_header_s
+{
+  char magic[8];
+  unsigned long long size;
+  long long mtime;
+  unsigned long long dir_size;
+  unsigned long long num_records;
+};
+
+/* Add the directory entry of the record set of type TYPE, of TYPE_LEN
+   bytes or NULL, whose offsets start at FIRST, to DIR.  */
+
+static void
+recutils_recidx_put_rset (struct recutils_buf_s *dir, const char *type,
+                          size_t type_len, unsigned long long first,
+                          unsigned long long count)
+{
+  unsigned int len = type ? type_len : RECUTILS_BUF_NULL;
+  recutils_buf_put (dir, &first, sizeof (first));
+  recutils_buf_put (dir, &count, sizeof (count));
+  recutils_buf_put (dir, &len, sizeof (len));
+  if (type)
+    {
+      recutils_buf_put (dir, type, type_len);
+      recutils_buf_put (dir, "", 1);
+    }
+}
+
+/* Index the SIZE bytes of rec data at DATA, storing the directory in
+   DIR and the offsets in OFFSETS.  Records are the paragraphs holding
+   fields, and their offset is that of their first field, leaving out
+   the comments before it.  A paragraph holding a %rec field is the
+   descriptor of a new record set.  */
+
+static void
+recutils_recidx_scan (const char *data, size_t size,
+                      struct recutils_buf_s *dir,
+                      struct recutils_buf_s *offsets)
+{
+  const char *end = data + size, *line, *eol, *p;
+  const char *type = NULL, *new_type = NULL;
+  size_t type_len = 0, new_type_len = 0;
+  unsigned long long first = 0, count = 0, offset = 0;
+  bool continued = false, fields = false, descriptor = false;
+  bool rsets = false;
+
+  for (line = data; ; line = eol < end ? eol + 1 : end)
+    {
+      eol = line < end ? memchr (line, '\n', end - line) : NULL;
+      if (eol == NULL)
+        eol = end;
+      if (line == end || (!continued && recutils_lazy_blank_p (line, eol)))
+        {
+          /* End of a paragraph.  */
+          if (descriptor)
+            {
+              if (rsets)
+                recutils_recidx_put_rset (dir, type, type_len, first, count);
+              rsets = true;
+              type = new_type;
+              type_len = new_type_len;
+              first += count;
+              count = 0;
+            }
+          else if (fields)
+            {
+              rsets = true;
+              recutils_buf_put (offsets, &offset, sizeof (offset));
+              count++;
+            }
+          fields = descriptor = false;
+          if (line == end)
+            break;
+        }
+      else if (!continued && line[0] != '#')
+        {
+          if (!fields)
+            offset = line - data;
+          fields = true;
+          if (eol - line > 5 && memcmp (line, "%rec:", 5) == 0)
+            {
+              descriptor = true;
+              for (p = line + 5; p < eol && (*p == ' ' || *p == '\t'); p++)
+                ;
+              new_type = p;
+              for (; p < eol && !isspace ((unsigned char) *p); p++)
+                ;
+              new_type_len = p - new_type;
+            }
+        }
+      continued = eol > line && eol[-1] == '\\';
+    }
+  if (rsets)
+    recutils_recidx_put_rset (dir, type, type_len, first, count);
+}
+
+/* Look for the record set of type TYPE in the directory DIR of SIZE
+   bytes.  Store the position of its first offset and its number of
+   records in *FIRST and *COUNT.  */
+
+static bool
+recutils_recidx_find (const char *dir, size_t size, const char *type,
+                      unsigned long long *first, unsigned long long *count)
+{
+  const char *p = dir, *end = dir + size, *rset_type;
+  while (recutils_buf_get (&p, end, first, sizeof (*first))
+         && recutils_buf_get (&p, end, count, sizeof (*count))
+         && recutils_buf_get_str (&p, end, &rset_type))
+    if (recutils_type_equal_p (rset_type, type))
+      return true;
+  return false;
+}
+
+/* Write the sidecar SIDECAR, replacing it atomically.  Errors are
+   ignored, since the sidecar can be built again.  */
+
+static void
+recutils_recidx_write (const char *sidecar,
+                       struct recutils_recidx_header_s *header,
+                       struct recutils_buf_s *dir,
+                       struct recutils_buf_s *offsets)
+{
+  char *tmpname;
+  FILE *out;
+  int fd;
+  bool success;
+
+  tmpname = malloc (strlen (sidecar) + sizeof (".XXXXXX"));
+  if (tmpname == NULL)
+    return;
+  strcpy (tmpname, sidecar);
+  strcat (tmpname, ".XXXXXX");
+  fd = mkstemp (tmpname);
+  if (fd >= 0)
+    {
+      out = fdopen (fd, "w");
+      if (out == NULL)
+        close (fd);
+      success = out
+        && fwrite (header, sizeof (*header), 1, out) == 1
+        && (dir->size == 0 || fwrite (dir->data, dir->size, 1, out) == 1)
+        && (offsets->size == 0
+            || fwrite (offsets->data, offsets->size, 1, out) == 1);
+      if (out && fclose (out) != 0)
+        success = false;
+      if (!success || rename (tmpname, sidecar) != 0)
+        unlink (tmpname);
+    }
+  free (tmpname);
+}
+
+/* Find the byte offset of the record N of type TYPE of the file
+   FILENAME, indexing it if needed.  Store in *FOUND whether there is
+   such a record.  Return 0 or an errno value.  */
+
+static int
+recutils_recidx_offset (const char *filename, const char *type, size_t n,
+                        off_t *offset, bool *found)
+{
+  struct recutils_recidx_header_s header, stamp;
+  struct recutils_buf_s dir = { NULL, 0, 0, false };
+  struct recutils_buf_s offsets = { NULL, 0, 0, false };
+  unsigned long long first, count, value;
+  struct stat st;
+  char *sidecar, *data;
+  size_t size;
+  int fd, err = 0;
+
+  *found = false;
+  if (stat (filename, &st) != 0)
+    return errno;
+  memset (&stamp, 0, sizeof (stamp));
+  memcpy (stamp.magic, RECUTILS_RECIDX_MAGIC, sizeof (stamp.magic));
+  stamp.size = st.st_size;
+  stamp.mtime = (long long) st.st_mtim.tv_sec * 1000000000
+    + st.st_mtim.tv_nsec;
+  sidecar = malloc (strlen (filename) + sizeof (".recidx"));
+  if (sidecar == NULL)
+    return ENOMEM;
+  strcpy (sidecar, filename);
+  strcat (sidecar, ".recidx");
+
+  fd = open (sidecar, O_RDONLY);
+  if (fd >= 0
+      && pread (fd, &header, sizeof (header), 0) == sizeof (header)
+      && memcmp (header.magic, stamp.magic, sizeof (header.magic)) == 0
+      && header.size == stamp.size && header.mtime == stamp.mtime
+      && (dir.data = malloc (header.dir_size + 1)) != NULL
+      && pread (fd, dir.data, header.dir_size, sizeof (header))
+         == (ssize_t) header.dir_size)
+    {
+      /* The sidecar is fresh.  */
+      if (recutils_recidx_find (dir.data, header.dir_size, type,
+                                &first, &count)
+          && n < count)
+        {
+          if (pread (fd, &value, sizeof (value),
+                     sizeof (header) + header.dir_size
+                     + (first + n) * sizeof (value)) != sizeof (value))
+            err = EIO;
+          else
+            {
+              *offset = value;
+              *found = true;
+            }
+        }
+      close (fd);
+      free (dir.data);
+      free (sidecar);
+      return err;
+    }
+  if (fd >= 0)
+    close (fd);
+  free (dir.data);
+  dir.data = NULL;
+
+  err = recutils_map_file (filename, &data, &size, NULL);
+  if (err == 0)
+    {
+      recutils_recidx_scan (data, size, &dir, &offsets);
+      if (size > 0)
+        munmap (data, size);
+      if (dir.nomem || offsets.nomem)
+        err = ENOMEM;
+      else
+        {
+          stamp.dir_size = dir.size;
+          stamp.num_records = offsets.size / sizeof (value);
+          recutils_recidx_write (sidecar, &stamp, &dir, &offsets);
+          if (recutils_recidx_find (dir.data, dir.size, type, &first, &count)
+              && n < count)
+            {
+              memcpy (&value, offsets.data + (first + n) * sizeof (value),
+                      sizeof (value));
+              *offset = value;
+              *found = true;
+            }
+        }
+    }
+  free (dir.data);
+  free (offsets.data);
+  free (sidecar);
+  return err;
+}
+
+/* Return the record N, counting from 0, of type TYPE (None for the
+   default record set) of the file FILENAME, or None if there is no
+   such record.  See RECORD OFFSETS.  */
+
+static PyObject *
+recutils_read_record (PyObject *self, PyObject *args, PyObject *kwds)
+{
+  const char *filename;
+  const char *type;
+  Py_ssize_t n;
+  off_t offset = 0;
+  bool found;
+  rec_parser_t parser;
+  rec_record_t rec = NULL;
+  FILE *in;
+  int err;
+  record *tmp;
+  static char *kwlist[] = {"filename", "type", "n", NULL};
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "szn", kwlist,
+                                    &filename, &type, &n))
+    {
+      return NULL;
+    }
+  if (n < 0)
+    {
+      PyErr_SetString (PyExc_ValueError, "n must not be negative");
+      return NULL;
+    }
+
+  Py_BEGIN_ALLOW_THREADS
+  err = recutils_recidx_offset (filename, type, n, &offset, &found);
+  if (err == 0 && found)
+    {
+      in = fopen (filename, "r");
+      if (in == NULL || fseeko (in, offset, SEEK_SET) != 0)
+        err = errno;
+      else
+        {
+          parser = rec_parser_new (in, filename);
+          if (parser == NULL)
+            err = ENOMEM;
+          else
+            {
+              if (!rec_parse_record (parser, &rec))
+                rec = NULL;
+              rec_parser_destroy (parser);
+            }
+        }
+      if (in)
+        fclose (in);
+    }
+  Py_END_ALLOW_THREADS
+
+  if (err)
+    {
+      PyErr_SetString (RecError, strerror (err));
+      return NULL;
+    }
+  if (!found)
+    {
+      return Py_BuildValue ("");
+    }
+  if (rec == NULL)
+    {
+      PyErr_SetString (RecError, "parse error");
+      return NULL;
+    }
+  tmp = PyObject_NEW (record, &recordType);
+  if (tmp == NULL)
+    {
+      rec_record_destroy (rec);
+      return NULL;
+    }
+  tmp->rcd = rec;
+  tmp->owner = NULL;
+  return (PyObject *) tmp;
+}
+
+
 static char recutils_doc[] =
   "This module provides bindings to the librec library (GNU recutils).";
 
@@ -2236,6 +10638,13 @@ static PyMethodDef recutils_methods[] = {
     {"comment_equal_p", (PyCFunction)recutils_comment_equal_p, METH_VARARGS,
      "Determine whether the texts stored in two given comments are equal."  
     },
+    {"scan", (PyCFunction)recutils_scan, METH_VARARGS | METH_KEYWORDS,
+     "Yield the records of a given type in a file matching a selection expression."  
+    },
+    {"read_record", (PyCFunction)recutils_read_record,
+     METH_VARARGS | METH_KEYWORDS,
+     "Read a record of a file by number, through a sidecar offset index."
+    },
     {NULL}  /* Sentinel */
 };
 
@@ -2248,6 +10657,8 @@ initrecutils (void)
 {
     PyObject* m;
 
+    recutils_search_init ();
+
     if (PyType_Ready (&recdbType) < 0)
         return;
 
@@ -2272,6 +10683,18 @@ initrecutils (void)
     if (PyType_Ready (&bufferType) < 0)
         return; 
 
+    if (PyType_Ready (&msetiterType) < 0)
+        return; 
+
+    if (PyType_Ready (&scannerType) < 0)
+        return; 
+
+    if (PyType_Ready (&columnType) < 0)
+        return; 
+
+    if (PyType_Ready (&cursorType) < 0)
+        return; 
+
     m = Py_InitModule3 ("recutils", recutils_methods, recutils_doc);
 
     if (m == NULL)
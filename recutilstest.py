@@ -13,6 +13,13 @@ print "Created db"
 db2 = pyrec.Recdb()
 db2.loadfile("books.rec")
 print "Created db2"
+db5 = recutils.recdb()
+db5.load_many(["books.rec", "account.rec"], threads=2)
+print "Created db5 from several files, size = ", db5.size()
+try:
+	db5.load_many(["account.rec"]) #Should get duplicate rset error
+except recutils.error as e:
+	print e
 
 print "CREATE TWO FIELDS"
 fl1 = recutils.field("Author", "Richard M. Stallman")
@@ -84,6 +91,10 @@ print "\nCREATE THE SEXES & FEXES"
 sex1 = pyrec.RecSex(1)
 b = sex1.pycompile("Location = 'home'")
 print "Sex compiled success = ",b
+sex2 = recutils.sex.cached("Location = 'home'", 1)
+sex3 = recutils.sex.cached("Location = 'home'", 1)
+print "Cached sexes shared = ", sex2 is sex3
+print "Sex cache info = ", recutils.sex.cache_info()
 fexe1 = pyrec.Fexenum.REC_FEX_SIMPLE
 fex1 = recutils.fex("Author",fexe1)
 
@@ -92,6 +103,13 @@ print "Query for a record set consisting of the list of Authors of books at home
 queryrset = db.query("Book", None, None, sex1, None, 10, fex1, None, None, None, 0)
 num_rec = queryrset.num_records()
 print "Number of queried records = ",num_rec
+queryrset2 = db.query("Book", None, None, sex1, None, 0, fex1, None, None, None, 0, threads=2)
+print "Same records with 2 threads = ", queryrset2.num_records() == db.query("Book", None, None, sex1, None, 0, fex1, None, None, None, 0).num_records()
+
+db.set_query_cache_size(16)
+db.query("Book", None, None, sex1, None, 0, fex1, None, None, None, 0)
+db.query("Book", None, None, sex1, None, 0, fex1, None, None, None, 0)
+print "Query cache info = ", db.query_cache_info()
 
 print "\nINSERTING QUERIED RSET"
 db2.insert_rset(queryrset,2);
@@ -117,6 +135,98 @@ ins = db.delete("Account", None, None, None, 1, 0)
 print "Delete success? - check \"books_account_del.rec\"", ins
 flag4 = db.writefile("books_account_del.rec")
 
+print "\nSYNCING TO A FILE"
+db6 = recutils.recdb()
+db6.pyloadfile("books.rec")
+db6.pywritefile("books_sync.rec")
+print "Unchanged db appended to file = ", db6.sync("books_sync.rec")
+print "Other file appended to = ", db6.sync("books_sync2.rec")
+db6.pywritefile("books_sync.rec", atomic=True, fsync="data")
+print "Atomic write appended to = ", db6.sync("books_sync.rec")
+
+print "\nLOGGING MUTATIONS TO A WRITE-AHEAD LOG"
+print "Replayed entries of a new log = ", db6.open_wal("books_sync.wal")
+db6.delete("Book", None, sex1, None, 0, 0)
+db6.close_wal()
+db7 = recutils.recdb()
+db7.pyloadfile("books_sync.rec")
+print "Replayed entries = ", db7.open_wal("books_sync.wal")
+print "Same records as the logged db = ", db7.get_rset_by_type("Book").num_records() == db6.get_rset_by_type("Book").num_records()
+db7.compact_wal()
+db7.close_wal()
+print "Replayed entries after compaction = ", db7.open_wal("books_sync.wal")
+print "Base of the log appended to = ", db7.sync("books_sync.rec")
+db7.delete("Book", None, sex1, None, 0, 0)
+db7.close_wal()
+touched = open("books_sync.rec", "a")
+touched.write("\n# Touched behind the log\n")
+touched.close()
+db11 = recutils.recdb()
+db11.pyloadfile("books_sync.rec")
+try:
+	db11.open_wal("books_sync.wal")
+	print "Log for another version of the base opened"
+except recutils.error:
+	print "Log for another version of the base refused"
+print "Replayed entries after discarding = ", db11.open_wal("books_sync.wal", discard=True)
+db11.close_wal()
+
+print "\nSAVING AND LOADING A SNAPSHOT"
+db7.save_snapshot("books_sync.snap")
+db8 = recutils.recdb()
+db8.load_snapshot("books_sync.snap")
+print "Same records as the saved db = ", db8.size() == db7.size() and db8.get_rset_by_type("Book").num_records() == db7.get_rset_by_type("Book").num_records()
+
+print "\nLOADING RECORD SETS LAZILY"
+db9 = recutils.recdb()
+db9.pyloadfile("books.rec", lazy=True)
+print "Size before parsing = ", db9.size()
+db10 = recutils.recdb()
+db10.pyloadfile("books.rec")
+print "Same records as an eager load = ", db9.get_rset_by_type("Book").num_records() == db10.get_rset_by_type("Book").num_records()
+lazyfile = open("books_lazy.rec", "w")
+lazyfile.write(open("books.rec").read())
+lazyfile.close()
+db12 = recutils.recdb()
+db12.pyloadfile("books_lazy.rec", lazy=True)
+lazyfile = open("books_lazy.rec", "w")
+lazyfile.write("%rec: Book\n\nTitle: Rewritten\n")
+lazyfile.close()
+try:
+	db12.get_rset_by_type("Book")
+	print "Record set parsed from a file modified in place"
+except recutils.error:
+	print "Record set of a file modified in place refused"
+
+print "\nLOADING A FILE WITH A DUPLICATED RECORD SET"
+dupfile = open("books_dup.rec", "w")
+dupfile.write("%rec: Book\n\nTitle: A\n\n%rec: Book\n\nTitle: B\n")
+dupfile.close()
+for lazy in [False, True]:
+	try:
+		recutils.recdb().pyloadfile("books_dup.rec", lazy=lazy)
+		print "Loaded (lazy=%s)" % lazy
+	except recutils.error:
+		print "Refused (lazy=%s)" % lazy
+
+print "\nINVALIDATING A CURSOR"
+cur = db10.cursor("Book")
+print "First page = ", cur.fetch(1).num_records()
+db10.delete("Book", None, None, None, 1, 0)
+try:
+	cur.fetch(1)
+	print "Cursor still valid after delete"
+except recutils.error:
+	print "Cursor invalidated by delete"
+
+print "\nMODIFYING A FIELD OWNED BY A DATABASE"
+owned = list(list(db10.get_rset_by_type("Book"))[0])[0]
+try:
+	owned.set_value("Changed in place")
+	print "Field of the database modified in place"
+except recutils.error:
+	print "Field of the database refused"
+
 print "\nCALLING SET FUNCTION"
 print "Change the authors of all books at home to J.R.R. Tolkien"
 
@@ -29,7 +29,7 @@ setup(
     py_modules=['pyrec'],
     ext_modules = [
         Extension('recutils', ['recutils.c'],
-                  libraries = [ 'rec' ],
+                  libraries = [ 'rec', 'pthread' ],
                   ),
       ],
 ) 